@@ -0,0 +1,224 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "pfc.h"
+#include "profiler.h"
+
+#include <sys/stat.h> // mkdir
+
+using namespace std;
+
+/*
+ *  Benchmarks of the PhaseField engine
+ *
+ *  Usage:
+ *    pfc-bench micro [n1 n2 ...]             kernels on n x n grids (default 128 256 512)
+ *    pfc-bench circle <nx> <ny> <od_steps>   circle shrinkage: OD steps + equilibration
+ *    pfc-bench seeds <nx> <ny> <od_steps>    multi-seed growth: OD steps only
+ *
+ *  Arguments key=value override parameters (e.g. simd=scalar).
+ *  Every result is printed by root as one JSON object per line.
+ */
+
+// minimum measuring time and repetitions of a microbenchmark
+const double min_bench_time = 0.5;
+const int    min_bench_reps = 3;
+
+// end-to-end scenarios: OD steps per equilibration and fixed number of
+// L-BFGS iterations, so that the work doesn't depend on convergence
+const int    scenario_od_block = 80;
+const int    scenario_lbfgs_iterations = 20;
+
+const std::string bench_output_path = "./output/bench/";
+
+class Benchmark {
+    PhaseField &pfc;
+
+    /*! Time per call of "func" (max over processes), repeated at least
+     *  min_bench_reps times and for min_bench_time seconds
+     */
+    template <typename Func>
+    double measure(Func func, int *reps_out) {
+        int reps = 0;
+        double start = MPI_Wtime(), elapsed = 0.0;
+        do {
+            func();
+            reps++;
+            double local = MPI_Wtime() - start;
+            // all processes must agree on the number of repetitions
+            MPI_Allreduce(&local, &elapsed, 1, MPI_DOUBLE, MPI_MAX, pfc.comm);
+        } while (reps < min_bench_reps || elapsed < min_bench_time);
+        *reps_out = reps;
+        return elapsed/reps;
+    }
+
+    void report(const char *name, double time_per_call, int reps, double ffts_per_call,
+            double extra_bytes = 0.0) {
+        if (pfc.mpi_rank != 0) return;
+        double cells = (double) pfc.nx*pfc.ny;
+        printf("{\"bench\": \"%s\", \"nx\": %d, \"ny\": %d, \"processes\": %d, "
+               "\"kernels\": \"%s\", \"reps\": %d, \"time_per_call\": %.6e, "
+               "\"cell_updates_per_s\": %.6e, \"ffts_per_s\": %.6e", name, pfc.nx, pfc.ny,
+               pfc.mpi_size, ::kernels(pfc.lattice.type).name, reps, time_per_call, cells/time_per_call,
+               ffts_per_call/time_per_call);
+        if (extra_bytes > 0.0)
+            printf(", \"bytes_per_s\": %.6e", extra_bytes/time_per_call);
+        printf("}\n");
+        fflush(stdout);
+    }
+
+public:
+    Benchmark(PhaseField &pfc_) : pfc(pfc_) {}
+
+    void kernels() {
+        PhaseField &p = pfc;
+        int reps;
+        double t;
+
+        p.initialize_eta_circle();
+        p.take_fft(p.eta_plan_f);
+
+        t = measure([&p]() { p.take_fft(p.eta_plan_f); }, &reps);
+        report("take_fft", t, reps, p.nc);
+
+        t = measure([&p]() { p.overdamped_time_step(); }, &reps);
+        report("overdamped_time_step", t, reps, 2*p.nc);
+
+        // eta_k is unchanged, only the memoized results are dropped
+        t = measure([&p]() {
+            p.invalidate_cache();
+            p.calculate_grad_theta(p.eta, p.eta_k);
+        }, &reps);
+        report("calculate_grad_theta", t, reps, p.nc);
+
+        t = measure([&p]() {
+            p.invalidate_cache();
+            p.calculate_energy(p.eta, p.eta_k);
+        }, &reps);
+        report("calculate_energy", t, reps, p.nc);
+
+        // one L-BFGS iteration: step, FFT, gradient and the direction update;
+        // lbfgs stops early at the tolerance or when failing, it returns the
+        // index of the last step then
+        const int lbfgs_its = 10;
+        long steps = 0;
+        t = measure([&p, lbfgs_its, &steps]() {
+            steps += std::min(p.mech_eq.lbfgs(lbfgs_its, false) + 1, lbfgs_its);
+        }, &reps);
+        report("lbfgs_iteration", t*reps/steps, reps, 2*p.nc);
+
+        mkdir(bench_output_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        std::string file = bench_output_path + "bench_" + to_string(p.nx) + ".pfc";
+        uint64_t bytes = 0;
+        t = measure([&p, &file, &bytes]() {
+            // lossless keyframes: every call writes the full field
+            SnapshotOptions options;
+            options.delta = false;
+            p.snapshot_writer.set_options(options);
+            bytes = p.write_eta_to_snapshot(file, 0);
+        }, &reps);
+        report("snapshot_write", t, reps, 0, bytes);
+
+        t = measure([&p, &file]() { p.read_eta_from_snapshot(file); }, &reps);
+        report("snapshot_read", t, reps, 0, bytes);
+
+        if (p.mpi_rank == 0) std::remove(file.c_str());
+    }
+
+    /*! End-to-end scenario, reports throughput of the whole run */
+    void scenario(std::string name, int od_steps) {
+        PhaseField &p = pfc;
+        bool circle = (name == "circle");
+        if (circle) p.initialize_eta_circle();
+        else p.initialize_eta_multiple_seeds();
+        p.take_fft(p.eta_plan_f);
+
+        double ffts_start = Profiler::count("fft_transforms");
+        MPI_Barrier(p.comm);
+        double start = MPI_Wtime();
+
+        for (int ts = 0; ts < od_steps; ts++) {
+            p.overdamped_time_step();
+            if (circle && (ts+1) % scenario_od_block == 0)
+                p.mech_eq.lbfgs(scenario_lbfgs_iterations, false);
+        }
+
+        double local = MPI_Wtime() - start, elapsed = 0.0;
+        MPI_Allreduce(&local, &elapsed, 1, MPI_DOUBLE, MPI_MAX, pfc.comm);
+        double ffts = Profiler::count("fft_transforms") - ffts_start;
+
+        if (p.mpi_rank == 0) {
+            printf("{\"scenario\": \"%s\", \"nx\": %d, \"ny\": %d, \"processes\": %d, "
+                   "\"kernels\": \"%s\", \"backend\": \"%s\", \"od_steps\": %d, "
+                   "\"time\": %.6e, \"cell_updates_per_s\": %.6e, \"ffts_per_s\": %.6e}\n",
+                   name.c_str(), p.nx, p.ny, p.mpi_size, ::kernels(p.lattice.type).name,
+                   p.fd.active() ? "finite_difference" : "spectral", od_steps, elapsed,
+                   (double) p.nx*p.ny*od_steps/elapsed, ffts/elapsed);
+            fflush(stdout);
+        }
+    }
+};
+
+
+/*! Splits the arguments to key=value parameter overrides and the rest */
+static bool parse_arguments(int argc, char **argv, PhaseFieldParameters &params,
+        vector<string> &args) {
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        size_t eq = arg.find('=');
+        if (eq == string::npos) {
+            args.push_back(arg);
+        } else if (!params.set(arg.substr(0, eq), arg.substr(eq+1))) {
+            cerr << "Error: invalid parameter " << arg << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+
+    MPI_Init(&argc, &argv);
+
+    int mpi_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+    PhaseFieldParameters params;
+    vector<string> args;
+    bool valid = parse_arguments(argc, argv, params, args);
+    std::string mode = args.empty() ? "micro" : args[0];
+
+    mkdir("./output", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    if (valid && mode == "micro") {
+        vector<int> sizes;
+        for (unsigned int a = 1; a < args.size(); a++) sizes.push_back(atoi(args[a].c_str()));
+        if (sizes.empty()) {
+            sizes.push_back(128); sizes.push_back(256); sizes.push_back(512);
+        }
+        for (unsigned int s = 0; s < sizes.size(); s++) {
+            params.nx = params.ny = sizes[s];
+            PhaseField pfc(MPI_COMM_WORLD, "./output/", params);
+            Benchmark(pfc).kernels();
+        }
+    } else if (valid && (mode == "circle" || mode == "seeds") && args.size() == 4) {
+        params.nx = atoi(args[1].c_str());
+        params.ny = atoi(args[2].c_str());
+        PhaseField pfc(MPI_COMM_WORLD, "./output/", params);
+        Benchmark(pfc).scenario(mode, atoi(args[3].c_str()));
+    } else if (mpi_rank == 0) {
+        cerr << "Usage: pfc-bench micro [n ...] | circle <nx> <ny> <od_steps> | "
+                "seeds <nx> <ny> <od_steps> [key=value ...]" << endl;
+    }
+
+    MPI_Finalize();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+"""
+Strong and weak scaling driver for the end-to-end benchmark scenarios
+
+Runs "pfc-bench <scenario>" at several process counts and writes the
+throughput and parallel efficiency (relative to the smallest process count)
+to a JSON file.
+
+    python bench/scaling.py --ranks 1 2 4 8 --nx 512 --ny 512 --steps 160
+
+Strong scaling keeps the grid fixed, weak scaling grows nx with the process
+count so that the cells per process stay constant.
+"""
+
+import argparse
+import json
+import subprocess
+import sys
+
+
+def run_scenario(args, scenario, ranks, nx, ny):
+    cmd = args.mpirun.split() + ["-n", str(ranks), args.bench,
+                                 scenario, str(nx), str(ny), str(args.steps)]
+    print(" ".join(cmd), file=sys.stderr)
+    output = subprocess.run(cmd, check=True, stdout=subprocess.PIPE,
+                            universal_newlines=True).stdout
+    for line in output.splitlines():
+        if line.startswith("{"):
+            return json.loads(line)
+    raise RuntimeError("no result from: " + " ".join(cmd))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--mpirun", default="mpirun")
+    parser.add_argument("--bench", default="bin/pfc-bench")
+    parser.add_argument("--ranks", type=int, nargs="+", default=[1, 2, 4, 8])
+    parser.add_argument("--scenarios", nargs="+", default=["circle", "seeds"])
+    parser.add_argument("--nx", type=int, default=512)
+    parser.add_argument("--ny", type=int, default=512)
+    parser.add_argument("--steps", type=int, default=160)
+    parser.add_argument("--output", default="output/scaling.json")
+    args = parser.parse_args()
+
+    results = []
+    for scenario in args.scenarios:
+        for mode in ["strong", "weak"]:
+            base = None
+            for ranks in sorted(args.ranks):
+                nx = args.nx
+                if mode == "weak":
+                    nx = args.nx*ranks//min(args.ranks)
+                res = run_scenario(args, scenario, ranks, nx, args.ny)
+                res["scaling"] = mode
+                if base is None:
+                    base = res
+                if mode == "strong":
+                    res["efficiency"] = (base["time"]*base["processes"]
+                                         / (res["time"]*res["processes"]))
+                else:
+                    res["efficiency"] = base["time"]/res["time"]
+                results.append(res)
+                print("%-7s %-6s P=%4d nx=%6d time=%9.3f s  cells/s=%.3e  "
+                      "FFTs/s=%.3e  efficiency=%.3f"
+                      % (scenario, mode, ranks, nx, res["time"],
+                         res["cell_updates_per_s"], res["ffts_per_s"],
+                         res["efficiency"]))
+
+    with open(args.output, "w") as f:
+        json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,48 @@
+#ifndef DEFECT_DETECTION_H
+#define DEFECT_DETECTION_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// forward declaration
+class PhaseField;
+
+/*! A dislocation core: the plaquette with a nonzero phase winding */
+struct Dislocation {
+    double x, y;            //!< plaquette centre, x = (i+1/2) dx, y = (j+1/2) dy
+    double burgers[2];      //!< Burgers vector (counterclockwise circuit)
+};
+
+/*! In-situ detection of dislocations
+ *
+ *  For a displacement u the amplitudes are eta_j ~ exp(-i q_j.u), so the phase
+ *  of eta_j winds by -q_j.b around a dislocation with Burgers vector b. The
+ *  windings n_j of every grid plaquette are summed from the wrapped phase
+ *  differences of its edges, and a plaquette with nonzero windings gives
+ *
+ *    b = -2 pi (sum_j q_j q_j^T)^-1 sum_j n_j q_j
+ *
+ *  Plaquettes in the liquid, and plaquettes whose windings break a triad
+ *  (n_a + n_b + n_c = 0 for q_a + q_b + q_c = 0), are noise and skipped.
+ *  Only the first row of the next process is needed.
+ */
+class DefectDetection {
+    PhaseField *pfc;
+
+    static const double solid_threshold;
+
+public:
+    DefectDetection(PhaseField *pfc);
+
+    /*! Dislocations of the local plaquettes, rows [0, local_nx) (collective) */
+    vector<Dislocation> find_dislocations();
+
+    /*! Appends "timestep x y b_x b_y" for every dislocation to "filepath",
+     *  returns the number of dislocations on root process (collective)
+     */
+    int write_dislocations(string filepath, int timestep);
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef DENSITY_RECONSTRUCTION_H
+#define DENSITY_RECONSTRUCTION_H
+
+#include <complex>
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+using namespace std;
+
+// forward declaration
+class PhaseField;
+
+/*! Reconstructs the atomic density from the amplitudes
+ *
+ *  phi(r) = sum_j eta_j(r) exp(i q_j.r) + c.c. is evaluated on the fly for
+ *  the local rows, the carrier waves exp(i q_j.r) are advanced along a row
+ *  by one complex multiplication per cell instead of being stored.
+ *
+ *  With an upsampling factor > 1 the amplitudes are first interpolated
+ *  spectrally (zero padding of their spectra) to a grid "factor" times finer
+ *  in both directions, which resolves the atoms of a coarse simulation grid.
+ *  The fine grid is distributed in slabs like the simulation grid and only
+ *  allocated during the reconstruction.
+ */
+class DensityReconstruction {
+    PhaseField *pfc;
+
+    void accumulate(const complex<double> *field, int c, ptrdiff_t rows,
+            ptrdiff_t row_start, int cols, int factor,
+            vector<double> &phi, vector<double> &amplitude);
+
+    void upsample(int factor, ptrdiff_t &local_n, ptrdiff_t &local_start,
+            vector<double> &phi, vector<double> &amplitude);
+
+public:
+    DensityReconstruction(PhaseField *pfc);
+
+    /*! phi and sum_j |eta_j| of the local rows [local_start, local_start+local_n)
+     *  of the grid with (factor*nx) x (factor*ny) points, stored row by row
+     *  (collective)
+     */
+    void reconstruct(int factor, ptrdiff_t &local_n, ptrdiff_t &local_start,
+            vector<double> &phi, vector<double> &amplitude);
+
+    /*! Writes sum_j |eta_j| ("eta") and phi as a binary legacy VTK file,
+     *  every process writes its own rows (collective)
+     */
+    void write_vtk(string filepath, int factor);
+};
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+#include "pfc.h"
+
+using namespace std;
+
+/*! One independent simulation of an ensemble */
+struct Replica {
+    std::string name;           //!< also the name of the output directory
+    PhaseFieldParameters params;
+};
+
+/*! Runs many independent simulations in one MPI job
+ *
+ *  The world communicator is split into groups of group_size processes and
+ *  every group runs one replica at a time in its own communicator. The
+ *  groups take the next unstarted replica from a shared counter, so that
+ *  replicas of different cost are balanced over the groups.
+ *
+ *  The replica file has one replica per line: a name followed by
+ *  key=value pairs (see PhaseFieldParameters::set). A line named "default"
+ *  sets the base parameters of the following replicas, '#' starts a comment.
+ */
+class Ensemble {
+    MPI_Comm world, group;
+    int world_rank, world_size;
+    int group_rank, group_size;
+    int group_id, num_groups;
+
+    std::string output_path;
+    vector<Replica> replicas;
+
+    MPI_Win counter_win;
+    int *counter;
+
+    int next_replica();
+
+public:
+    Ensemble(MPI_Comm world_, int group_size_, std::string output_path_);
+    ~Ensemble();
+
+    /*! Reads the replica file on root and broadcasts it (collective) */
+    bool read_replicas(string filepath);
+
+    /*! Runs all replicas and writes ensemble_summary.txt (collective) */
+    void run();
+};
+
+#endif
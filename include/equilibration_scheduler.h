@@ -0,0 +1,59 @@
+#ifndef EQUILIBRATION_SCHEDULER_H
+#define EQUILIBRATION_SCHEDULER_H
+
+#include <string>
+
+using namespace std;
+
+// forward declarations
+class PhaseField;
+struct PhaseFieldParameters;
+
+/*! Decides after which overdamped steps to run the mechanical equilibration
+ *
+ *  The phase gradient norm (the error measure of the solvers) is checked
+ *  every check_interval OD steps, which takes one inverse FFT. Equilibration
+ *  is triggered when the norm exceeds the threshold or would exceed it
+ *  before the next check (linear extrapolation of its growth), but not
+ *  before min_interval and at the latest after max_interval OD steps.
+ *  Without the adaptive mode every od_steps steps are equilibrated, and the
+ *  norm is only measured then (the equilibration reuses the gradient).
+ */
+class EquilibrationScheduler {
+    PhaseField *pfc;
+
+    bool adaptive;
+    int fixed_interval;
+    int check_interval, min_interval, max_interval;
+    double threshold;
+
+    int steps;          // OD steps since the last equilibration
+    double last_norm;   // norm at the previous check, < 0 if none
+
+    std::string log_filepath;
+
+    void log_decision(int timestep, double norm, const char *decision);
+
+public:
+    EquilibrationScheduler(PhaseField *pfc, const PhaseFieldParameters &params);
+
+    /*! Every check is appended to "filepath" (empty: no log) */
+    void set_log_file(string filepath) { log_filepath = filepath; }
+
+    /*! To be called after every OD step,
+     *  @return true if the equilibration should run now
+     */
+    bool step(int timestep);
+
+    /*! Why the last equilibration was triggered */
+    const char *reason;
+
+    /*! Largest phase gradient norm of the checks since reset_peak_norm(),
+     *  < 0 if none
+     */
+    double peak_norm;
+
+    void reset_peak_norm() { peak_norm = -1.0; }
+};
+
+#endif
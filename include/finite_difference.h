@@ -0,0 +1,89 @@
+#ifndef FINITE_DIFFERENCE_H
+#define FINITE_DIFFERENCE_H
+
+#include <complex>
+#include <vector>
+
+#include <mpi.h>
+
+using namespace std;
+
+// forward declarations
+class PhaseField;
+struct PhaseFieldParameters;
+
+/*! Finite-difference backend of the G_j operators
+ *
+ *  G_j = nabla^2 + 2i q_j.nabla is applied in real space with the fourth
+ *  order central stencils (5 points in x and in y, the symbol of
+ *  python_code/main.py:calculate_fd_kernels), so a rank needs only two
+ *  rows of its neighbours instead of the all-to-all transposes of the
+ *  FFTs. The fields keep the row slabs of FFTW, the halo rows are
+ *  exchanged with nonblocking messages while the inner rows are computed.
+ *
+ *  The overdamped step d eta_j/dt = -((B^l - B^x) eta_j + B^x G_j^2 eta_j + N_j)
+ *  is taken with the damped first order Runge-Kutta-Chebyshev scheme
+ *  (Verwer et al., J. Comput. Phys. 1990): its s stages are explicit and
+ *  stable up to dt*rho ~ 1.9 s^2, so the stiff B^x G_j^2 (rho ~ dx^-4) costs
+ *  O(sqrt(rho dt)) stencil applications per step. Unlike an iterative
+ *  implicit solve, a step has no global reductions.
+ */
+class FiniteDifference {
+    PhaseField *pfc;
+
+    bool enabled;
+
+    int prev_rank, next_rank;   // owners of the rows before and after the local ones
+    // stencils of G_j, offsets -2..2: d_xx + d_yy + i (der_x + der_y)
+    double lap_x[5], lap_y[5];
+    double (*der_x)[5], (*der_y)[5];
+
+    // RKC stages and the coefficients of Y_j = mu_j Y_j-1 + nu_j Y_j-2 + mut_j dt F(Y_j-1)
+    int stages;
+    vector<double> mu, nu, mut;
+
+    // two halo rows below (lo) and above (hi) the local rows, and work fields
+    complex<double> **halo_lo, **halo_hi;
+    complex<double> **work, **g_sq, **stage_a, **stage_b;
+
+    complex<double> **allocate_field(int rows);
+    void free_field(complex<double> **field);
+
+    const complex<double> *row(complex<double> *const *field, int c, int i) const;
+    vector<double> row_lap, row_der;    // sums of one row
+
+    void stencil_row(complex<double> *out, complex<double> *const *in, int c, int i);
+
+    double spectral_radius() const;
+    void calculate_coefficients();
+
+public:
+    FiniteDifference(PhaseField *pfc, const PhaseFieldParameters &params);
+    ~FiniteDifference();
+
+    /*! Finds the neighbour ranks and allocates the halos (collective),
+     *  to be called when the decomposition is known. Falls back to the
+     *  spectral backend if a rank has less than two rows.
+     */
+    void setup();
+
+    bool active() const { return enabled; }
+
+    /*! out_j = G_j in_j (collective, one halo exchange) */
+    void apply_g(complex<double> **out, complex<double> **in);
+
+    /*! out_j = G_j^2 in_j (collective, two halo exchanges) */
+    void apply_g_sq(complex<double> **out, complex<double> **in);
+
+    /*! Takes an overdamped time step of eta (collective), uses the
+     *  buffer of PhaseField
+     */
+    void time_step(complex<double> **eta);
+
+    int get_stages() const { return stages; }
+
+    /*! Bytes of the halos and work fields per process */
+    double workspace_bytes() const;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef GRAIN_ANALYSIS_H
+#define GRAIN_ANALYSIS_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// forward declaration
+class PhaseField;
+
+/*! Summary of the grain structure at one time step */
+struct GrainStatistics {
+    int num_grains;
+    double mean_area, std_area;
+    double mean_orientation;    //!< [rad], area weighted
+    double boundary_length;     //!< half of the total grain perimeter
+    double solid_fraction;
+    vector<double> areas;       //!< sorted from largest to smallest
+};
+
+/*! In-situ analysis of the grain structure
+ *
+ *  The local lattice rotation is calculated from the phase gradients of the
+ *  amplitudes and neighbouring crystalline cells with similar orientation
+ *  are labelled as one grain. Labelling is done locally with union-find and
+ *  the labels are then merged across the slab boundaries.
+ */
+class GrainAnalysis {
+    PhaseField *pfc;
+
+    static const double solid_threshold;
+    static const double angle_tolerance;
+    static const int min_grain_cells;
+
+    double wrap_angle(double angle);
+
+    void calculate_orientation(vector<double> &orientation, vector<char> &solid);
+    void label_grains(const vector<double> &orientation, const vector<char> &solid,
+            vector<long> &labels);
+
+public:
+    GrainAnalysis(PhaseField *pfc);
+
+    /*! Local lattice rotation [rad] of cells in rows [0, local_nx) and
+     *  a flag for crystalline cells
+     */
+    void orientation_map(vector<double> &orientation, vector<char> &solid);
+
+    GrainStatistics calculate_statistics();
+
+    /*! Appends one line of statistics to "filepath" and the grain
+     *  areas to "sizes_filepath"
+     */
+    GrainStatistics write_statistics(string filepath, string sizes_filepath,
+            int timestep);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <complex>
+#include <string>
+#include <cstdint>
+
+#include "lattice.h"
+
+using namespace std;
+
+/*! Counter of the noise of one component on consecutive cells
+ *
+ *  The Gaussian numbers come from the counter-based generator Philox4x32-10
+ *  (Salmon et al. 2011): key "key", counter (cell, step, component), so that
+ *  every number is a function of the global cell index and the step only.
+ */
+struct NoiseStream {
+    uint64_t key;           //!< random seed
+    uint64_t cell;          //!< global index of the first cell
+    uint32_t step;          //!< time step
+    uint32_t component;
+    double amplitude;       //!< standard deviation of the complex noise
+    double q_sq;            //!< |q_c|^2 of conserved noise, < 0: non-conserved
+};
+
+/*! Pointwise kernels of the amplitude model
+ *
+ *  Every kernel works on n consecutive cells. The complex fields are
+ *  std::complex<double> arrays (interleaved real and imaginary parts), the
+ *  vectorized versions split them to real and imaginary lanes internally.
+ *  eta[], buf[] and grad[] are the nc components of the lattice.
+ *
+ *  There is one table per instruction set and lattice (the kernels are
+ *  instantiated for every lattice descriptor): "scalar" (the reference,
+ *  std::complex arithmetic), "avx2" (4 lanes, FMA) and "avx512" (8 lanes).
+ *  The vectorized kernels use their own sincos and reorder the sums, so
+ *  their results differ from the scalar ones in the last bits.
+ */
+struct KernelTable {
+    const char *name;
+
+    /*! out_c = eta_c - dt*N_c(eta), N_c the nonlinear part of the OD scheme */
+    void (*od_nonlinear)(complex<double> *const out[], complex<double> *const eta[],
+            double dt, double tt, double vv, long n);
+
+    /*! Sum of the energy density over the cells, buf_c = G_c eta_c */
+    double (*energy_density)(complex<double> *const eta[], complex<double> *const buf[],
+            double bx, double bl, double tt, double vv, long n);
+
+    /*! grad_c = sum_d q_c.q_d Im(conj(eta_d) dF/deta_d), buf_c = G_c^2 eta_c */
+    void (*grad_theta)(double *const grad[], complex<double> *const eta[],
+            complex<double> *const buf[], double bx, double bl, double tt, double vv,
+            long n);
+
+    /*! data *= f */
+    void (*scale)(complex<double> *data, const double *f, long n);
+
+    /*! data *= f^2 */
+    void (*scale_sq)(complex<double> *data, const double *f, long n);
+
+    /*! out = in/(1 + dt*(bl - bx + bx*g^2)), the linear part of the OD scheme */
+    void (*od_kspace)(complex<double> *out, const complex<double> *in, const double *g,
+            double dt, double bx, double bl, long n);
+
+    /*! out = (in + xi)/(1 + dt*(bl - bx + bx*g^2)), od_kspace with the noise xi
+     *  of "noise" added to the numerator; the standard deviation of xi is
+     *  noise.amplitude, times |k+q_c| = sqrt(|q_c|^2 - g) for conserved noise
+     */
+    void (*od_kspace_noise)(complex<double> *out, const complex<double> *in, const double *g,
+            double dt, double bx, double bl, const NoiseStream &noise, long n);
+
+    /*! data += xi, non-conserved noise of standard deviation noise.amplitude */
+    void (*add_noise)(complex<double> *data, const NoiseStream &noise, long n);
+
+    /*! out = in*exp(i*scale*dir), the angles are also written to
+     *  angle_out unless it is NULL (out may be in)
+     */
+    void (*rotate_phases)(complex<double> *out, const complex<double> *in,
+            const double *dir, double scale, double *angle_out, long n);
+};
+
+// indexed by LatticeType
+extern const KernelTable scalar_kernels[NUM_LATTICES];
+extern const KernelTable avx2_kernels[NUM_LATTICES];
+extern const KernelTable avx512_kernels[NUM_LATTICES];
+
+/*! The selected kernels of the lattice (the best supported ones by default) */
+const KernelTable &kernels(LatticeType lattice);
+
+/*! Selects the kernels by name: "auto", "scalar", "avx2" or "avx512",
+ *  returns false (and keeps the selection) if the CPU doesn't support them
+ */
+bool select_kernels(const std::string &name);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef LATTICE_H
+#define LATTICE_H
+
+#include <string>
+
+/*! Lattices of the amplitude model */
+enum LatticeType {
+    HEXAGONAL_LATTICE,
+    SQUARE_LATTICE,
+    NUM_LATTICES
+};
+
+/*! Lattice descriptors
+ *
+ *  A descriptor gives, as compile-time constants, the number of amplitudes
+ *  nc, the reciprocal lattice vectors q_j and the resonant triads
+ *  (q_a + q_b + q_c = 0), which make the cubic term of the free energy
+ *
+ *    f_3 = -4 tau sum_triads Re(eta_a eta_b eta_c)
+ *
+ *  The pointwise kernels are templated on the descriptor, so their component
+ *  loops have constant trip counts and the q_a.q_b products are constants.
+ *  The quartic term has only the diagonal (|eta_a|^2 |eta_b|^2) resonances,
+ *  which holds for the one-mode lattices below. A lattice with other
+ *  resonances (e.g. two-mode hexagonal, nc = 6) needs their terms in the
+ *  kernels too.
+ */
+struct HexagonalLattice {
+    static constexpr LatticeType type = HEXAGONAL_LATTICE;
+    static constexpr int nc = 3;
+    //! one mode approximation lowest order reciprocal lattice vectors, Eq.(2.4)
+    static constexpr double q[nc][2] = {
+        {-0.5*1.7320508075688772935, -0.5},
+        {0.0, 1.0},
+        {0.5*1.7320508075688772935, -0.5}
+    };
+    static constexpr int num_triads = 1;
+    static constexpr int triads[1][3] = {{0, 1, 2}};
+
+    static constexpr double qq(int a, int b) { return q[a][0]*q[b][0] + q[a][1]*q[b][1]; }
+};
+
+struct SquareLattice {
+    static constexpr LatticeType type = SQUARE_LATTICE;
+    static constexpr int nc = 2;
+    static constexpr double q[nc][2] = {
+        {1.0, 0.0},
+        {0.0, 1.0}
+    };
+    static constexpr int num_triads = 0;
+    static constexpr int triads[1][3] = {{-1, -1, -1}};     // (none)
+
+    static constexpr double qq(int a, int b) { return q[a][0]*q[b][0] + q[a][1]*q[b][1]; }
+};
+
+/*! A lattice descriptor for the code that doesn't need the constants at
+ *  compile time (field allocation, initial states, analysis, I/O)
+ */
+struct Lattice {
+    LatticeType type;
+    const char *name;
+    int nc;
+    const double (*q)[2];
+    int num_triads;
+    const int (*triads)[3];
+};
+
+const Lattice &get_lattice(LatticeType type);
+
+/*! Finds the lattice by name ("hexagonal" or "square"), returns false if
+ *  there is no such lattice
+ */
+bool find_lattice(const std::string &name, LatticeType *type);
+
+#endif
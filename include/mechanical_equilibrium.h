@@ -5,21 +5,107 @@
 #include <chrono>
 #include <complex>
 #include <deque>
+#include <string>
+#include <vector>
+
+#include <fftw3-mpi.h>
 
 using namespace std;
 
 typedef std::chrono::high_resolution_clock Time;
 
-// forward declaration
+// forward declarations
 class PhaseField;
+struct PhaseFieldParameters;
+
+enum SolverMethod {
+    SOLVER_STEEPEST_DESCENT,    //!< steepest descent with line search
+    SOLVER_AGD,                 //!< accelerated gradient descent
+    SOLVER_LBFGS,
+    SOLVER_LBFGS_ENHANCED       //!< L-BFGS rounds alternating with AGD
+};
+
+/*! Solver and its tuning parameters
+ *
+ *  The constructor sets the defaults of the method, every solver only
+ *  reads the fields it uses.
+ */
+struct SolverConfig {
+    SolverMethod method;
+    int m;                  //!< L-BFGS history length
+    double dz;              //!< step size
+    double gamma;           //!< AGD momentum
+    int check_freq;         //!< iterations between energy checks
+    int max_iter;
+    double tolerance;       //!< on the average phase gradient norm
+    int accelerated_descent_iterations; //!< AGD iterations per round (lbfgs_enhanced)
+    int lbfgs_it_increase;  //!< L-BFGS iterations per later round (lbfgs_enhanced)
+
+    SolverConfig(SolverMethod method_ = SOLVER_LBFGS_ENHANCED);
+
+    /*! e.g. "lbfgs(m=5,dz=0.02)" */
+    std::string name() const;
+};
 
 class MechanicalEquilibrium {
     PhaseField *pfc;
 
+    friend class Benchmark;
+
+    // configuration used by equilibrate() and by the solvers
+    SolverConfig config;
+
+    // settings of "method": config if it is for the same method, else defaults
+    SolverConfig settings(SolverMethod method) const;
+
+    // autotuning: candidate configurations and their measured convergence
+    // rates (decades of error reduction per second, < 0: not measured yet),
+    // the choice stays adaptive: every equilibration starts with the fastest
+    bool autotune;
+    vector<SolverConfig> candidates;
+    vector<double> rates;
+    static const double rate_smoothing;
+
+    // failure detection, only with autotuning
+    bool stop_on_failure;
+    const char *failure;
+    double best_error;
+    int stalled_checks;
+    static const int stagnation_checks;
+    static const double stagnation_factor;
+
+    // step calibration: 1/L of the largest curvature L of the energy
+    // wrt the phases, 0 if not calibrated (fixed steps of the configs)
+    bool calibrate;
+    double step_limit;
+    double line_search_step;    // last accepted exp_line_search step
+    static const int curvature_iterations;
+    static const double curvature_safety;
+
+    double solver_workspace(const SolverConfig &c) const;
+
+    bool failing(double energy, double last_energy, double error);
+    int run_solver();
+    int choose_candidate(const vector<bool> &tried) const;
+
     double elementwise_avg_norm();
 
     double exp_line_search(double *energy_io, double **neg_direction);
 
+    // batched line search: trial states interleaved in one field of
+    // nc*line_search_batch components, NULL when not allocated
+    int line_search_batch;
+    complex<double> *batch;
+    fftw_plan batch_plan_f, batch_plan_b;
+
+    void allocate_batch();
+    void free_batch();
+    void batch_energies(const double *dz, double **neg_direction, double *energies);
+    double batched_line_search(double *energy_io, double **neg_direction);
+
+    /*! The batched or the exponential line search (sets eta and eta_k) */
+    double line_search(double *energy_io, double **neg_direction);
+
     void take_step(double dz, double **neg_direction,
         complex<double> **eta_in, complex<double> **eta_out);
 
@@ -27,7 +113,8 @@ class MechanicalEquilibrium {
         double **velocity, bool zero_vel); 
 
     double dot_prod(double **v1, double **v2);
-    void lbfgs_direction(int m, double ***s, double ***y, double **grad, double **result);
+    void lbfgs_direction(int m, double ***s, double ***y, double **grad, double **result,
+            double h0 = 1.0);
     void move_queue(int m, double ***queue);
     bool check_move(int m, double ***q_bef, double ***q_aft);
 
@@ -35,7 +122,8 @@ class MechanicalEquilibrium {
     static int lbfgs_iterations;
 
 public:
-    MechanicalEquilibrium(PhaseField *pfc);
+    MechanicalEquilibrium(PhaseField *pfc, const PhaseFieldParameters &params);
+    ~MechanicalEquilibrium();
 
     int steepest_descent_fixed_dz();
     int steepest_descent_line_search();
@@ -46,9 +134,36 @@ public:
     		bool print = true);
     int accelerated_gradient_descent_line_search();
 
-    int lbfgs();
+    int lbfgs(int max_it = 10000, bool print = true);
     int lbfgs_enhanced();
 
+    /*! Runs the configured solver, or with autotuning the candidate
+     *  configurations in turn and then the fastest one, falling back to
+     *  the next one when a solver diverges or stagnates
+     *  @return number of iterations
+     */
+    int equilibrate();
+
+    void set_config(const SolverConfig &config_) { config = config_; }
+
+    /*! Largest curvature of the energy wrt the phases at the current state,
+     *  by power iteration with gradient differences (2 ffts per iteration)
+     */
+    double estimate_curvature(int iterations);
+
+    /*! Sets the step sizes of all solvers from the curvature estimate
+     *  (done by equilibrate() unless a fixed step size is configured)
+     */
+    void calibrate_steps();
+
+    /*! Average phase gradient norm of the current state, the error measure
+     *  of the solvers (1 fft, requires eta_k to be set)
+     */
+    double gradient_norm();
+
+    /*! Largest memory [bytes] the solvers allocate during equilibrate() */
+    double workspace_bytes() const;
+
 };
 
 #endif
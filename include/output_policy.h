@@ -0,0 +1,83 @@
+#ifndef OUTPUT_POLICY_H
+#define OUTPUT_POLICY_H
+
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+// forward declarations
+class PhaseField;
+struct PhaseFieldParameters;
+
+/*! Decides at which check points to write a snapshot
+ *
+ *  The check points are the repetitions of run_calculations, or every
+ *  check_interval OD steps in test. The signals are global values the run
+ *  has anyway, compared to their values at the last snapshot: the energy
+ *  (relative change above energy_change), the largest phase gradient norm
+ *  the equilibration scheduler measured since the last snapshot (grown by
+ *  norm_factor over that of the previous interval, norms below the
+ *  equilibration threshold don't count) and the grain count (relative
+ *  change above grain_change). A snapshot is written when
+ *  one of them fires, but not before min_interval and at the latest after
+ *  max_interval OD steps, and at the last check point. With a byte budget,
+ *  the snapshots it still allows (at the mean size so far) are spread
+ *  evenly over the remaining check points.
+ *  Without the adaptive mode the callers keep their fixed cadences.
+ */
+class OutputPolicy {
+    PhaseField *pfc;
+
+    bool adaptive;
+    int check_interval, min_interval, max_interval;
+    double energy_change, norm_factor, grain_change;
+    double norm_floor;      // norms below are equilibrated (the meq threshold)
+    double max_bytes;
+
+    int last_timestep;      // of the last snapshot (or the start)
+    int checks;             // check points since the last snapshot
+    bool have_energy;
+    double ref_energy;      // values at the last snapshot,
+    double ref_norm;        // < 0 if not measured yet
+    int ref_grains;
+
+    uint64_t bytes_written;
+    int snapshots;
+
+    std::string log_filepath;
+
+    void log_decision(int timestep, double energy, double norm, int num_grains,
+            const char *decision);
+
+public:
+    OutputPolicy(PhaseField *pfc, const PhaseFieldParameters &params);
+
+    bool is_adaptive() const { return adaptive; }
+
+    /*! OD steps between the check points of test */
+    int get_check_interval() const { return check_interval; }
+
+    /*! Every check is appended to "filepath" (empty: no log) */
+    void set_log_file(string filepath) { log_filepath = filepath; }
+
+    /*! Starts a run at "timestep", the byte budget is kept */
+    void start(int timestep);
+
+    /*! To be called at every check point (collective)
+     *
+     *  "norm" < 0 and "num_grains" < 0 if not measured, the grain count of
+     *  the root process is used. "remaining" is the number of check points
+     *  left after this one.
+     *  @return true if a snapshot should be written now
+     */
+    bool check(int timestep, double energy, double norm, int num_grains, int remaining);
+
+    /*! Counts a written snapshot of "bytes" against the budget */
+    void written(uint64_t bytes);
+
+    /*! Why the last snapshot was written */
+    const char *reason;
+};
+
+#endif
@@ -3,10 +3,21 @@
 
 #include <complex>
 #include <string>
+#include <vector>
 
 #include <fftw3-mpi.h>
 
 #include "mechanical_equilibrium.h"
+#include "snapshot.h"
+#include "grain_analysis.h"
+#include "defect_detection.h"
+#include "spectral_analysis.h"
+#include "equilibration_scheduler.h"
+#include "output_policy.h"
+#include "density_reconstruction.h"
+#include "polycrystal.h"
+#include "kernels.h"
+#include "finite_difference.h"
 
 
 using namespace std;
@@ -15,23 +26,99 @@ using namespace std;
 #define PI 3.14159265358979323846
 
 
+/*! Grid, model and run parameters of one simulation
+ *
+ *  The defaults are set in the PARAMETERS block of pfc.cpp, single values
+ *  can be overridden by name (e.g. from an ensemble parameter file).
+ */
+struct PhaseFieldParameters {
+    int nx, ny;             //!< grid size
+    double dx, dy;          //!< space step
+    double dt;              //!< time step
+
+    std::string lattice;    //!< "hexagonal" or "square" (see lattice.h)
+
+    double bx, bl;          //!< B^x and B^l = B^x - dB
+    double tt, vv;          //!< tau and nu
+
+    std::string initial_state;  //!< "circle", "seed", "seeds", "voronoi" or "file"
+    std::string initial_file;   //!< snapshot of the "file" state, resampled to the grid
+    int nparticles;         //!< number of seeds or grains
+    double particle_radius; //!< (max) seed radius relative to the system size
+    double angle;           //!< (max) grain rotation angle [rad]
+    double amplitude;       //!< perfect lattice equilibrium amplitude
+    unsigned int seed;      //!< random seed of the initial state (0: from time)
+    std::string grain_distribution; //!< "uniform" or "reference" (see GrainDistribution)
+    int seed_exponent;      //!< p of the seed profile amplitude/(rd^p+1)
+    int coarse_levels;      //!< initial state relaxed on grids 2^l coarser, l = levels..1 (0: off)
+    int coarse_steps;       //!< OD steps on every coarse grid
+
+    int repetitions;        //!< OD + equilibration cycles of run_calculations
+    int od_steps;           //!< OD steps per cycle (fixed schedule)
+    int out_time;
+    int max_iterations;
+    int grain_stats_freq;   //!< in repetitions of run_calculations
+    int defect_freq;        //!< dislocation list, in repetitions (0: off)
+    int spectra_freq;       //!< radially averaged spectra, in repetitions (0: off)
+    int vtk_upsampling;     //!< VTK output grid is this many times finer
+    bool write_vtk;         //!< run_calculations writes phi (VTK) with the snapshots
+
+    bool meq_adaptive;      //!< gradient triggered equilibration (see EquilibrationScheduler)
+    int meq_check_interval; //!< OD steps between gradient norm checks
+    int meq_min_interval;   //!< min. OD steps between equilibrations
+    int meq_max_interval;   //!< max. OD steps between equilibrations
+    double meq_threshold;   //!< gradient norm that triggers equilibration
+
+    bool output_adaptive;   //!< event-driven snapshots (see OutputPolicy)
+    int output_check_interval; //!< OD steps between output checks in test
+    int output_min_interval;   //!< min. OD steps between snapshots
+    int output_max_interval;   //!< max. OD steps between snapshots
+    double output_energy_change; //!< relative energy change that triggers a snapshot
+    double output_norm_factor;   //!< phase gradient norm growth that triggers a snapshot
+    double output_grain_change;  //!< relative grain count change that triggers a snapshot
+    double output_max_bytes;     //!< snapshot volume of a run (0: unlimited)
+
+    std::string meq_solver; //!< "lbfgs_enhanced", "lbfgs", "agd", "steepest_descent" or "auto"
+    int meq_lbfgs_m;        //!< L-BFGS history length (0: solver default)
+    double meq_dz;          //!< solver step size (0: calibrated or solver default)
+    bool meq_calibrate_step;//!< step sizes from the energy curvature
+    int meq_line_search_batch; //!< trial steps evaluated together (1: one at a time)
+
+    bool low_memory;        //!< in-place buffer transforms, G_j on the fly, solver fields on demand
+    std::string simd;       //!< pointwise kernels: "auto", "scalar", "avx2" or "avx512"
+
+    std::string backend;    //!< G_j operators: "spectral" or "finite_difference"
+    bool reproducible;      //!< sums independent of the process count (see reproducible_sum)
+
+    double noise_strength;  //!< temperature T of the Langevin noise (0: deterministic steps)
+    bool noise_conserved;   //!< conserved noise, |k+q_j| xi_j (spectral backend only)
+
+    PhaseFieldParameters();
+
+    /*! Sets the parameter "key" (e.g. "tt", "angle_deg") from a string,
+     *  returns false if the key or the value is not valid
+     */
+    bool set(const std::string &key, const std::string &value);
+};
+
+
 class PhaseField {
 private: 
-    static const int nx, ny;
-    static const double dx, dy;
-
-    static const double dt;
+    const int nx, ny;
+    const double dx, dy;
 
-    static const double q_vec[][2];
+    const double dt;
 
-    static const double bx, bl;
-    static const double tt, vv;
+    const Lattice &lattice;
+    const int nc; //number of components
+    const double (*const q_vec)[2];
 
-    static const int nc; //number of components
-    
+    const double bx, bl;
+    const double tt, vv;
 
     ptrdiff_t alloc_local, local_nx, local_nx_start;
 
+    MPI_Comm comm;
     int mpi_rank, mpi_size;
 
     double *k_x_values, *k_y_values;
@@ -40,17 +127,85 @@ private:
     void calculate_k_values(double *k_values, int n, double d);
     void calculate_g_values(double **g_values);
 
+    /*! G_j of component c at local k space point (i, j) */
+    double calculate_g_value(int c, int i, int j) const {
+        double kx = k_x_values[i + local_nx_start], ky = k_y_values[j];
+        return - (kx*kx + ky*ky) - 2*(q_vec[c][0]*kx + q_vec[c][1]*ky);
+    }
+
+    /*! G_j from the table, or calculated in the low memory mode */
+    double g_value(int c, int i, int j) const {
+        return g_values ? g_values[c][i*ny + j] : calculate_g_value(c, i, j);
+    }
+
+    /*! G_j of component c on the local k space row i, from the table or
+     *  calculated to row (ny doubles) in the low memory mode
+     */
+    const double *g_row(int c, int i, double *row) const {
+        if (g_values) return g_values[c] + i*ny;
+        for (int j = 0; j < ny; j++) row[j] = calculate_g_value(c, i, j);
+        return row;
+    }
+
     double dot_prod(const double* v1, const double* v2, int len);
 
     void memcopy_eta(complex<double> **eta_to, complex<double> **eta_from);
+
+    void receive_next_row(void *first_row, void *next_row, int count,
+            MPI_Datatype type);
+
+    // local_nx and local_nx_start of every process
+    vector<int> row_counts, row_offsets;
+
+    /*! Sum over all rows of "row_sums" (one per local row), in an order
+     *  that depends only on nx (collective)
+     */
+    double reproducible_sum(const double *row_sums);
     
 
     complex<double> **eta, **eta_k;
     fftw_plan *eta_plan_f, *eta_plan_b;
 
+    // work fields of the solvers, NULL when not allocated
     complex<double> **eta_tmp, **eta_tmp_k;
     fftw_plan *eta_tmp_plan_f, *eta_tmp_plan_b;
 
+    void allocate_eta_tmp();
+    void free_eta_tmp();
+    void release_eta_tmp();
+
+    /*  Version stamps of the states eta and eta_tmp: the real space stamp is
+     *  renewed whenever the field changes, the k space field is up to date
+     *  when its stamp is the same. The energy and the gradient are memoized
+     *  by the stamp, so that a state is transformed and evaluated only once.
+     *  Other fields (e.g. saved copies) are untracked, stamp 0.
+     */
+    unsigned long last_version;
+    unsigned long eta_version, eta_k_version, eta_tmp_version, eta_tmp_k_version;
+    unsigned long energy_versions[2], grad_version;  // (the last two energies)
+    double energy_values[2];
+    int energy_slot;
+
+    unsigned long *version_of(complex<double> **field, bool k_space);
+
+    /*! eta or eta_tmp was changed in real space */
+    void field_changed(complex<double> **field);
+
+    /*! eta or eta_tmp was overwritten with the real and k space fields of
+     *  the state "version"
+     */
+    void field_copied(complex<double> **field, unsigned long version);
+
+    unsigned long field_version(complex<double> **field);
+
+    /*! Transforms eta or eta_tmp to k space, if eta_k (eta_tmp_k) is not
+     *  up to date (collective)
+     */
+    void update_k(complex<double> **field);
+
+    double evaluate_energy(complex<double> **eta_, complex<double> **eta_k_);
+    void evaluate_grad_theta(complex<double> **eta_, complex<double> **eta_k_);
+
     complex<double> **buffer, **buffer_k;
     fftw_plan *buffer_plan_f, *buffer_plan_b;
 
@@ -60,21 +215,70 @@ private:
 
     MechanicalEquilibrium mech_eq;
 
+    SnapshotWriter snapshot_writer;
+
+    GrainAnalysis grain_analysis;
+
+    DefectDetection defect_detection;
+
+    SpectralAnalysis spectral_analysis;
+
+    EquilibrationScheduler meq_scheduler;
+
+    OutputPolicy output_policy;
+
+    DensityReconstruction density;
+
+    FiniteDifference fd;
+
     double calculate_radius();
 
-    static const int nparticles;
-    static const double particle_radius;
-    static const double angle;
-    static const double amplitude;
-    static const int out_time;
-    static const int max_iterations;
-    complex<double> **exp_part;
+    const PhaseFieldParameters parameters;  // for the grids of the warm start
+    const std::string initial_state;
+    const int nparticles;
+    const double particle_radius;
+    const double angle;
+    const double amplitude;
+    const unsigned int seed;
+    const GrainDistribution grain_distribution;
+    const int seed_exponent;
+    const int repetitions;
+    const int out_time;
+    const int max_iterations;
+    const int grain_stats_freq;
+    const int defect_freq;
+    const int spectra_freq;
+    const int vtk_upsampling;
+    const bool write_vtk;
+    const bool low_memory;
+    const bool reproducible;
+    const double noise_strength;
+    bool noise_conserved;
+    uint64_t noise_key;     // Philox key of the noise, the same on all processes
+
+    std::string log_prefix;
+
+    int timestep;   // OD steps taken, the counter of the noise
+
+    /*! Noise of component c from the global cell "cell" on, of the current step
+     *  (k_space: scaled to the unnormalized transforms)
+     */
+    NoiseStream noise_stream(int c, long cell, bool k_space) const;
+
+    void resample_spectra(complex<double> **src_k, int src_nx, int src_ny,
+            double src_dx, double src_dy);
+    bool resample_snapshot(string filepath, const SnapshotHeader &header);
+    void warm_start();
+    /*! eta of initial_state, without the warm start */
+    void initialize_eta_state();
 
 public:
 
     void initialize_eta_circle();
     void initialize_eta_seed();
     void initialize_eta_multiple_seeds();
+    void initialize_eta_voronoi();
+    void initialize_eta_from_file();
     void take_fft(fftw_plan *plan);
     void normalize_field(complex<double> **field);
 
@@ -89,23 +293,75 @@ public:
             complex<double> **eta_);
     void overdamped_time_step();
 
-    PhaseField(int mpi_rank_, int mpi_size_, std::string output_path_);
+    /*! All communication (including the FFTs) is done in "comm_", so that
+     *  independent simulations can run side by side in sub-communicators
+     */
+    PhaseField(MPI_Comm comm_, std::string output_path_,
+            const PhaseFieldParameters &params = PhaseFieldParameters());
     ~PhaseField();
     
     void write_eta_to_file(string filepath);
     void write_eta_to_vtk_file(string filepath);
     void read_eta_from_file(string filepath);
 
+    uint64_t write_eta_to_snapshot(string filepath, int timestep);
+    bool read_eta_from_snapshot(string filepath);
+
 
-    void start_calculations();
+    /*! Prefixes the progress lines printed by run_calculations */
+    void set_log_prefix(string prefix) { log_prefix = prefix; }
+
+    /*! Prints the field memory per process: permanent fields and the
+     *  peak during the equilibration (collective)
+     */
+    void report_memory();
+
+    void initialize_eta();
+    void start_calculations(string subdir = "seed_run/");
     void run_calculations(int init_it, double time_so_far, string path,
             string run_info_filename);
     void continue_calculations();
 
     void test();
 
+    /*! Stepping interface for embedding the engine (libpfc, the Python
+     *  bindings), all methods but set_eta are collective. eta_k is kept
+     *  consistent with eta: after changing eta with set_eta or through
+     *  get_eta(c), call fields_changed().
+     */
+    void initialize();
+    void step(int steps);
+    int equilibrate();
+    double energy();
+    void fields_changed();
+    void set_eta(int c, const complex<double> *local_field);
+    /*! Drops the memoized energies and gradient (for benchmarks), eta and
+     *  eta_k stay as they are
+     */
+    void invalidate_cache();
+
+    int get_nx() const { return nx; }
+    int get_ny() const { return ny; }
+    int get_nc() const { return nc; }
+    int get_local_nx() const { return local_nx; }
+    int get_local_nx_start() const { return local_nx_start; }
+    int get_timestep() const { return timestep; }
+    double get_time() const { return timestep*dt; }
+    MPI_Comm get_comm() const { return comm; }
+
     // make MechanicalEquilibrium be able to access private members
     friend class MechanicalEquilibrium;
+    friend class GrainAnalysis;
+    friend class DefectDetection;
+    friend class SpectralAnalysis;
+    friend class EquilibrationScheduler;
+    friend class OutputPolicy;
+    friend class DensityReconstruction;
+    friend class Polycrystal;
+    friend class Benchmark;
+    friend class Ensemble;
+    friend class FiniteDifference;
+    friend class Analyzer;
 };
 
 #endif
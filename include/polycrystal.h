@@ -0,0 +1,91 @@
+#ifndef POLYCRYSTAL_H
+#define POLYCRYSTAL_H
+
+#include <complex>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+// forward declaration
+class PhaseField;
+
+/*! One grain of a polycrystal: center, seed radius (physical units) and
+ *  the phase wave vectors of its rotated lattice
+ */
+struct Grain {
+    double x, y;
+    double radius;
+    double angle;
+    //! eta_j = amplitude*exp(i (k[2j]*dx + k[2j+1]*dy)), (dx, dy) from the center
+    vector<double> k;
+};
+
+/*! How the grains are drawn */
+enum GrainDistribution {
+    //! radius uniform in [0, max_radius], rotation uniform in [-max_angle, max_angle]
+    UNIFORM_GRAINS,
+    //! radius max_radius, grain 0 unrotated and the others uniform in [0, max_angle)
+    //! (the convention of examples/python_code_*)
+    REFERENCE_GRAINS
+};
+
+/*! Initial states with many rotated grains
+ *
+ *  The grains are generated from a single seed value (broadcast from root,
+ *  so all processes agree) with mt19937_64, which gives the same grains for
+ *  any number of processes and on any platform.
+ *
+ *  seeds(): rotated crystal seeds in liquid, amplitude/(rd^p+1) with rd the
+ *  distance from the center in radii. A seed is only evaluated where it is
+ *  larger than seed_tolerance of the amplitude, and the phase factors are
+ *  rotated along the rows.
+ *
+ *  voronoi(): space filling grains, every cell belongs to the nearest grain
+ *  center. The centers are binned, so a cell only checks the nearby bins.
+ */
+class Polycrystal {
+    PhaseField *pfc;
+
+    vector<Grain> grains;
+    uint64_t seed;
+
+    int seed_exponent;
+    static const double seed_tolerance;
+
+    // bins of the grain centers: grains of bin b are
+    // bin_grains[bin_start[b]] ... bin_grains[bin_start[b+1]-1]
+    int nbx, nby;
+    double bin_x, bin_y;
+    vector<int> bin_start, bin_grains;
+
+    void make_bins();
+    double min_image(double d, double length) const;
+    double periodic_dist_sq(double x, double y, const Grain &g) const;
+    int nearest_grain(double x, double y) const;
+
+public:
+    /*! Generates the grains (collective)
+     *
+     *  @param num_grains
+     *  @param max_radius   (max) seed radius, relative to nx*dx
+     *  @param max_angle    (max) rotation
+     *  @param seed_        random seed, 0: from the time on root
+     *  @param distribution of the radii and rotations
+     *  @param seed_exponent_ p of the seed profile amplitude/(rd^p+1)
+     */
+    Polycrystal(PhaseField *pfc, int num_grains, double max_radius,
+            double max_angle, uint64_t seed_,
+            GrainDistribution distribution = UNIFORM_GRAINS, int seed_exponent_ = 16);
+
+    /*! The seed value that was used */
+    uint64_t get_seed() const { return seed; }
+
+    /*! Sets eta to the seeds in liquid */
+    void seeds();
+
+    /*! Sets eta to the Voronoi tessellation of the grain centers */
+    void voronoi();
+};
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string>
+#include <vector>
+
+#include <mpi.h>
+
+using namespace std;
+
+/*! Named timers and counters
+ *
+ *  Regions and counters are registered once (the macros below keep the id in a
+ *  static variable), so a timed scope costs two clock reads. Times are
+ *  inclusive: nested regions are also counted in the enclosing ones.
+ *  The report aggregates every region over the processes (min/avg/max).
+ */
+class Profiler {
+    struct Region {
+        std::string name;
+        double time;
+        long calls;
+    };
+    struct Counter {
+        std::string name;
+        double value;
+    };
+    struct TraceEvent {
+        int region;
+        double start, duration;
+    };
+
+    static vector<Region> regions;
+    static vector<Counter> counters;
+    static vector<TraceEvent> trace;
+    static bool trace_enabled;
+    static double time_origin;
+
+    static const size_t max_trace_events;
+
+public:
+    static double now();
+
+    static int region(const char *name);
+    static int counter(const char *name);
+
+    static void add_time(int id, double start, double duration);
+    static void add_count(int id, double value) { counters[id].value += value; }
+
+    /*! Current value of a counter on this process (0 if not registered) */
+    static double count(const char *name);
+
+    /*! Records every timed scope for the Chrome trace timeline */
+    static void enable_trace(bool enable) { trace_enabled = enable; }
+
+    /*! Writes the aggregated report as JSON (collective, root writes) */
+    static void write_report(string filepath, MPI_Comm comm);
+
+    /*! Writes the per-process timeline in Chrome trace format
+     *  (chrome://tracing or Perfetto); every process writes its own file
+     */
+    static void write_trace(string filepath, int mpi_rank);
+};
+
+/*! Adds the time from construction to destruction to a region */
+class ScopedTimer {
+    int id;
+    double start;
+
+public:
+    ScopedTimer(int id_) : id(id_), start(Profiler::now()) {}
+    ~ScopedTimer() { Profiler::add_time(id, start, Profiler::now() - start); }
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+/*! Times the enclosing scope as region "name" */
+#define PROFILE_SCOPE(name) \
+    static const int PROFILE_CONCAT(profile_id_, __LINE__) = Profiler::region(name); \
+    ScopedTimer PROFILE_CONCAT(profile_timer_, __LINE__)(PROFILE_CONCAT(profile_id_, __LINE__))
+
+/*! Adds "value" to counter "name" */
+#define PROFILE_COUNT(name, value) \
+    do { \
+        static const int profile_counter_id = Profiler::counter(name); \
+        Profiler::add_count(profile_counter_id, value); \
+    } while (0)
+
+#endif
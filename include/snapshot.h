@@ -0,0 +1,102 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <complex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <mpi.h>
+
+using namespace std;
+
+/*! Storage precision of the values in a snapshot chunk */
+enum SnapshotPrecision {
+    SNAPSHOT_DOUBLE = 0,    //!< lossless 8 byte doubles
+    SNAPSHOT_FLOAT = 1,     //!< 4 byte floats
+    SNAPSHOT_QUANTIZED = 2  //!< integers, absolute error <= error_bound
+};
+
+/*! Options of the snapshot writer
+ *
+ *  The defaults give lossless output with delta encoding against
+ *  the previously written snapshot and a keyframe after every 10 files.
+ */
+struct SnapshotOptions {
+    SnapshotPrecision precision;
+    double error_bound;         //!< only used by SNAPSHOT_QUANTIZED
+    bool delta;                 //!< encode against the previous snapshot
+    int keyframe_interval;      //!< every n-th snapshot is written without delta
+    int compression_level;      //!< zlib level, 0..9
+    int chunk_bytes;            //!< approximate uncompressed size of one chunk
+
+    SnapshotOptions()
+        : precision(SNAPSHOT_DOUBLE), error_bound(1.0e-6), delta(true),
+          keyframe_interval(10), compression_level(1), chunk_bytes(1 << 22) {}
+};
+
+/*! Self-describing part of a snapshot file */
+struct SnapshotHeader {
+    int nx, ny, nc;
+    double dx, dy, dt;
+    int timestep;
+    double time;
+    double bx, bl, tt, vv;
+    vector<double> q_vec;   //!< nc*2 values
+
+    int precision;
+    double error_bound;
+    std::string reference;  //!< file name of the delta reference, empty for keyframes
+};
+
+/*! One independently compressed piece of a field component */
+struct SnapshotChunk {
+    int component;
+    int row_start, row_count;
+    uint64_t offset, size;
+};
+
+/*! Writes the fields in the compressed snapshot format (see snapshot.cpp)
+ *
+ *  Each process compresses the chunks of its own slab and the chunks
+ *  are then written with collective MPI-IO. For delta encoding the writer
+ *  keeps the encoded words of the last snapshot, so the slab
+ *  decomposition must stay the same between the calls.
+ */
+class SnapshotWriter {
+    MPI_Comm comm;
+    SnapshotOptions options;
+
+    int count;                      // number of written snapshots
+    std::string last_filename;
+    vector< vector<uint64_t> > prev_words;
+
+public:
+    SnapshotWriter(MPI_Comm comm_, SnapshotOptions options_ = SnapshotOptions());
+
+    void set_options(SnapshotOptions options_);
+    const SnapshotOptions& get_options() const { return options; }
+
+    /*! Writes the local slabs fields[c][0 .. local_nx*ny) of all components
+     *  @return total number of bytes in the file
+     */
+    uint64_t write(string filepath, SnapshotHeader &header,
+            complex<double> **fields, int local_nx, int local_nx_start);
+};
+
+bool is_snapshot_file(string filepath);
+
+/*! Reads the header (and chunk table) of a snapshot file on all processes */
+bool read_snapshot_header(string filepath, MPI_Comm comm, SnapshotHeader &header,
+        vector<SnapshotChunk> *chunks = NULL);
+
+/*! Reads rows [local_nx_start, local_nx_start+local_nx) of all components
+ *
+ *  Delta encoded files are resolved through their reference files, which
+ *  are expected in the same directory. The chunk layout of the file does not
+ *  need to match the decomposition of the reader.
+ */
+bool read_snapshot(string filepath, MPI_Comm comm, complex<double> **fields,
+        int local_nx, int local_nx_start, SnapshotHeader &header);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef SPECTRAL_ANALYSIS_H
+#define SPECTRAL_ANALYSIS_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// forward declaration
+class PhaseField;
+
+/*! Radially averaged spectrum and its moments at one time step */
+struct SpectralStatistics {
+    double dk;                  //!< bin width, bin b holds b dk <= |k| < (b+1) dk
+    vector<double> spectrum;    //!< mean of sum_j |eta_j(k)|^2/(nx ny) in each bin
+    double k_mean, k_rms;       //!< <|k|> and sqrt(<|k|^2>), k = 0 excluded
+    double length;              //!< characteristic length 2 pi/k_mean
+    double anisotropy;          //!< (l_1-l_2)/(l_1+l_2) of the eigenvalues of <k k^T>
+    double axis;                //!< [rad] eigenvector of l_1 (direction of fastest variation)
+};
+
+/*! In-situ spectra of the amplitudes
+ *
+ *  |eta_j(k)|^2 of all components is binned by |k| with the bin width of the
+ *  coarser k grid direction. The moments weight every mode k != 0 with its
+ *  power, so for coarsening the length 2 pi/<|k|> grows with the grains.
+ *  The k = 0 mode is the mean amplitude and only enters bin 0. One pass over
+ *  eta_k and one allreduce of the bins; the finite-difference backend doesn't
+ *  keep eta_k and needs one transform.
+ */
+class SpectralAnalysis {
+    PhaseField *pfc;
+
+public:
+    SpectralAnalysis(PhaseField *pfc);
+
+    /*! Spectrum and moments of the current eta, the same on every process
+     *  (collective)
+     */
+    SpectralStatistics calculate_spectra();
+
+    /*! Appends "timestep S_0 S_1 ..." to "spectra_filepath" (with a "# k"
+     *  line of the bin centres first) and "timestep time k_mean k_rms length
+     *  anisotropy axis[deg]" to "stats_filepath" (collective)
+     */
+    SpectralStatistics write_spectra(string spectra_filepath, string stats_filepath,
+            int timestep);
+};
+
+#endif
@@ -1,10 +1,14 @@
 import numpy as np
 import matplotlib.pyplot as plt
+import os
+import struct
 import sys
+import zlib
 
-if len(sys.argv) != 2:
+if len(sys.argv) not in (2, 4):
     print("Please supply a filename to convert.")
-    exit
+    print("(for raw .bin files also the grid size: file.bin nx ny)")
+    exit()
 
 def print_comp(eta_):
     for i in range(nx):
@@ -13,18 +17,88 @@ def print_comp(eta_):
             print("%11.4e"%eta_[i, j], end="")
         print("|")
 
+def read_snapshot_header(filepath):
+    """
+    Reads the header and chunk table of a snapshot file (see src/snapshot.cpp)
+    """
+    with open(filepath, "rb") as f:
+        data = f.read(16)
+        if data[:8] != b"PFCSNAP1":
+            return None
+        block_bytes = struct.unpack("<I", data[12:16])[0]
+        block = f.read(block_bytes)
+        h = {}
+        h["nx"], h["ny"], h["nc"] = struct.unpack_from("<3i", block, 0)
+        h["dx"], h["dy"], h["dt"] = struct.unpack_from("<3d", block, 12)
+        h["timestep"], = struct.unpack_from("<i", block, 36)
+        h["time"], h["bx"], h["bl"], h["tt"], h["vv"] = struct.unpack_from("<5d", block, 40)
+        pos = 80
+        h["q_vec"] = struct.unpack_from("<%dd" % (2*h["nc"]), block, pos)
+        pos += 16*h["nc"]
+        h["precision"], h["error_bound"] = struct.unpack_from("<id", block, pos)
+        ref_len, = struct.unpack_from("<I", block, pos + 12)
+        h["reference"] = block[pos+16:pos+16+ref_len].decode()
+        nchunks, = struct.unpack("<I", f.read(4))
+        chunks = [struct.unpack("<4i2Q", f.read(32)) for _ in range(nchunks)]
+    return h, chunks
+
+def read_snapshot(filepath):
+    """
+    Reads a snapshot file, following delta references, into an array (nc, nx, ny)
+    """
+    h, chunks = read_snapshot_header(filepath)
+    nx, ny, nc = h["nx"], h["ny"], h["nc"]
+    wsize = 4 if h["precision"] == 1 else 8
+    wtype = np.uint32 if wsize == 4 else np.uint64
+
+    words = np.zeros((nc, nx, ny*2), dtype=wtype)
+    with open(filepath, "rb") as f:
+        for c, row_start, row_count, _, offset, size in chunks:
+            f.seek(offset)
+            raw = np.frombuffer(zlib.decompress(f.read(size)), dtype=np.uint8)
+            raw = raw.reshape(wsize, -1).T.copy()
+            words[c, row_start:row_start+row_count] = raw.view(wtype).reshape(row_count, ny*2)
+
+    if h["reference"]:
+        ref_path = os.path.join(os.path.dirname(filepath), h["reference"])
+        ref = read_snapshot_words(ref_path)
+        if h["precision"] == 2:
+            words = words + ref
+        else:
+            words = words ^ ref
+
+    return h, words
+
+def read_snapshot_words(filepath):
+    return read_snapshot(filepath)[1]
+
+def words_to_eta(h, words):
+    if h["precision"] == 0:
+        values = words.view(np.float64)
+    elif h["precision"] == 1:
+        values = words.view(np.float32).astype(np.float64)
+    else:
+        values = words.view(np.int64) * 2.0*h["error_bound"]
+    return values[:, :, 0::2] + 1j*values[:, :, 1::2]
+
 filepath = sys.argv[1]
-imagename = filepath.replace("bin", "png")
+imagename = os.path.splitext(filepath)[0] + ".png"
 
 print("Creating {0} from {1}".format(imagename, filepath))
 
-nx = 512
-ny = 512
-nc = 3
-flat = np.fromfile(filepath, dtype=np.complex128, count=-1, sep="")
-eta = flat.reshape(nc, nx, ny)
+header = read_snapshot_header(filepath)
+if header is not None:
+    h, words = read_snapshot(filepath)
+    nx, ny, nc = h["nx"], h["ny"], h["nc"]
+    eta = words_to_eta(h, words)
+else:
+    nx = int(sys.argv[2]) if len(sys.argv) == 4 else 512
+    ny = int(sys.argv[3]) if len(sys.argv) == 4 else 512
+    nc = 3
+    flat = np.fromfile(filepath, dtype=np.complex128, count=-1, sep="")
+    eta = flat.reshape(nc, nx, ny)
 
-val = np.abs(eta[0]) + np.abs(eta[1]) + np.abs(eta[2])
+val = np.sum(np.abs(eta), axis=0)
 plt.pcolormesh(val)
 plt.xlabel(r"$x$")
 plt.ylabel(r"$y$")
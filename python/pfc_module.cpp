@@ -0,0 +1,115 @@
+
+/*
+ *  Python bindings of the PhaseField engine (pybind11, mpi4py)
+ *
+ *  Every process creates the PhaseField in the same communicator and sees
+ *  its own slab of the fields: eta(c) is a NumPy view (local_nx x ny,
+ *  complex128) of the engine memory, not a copy. The views keep the
+ *  PhaseField alive. After writing to them, call fields_changed().
+ *
+ *      from mpi4py import MPI
+ *      import pfc
+ *      sim = pfc.PhaseField(MPI.COMM_WORLD, "./output/", {"nx": 256, "ny": 256})
+ *      sim.initialize()
+ *      sim.step(80)
+ *      sim.equilibrate()
+ *      print(sim.energy(), abs(sim.eta(0)).mean())
+ */
+
+#include <string>
+#include <stdexcept>
+
+#include <mpi.h>
+#include <mpi4py/mpi4py.h>
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/complex.h>
+
+#include "pfc.h"
+
+namespace py = pybind11;
+
+/*! The MPI communicator of an mpi4py communicator */
+static MPI_Comm get_comm(py::object comm) {
+    MPI_Comm *c = PyMPIComm_Get(comm.ptr());
+    if (c == NULL) throw py::error_already_set();
+    return *c;
+}
+
+/*! Parameters from a dict of {name: value}, see PhaseFieldParameters::set */
+static PhaseFieldParameters get_parameters(py::dict values) {
+    PhaseFieldParameters params;
+    for (auto item : values) {
+        std::string key = py::str(item.first);
+        std::string value = py::str(item.second);
+        if (!params.set(key, value))
+            throw std::invalid_argument("invalid parameter " + key + "=" + value);
+    }
+    return params;
+}
+
+/*! Component c of a field as a NumPy view owned by "self" */
+static py::array local_view(py::object self, complex<double> *field) {
+    PhaseField &pfc = self.cast<PhaseField&>();
+    py::ssize_t ny = pfc.get_ny(), size = sizeof(complex<double>);
+    return py::array_t< complex<double> >({(py::ssize_t) pfc.get_local_nx(), ny},
+            {ny*size, size}, field, self);
+}
+
+static void check_component(PhaseField &pfc, int c) {
+    if (c < 0 || c >= pfc.get_nc())
+        throw py::index_error("component " + std::to_string(c) + " out of range");
+}
+
+PYBIND11_MODULE(pfc, m) {
+    m.doc() = "Phase-field crystal amplitude model with MPI (libpfc)";
+
+    if (import_mpi4py() < 0) throw py::error_already_set();
+
+    py::class_<PhaseField>(m, "PhaseField")
+        .def(py::init([](py::object comm, std::string output_path, py::dict params) {
+                return new PhaseField(get_comm(comm), output_path, get_parameters(params));
+            }), py::arg("comm"), py::arg("output_path") = "./output/",
+            py::arg("params") = py::dict(),
+            "Creates the engine in an mpi4py communicator (collective), params "
+            "are PhaseFieldParameters by name")
+        .def("initialize", &PhaseField::initialize,
+            "Sets eta to the initial state of the parameters")
+        .def("step", &PhaseField::step, py::arg("steps") = 1,
+            "Takes overdamped time steps")
+        .def("equilibrate", &PhaseField::equilibrate,
+            "Mechanical equilibration, returns the iterations")
+        .def("energy", &PhaseField::energy, "Energy density of the whole system")
+        .def("fields_changed", &PhaseField::fields_changed,
+            "Updates the transforms after eta was written (collective)")
+        .def("eta", [](py::object self, int c) {
+                PhaseField &pfc = self.cast<PhaseField&>();
+                check_component(pfc, c);
+                return local_view(self, pfc.get_eta(c));
+            }, py::arg("c"), "Local rows of amplitude c, a view (local_nx x ny)")
+        .def("set_eta", [](PhaseField &pfc, int c,
+                    py::array_t< complex<double>, py::array::c_style | py::array::forcecast> field) {
+                check_component(pfc, c);
+                if (field.ndim() != 2 || field.shape(0) != pfc.get_local_nx()
+                        || field.shape(1) != pfc.get_ny())
+                    throw std::invalid_argument("set_eta: shape must be (local_nx, ny)");
+                pfc.set_eta(c, field.data());
+            }, py::arg("c"), py::arg("field"),
+            "Copies the local rows of amplitude c, call fields_changed() after")
+        .def("write_snapshot", &PhaseField::write_eta_to_snapshot,
+            py::arg("filepath"), py::arg("timestep") = 0)
+        .def("read_snapshot", [](PhaseField &pfc, std::string filepath) {
+                bool ok = pfc.read_eta_from_snapshot(filepath);
+                if (ok) pfc.fields_changed();
+                return ok;
+            }, py::arg("filepath"))
+        .def("write_vtk", &PhaseField::write_eta_to_vtk_file, py::arg("filepath"))
+        .def_property_readonly("nx", &PhaseField::get_nx)
+        .def_property_readonly("ny", &PhaseField::get_ny)
+        .def_property_readonly("nc", &PhaseField::get_nc)
+        .def_property_readonly("local_nx", &PhaseField::get_local_nx)
+        .def_property_readonly("local_nx_start", &PhaseField::get_local_nx_start)
+        .def_property_readonly("timestep", &PhaseField::get_timestep)
+        .def_property_readonly("time", &PhaseField::get_time);
+}
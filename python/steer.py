@@ -0,0 +1,29 @@
+"""
+Runs the engine from Python: OD steps with an equilibration every 80 steps,
+analysing the local slabs in memory (no files).
+
+    make python
+    mpirun -n 4 env PYTHONPATH=lib python3 python/steer.py
+"""
+
+import numpy as np
+from mpi4py import MPI
+
+import pfc
+
+comm = MPI.COMM_WORLD
+sim = pfc.PhaseField(comm, "./output/", {"nx": 256, "ny": 256, "initial_state": "seeds",
+                                         "nparticles": 5, "seed": 1})
+sim.initialize()
+
+for rep in range(10):
+    sim.step(80)
+    sim.equilibrate()
+
+    # views of the local rows, shape (local_nx, ny)
+    amplitude = sum(abs(sim.eta(c)) for c in range(sim.nc))
+    solid = comm.allreduce(np.count_nonzero(amplitude > 0.15), op=MPI.SUM)
+    energy = sim.energy()
+    if comm.rank == 0:
+        print("time %7.1f energy %.10e solid fraction %.3f"
+              % (sim.time, energy, solid/(sim.nx*sim.ny)))
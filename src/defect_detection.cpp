@@ -0,0 +1,141 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+
+#include <mpi.h>
+
+#include "defect_detection.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+// ---------------------------------------------------------------
+// PARAMETERS
+
+// plaquettes are crystalline, if sum_j |eta_j| exceeds this fraction of the
+// perfect lattice value at all corners (lower than in GrainAnalysis, as the
+// amplitudes with nonzero winding vanish at the core)
+const double DefectDetection::solid_threshold = 0.2;
+
+// ---------------------------------------------------------------
+
+DefectDetection::DefectDetection(PhaseField *pfc)
+        : pfc(pfc) {}
+
+vector<Dislocation> DefectDetection::find_dislocations() {
+    PROFILE_SCOPE("defect_detection");
+    int nc = pfc->nc, ny = pfc->ny, local_nx = pfc->local_nx;
+    const Lattice &lattice = pfc->lattice;
+
+    // first row of the next process closes the last row of plaquettes
+    vector< complex<double> > first_row(nc*ny), next_row(nc*ny);
+    for (int c = 0; c < nc; c++)
+        for (int j = 0; j < ny && local_nx > 0; j++)
+            first_row[c*ny + j] = pfc->eta[c][j];
+    pfc->receive_next_row(&first_row[0], &next_row[0], 2*nc*ny, MPI_DOUBLE);
+
+    // inverse of sum_j q_j q_j^T
+    double m[3] = {0.0, 0.0, 0.0};
+    for (int c = 0; c < nc; c++) {
+        m[0] += pfc->q_vec[c][0]*pfc->q_vec[c][0];
+        m[1] += pfc->q_vec[c][0]*pfc->q_vec[c][1];
+        m[2] += pfc->q_vec[c][1]*pfc->q_vec[c][1];
+    }
+    double det = m[0]*m[2] - m[1]*m[1];
+
+    double solid_limit = solid_threshold*nc*pfc->amplitude;
+
+    vector<double> amplitude_sum(ny);
+    vector<double> next_sum(ny);
+    vector<int> winding(nc);
+    vector<Dislocation> dislocations;
+    for (int i = 0; i < local_nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            amplitude_sum[j] = next_sum[j] = 0.0;
+            for (int c = 0; c < nc; c++) {
+                amplitude_sum[j] += abs(pfc->eta[c][i*ny + j]);
+                next_sum[j] += abs((i+1 < local_nx) ? pfc->eta[c][(i+1)*ny + j]
+                                                    : next_row[c*ny + j]);
+            }
+        }
+        for (int j = 0; j < ny; j++) {
+            int jn = (j+1)%ny;
+            if (amplitude_sum[j] < solid_limit || amplitude_sum[jn] < solid_limit
+                    || next_sum[j] < solid_limit || next_sum[jn] < solid_limit)
+                continue;
+
+            // corners (i, j), (i+1, j), (i+1, j+1), (i, j+1): counterclockwise
+            bool nonzero = false;
+            for (int c = 0; c < nc; c++) {
+                const complex<double> *row = pfc->eta[c] + i*ny;
+                const complex<double> *row_x = (i+1 < local_nx) ? pfc->eta[c] + (i+1)*ny
+                                                                : &next_row[c*ny];
+                complex<double> corners[4] = {row[j], row_x[j], row_x[jn], row[jn]};
+                double phase = 0.0;
+                for (int k = 0; k < 4; k++)
+                    phase += arg(corners[(k+1)%4]*conj(corners[k]));
+                winding[c] = (int) std::floor(phase/(2*PI) + 0.5);
+                nonzero = nonzero || winding[c] != 0;
+            }
+            if (!nonzero) continue;
+
+            bool consistent = true;
+            for (int t = 0; t < lattice.num_triads; t++)
+                consistent = consistent && winding[lattice.triads[t][0]]
+                    + winding[lattice.triads[t][1]] + winding[lattice.triads[t][2]] == 0;
+            if (!consistent) continue;
+
+            double s[2] = {0.0, 0.0};
+            for (int c = 0; c < nc; c++) {
+                s[0] += winding[c]*pfc->q_vec[c][0];
+                s[1] += winding[c]*pfc->q_vec[c][1];
+            }
+            Dislocation d;
+            d.x = (i + pfc->local_nx_start + 0.5)*pfc->dx;
+            d.y = (j + 0.5)*pfc->dy;
+            d.burgers[0] = -2*PI*( m[2]*s[0] - m[1]*s[1])/det;
+            d.burgers[1] = -2*PI*(-m[1]*s[0] + m[0]*s[1])/det;
+            dislocations.push_back(d);
+        }
+    }
+    return dislocations;
+}
+
+int DefectDetection::write_dislocations(string filepath, int timestep) {
+    vector<Dislocation> local = find_dislocations();
+
+    // gather x, y, b_x, b_y to root
+    vector<double> local_data;
+    for (size_t d = 0; d < local.size(); d++) {
+        local_data.push_back(local[d].x);
+        local_data.push_back(local[d].y);
+        local_data.push_back(local[d].burgers[0]);
+        local_data.push_back(local[d].burgers[1]);
+    }
+    int mpi_size = pfc->mpi_size;
+    int local_count = local_data.size();
+    vector<int> counts(mpi_size), displs(mpi_size);
+    MPI_Gather(&local_count, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, pfc->comm);
+    int total = 0;
+    for (int r = 0; r < mpi_size; r++) {
+        displs[r] = total;
+        total += counts[r];
+    }
+    vector<double> all_data(total + 1);
+    MPI_Gatherv(local_data.empty() ? NULL : &local_data[0], local_count, MPI_DOUBLE,
+            &all_data[0], &counts[0], &displs[0], MPI_DOUBLE, 0, pfc->comm);
+
+    if (pfc->mpi_rank == 0) {
+        FILE *fp = fopen(filepath.c_str(), "a");
+        if (fp == NULL) {
+            cerr << "Error: couldn't open " << filepath << endl;
+        } else {
+            for (int p = 0; p < total; p += 4)
+                fprintf(fp, "%d %.4f %.4f %.4f %.4f\n", timestep, all_data[p],
+                        all_data[p+1], all_data[p+2], all_data[p+3]);
+            fclose(fp);
+        }
+    }
+    return total/4;
+}
@@ -0,0 +1,267 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#include <mpi.h>
+#include <fftw3-mpi.h>
+
+#include "density_reconstruction.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+DensityReconstruction::DensityReconstruction(PhaseField *pfc)
+        : pfc(pfc) {}
+
+/*! Index of wave number index "k" of an n point spectrum in the spectrum
+ *  of factor*n points, k > (n-1)/2 are the negative wave numbers
+ */
+static ptrdiff_t padded_index(ptrdiff_t k, ptrdiff_t n, int factor) {
+    return k <= (n-1)/2 ? k : k + (factor-1)*n;
+}
+
+/*! Method, that adds component c of phi and |eta_c| of "rows" rows of "field"
+ *
+ *  The cell (i, j) of the grid "factor" times finer than the simulation grid
+ *  is at ((i/factor+1-nx/2)*dx, (j/factor+1-ny/2)*dy), as in the
+ *  initialization methods. The carrier wave is calculated once per row and
+ *  then rotated by exp(i q_y dy/factor) from cell to cell.
+ */
+void DensityReconstruction::accumulate(const complex<double> *field, int c,
+        ptrdiff_t rows, ptrdiff_t row_start, int cols, int factor,
+        vector<double> &phi, vector<double> &amplitude) {
+    double hx = pfc->dx/factor, hy = pfc->dy/factor;
+    double x0 = (1 - pfc->nx/2.0)*pfc->dx, y0 = (1 - pfc->ny/2.0)*pfc->dy;
+    const double *q = pfc->q_vec[c];
+
+    complex<double> rotation = std::polar(1.0, q[1]*hy);
+    for (ptrdiff_t i = 0; i < rows; i++) {
+        double x = x0 + (row_start + i)*hx;
+        complex<double> carrier = std::polar(1.0, q[0]*x + q[1]*y0);
+        for (int j = 0; j < cols; j++) {
+            complex<double> e = field[i*cols + j];
+            phi[i*cols + j] += 2.0*real(e*carrier);
+            amplitude[i*cols + j] += abs(e);
+            carrier *= rotation;
+        }
+    }
+}
+
+/*! Method, that interpolates the amplitudes spectrally to the fine grid and
+ *  reconstructs phi there
+ *
+ *  The coarse spectrum rows are sent to the processes owning the same wave
+ *  numbers of the fine grid. Coarse rows keep their order in the fine grid,
+ *  so every process receives its rows sorted by wave number.
+ */
+void DensityReconstruction::upsample(int factor, ptrdiff_t &local_n,
+        ptrdiff_t &local_start, vector<double> &phi, vector<double> &amplitude) {
+    int nc = pfc->nc, nx = pfc->nx, ny = pfc->ny;
+    ptrdiff_t local_nx = pfc->local_nx, local_nx_start = pfc->local_nx_start;
+    int mpi_size = pfc->mpi_size;
+    MPI_Comm comm = pfc->comm;
+    ptrdiff_t fine_nx = (ptrdiff_t) factor*nx, fine_ny = (ptrdiff_t) factor*ny;
+
+    // spectra of the amplitudes (buffer is free between time steps)
+    pfc->memcopy_eta(pfc->buffer, pfc->eta);
+    pfc->take_fft(pfc->buffer_plan_f);
+
+    ptrdiff_t fine_alloc = fftw_mpi_local_size_2d(fine_nx, fine_ny, comm,
+            &local_n, &local_start);
+
+    // slabs of the coarse and the fine grid on every process
+    long slab[4] = {(long) local_nx_start, (long) local_nx,
+                    (long) local_start, (long) local_n};
+    vector<long> slabs(4*mpi_size);
+    MPI_Allgather(slab, 4, MPI_LONG, &slabs[0], 4, MPI_LONG, comm);
+
+    int row_len = 2*nc*ny;  // doubles of all components of one row
+    vector<int> send_counts(mpi_size, 0), send_displs(mpi_size, 0);
+    vector<int> recv_counts(mpi_size, 0), recv_displs(mpi_size, 0);
+
+    vector<double> send(local_nx*row_len + 1);
+    int p = 0;
+    for (ptrdiff_t i = 0; i < local_nx; i++) {
+        ptrdiff_t f = padded_index(local_nx_start + i, nx, factor);
+        while (f >= slabs[4*p+2] + slabs[4*p+3]) p++;
+        send_counts[p] += row_len;
+        for (int c = 0; c < nc; c++) {
+            for (int j = 0; j < ny; j++) {
+                send[i*row_len + 2*(c*ny+j)] = real(pfc->buffer_k[c][i*ny + j]);
+                send[i*row_len + 2*(c*ny+j) + 1] = imag(pfc->buffer_k[c][i*ny + j]);
+            }
+        }
+    }
+
+    // fine rows of the received coarse rows, in the order of receiving
+    vector<ptrdiff_t> fine_rows;
+    p = 0;
+    for (ptrdiff_t k = 0; k < nx; k++) {
+        ptrdiff_t f = padded_index(k, nx, factor);
+        if (f < local_start || f >= local_start + local_n) continue;
+        while (k >= slabs[4*p] + slabs[4*p+1]) p++;
+        recv_counts[p] += row_len;
+        fine_rows.push_back(f - local_start);
+    }
+
+    for (int r = 1; r < mpi_size; r++) {
+        send_displs[r] = send_displs[r-1] + send_counts[r-1];
+        recv_displs[r] = recv_displs[r-1] + recv_counts[r-1];
+    }
+    vector<double> recv(fine_rows.size()*row_len + 1);
+    MPI_Alltoallv(&send[0], &send_counts[0], &send_displs[0], MPI_DOUBLE,
+            &recv[0], &recv_counts[0], &recv_displs[0], MPI_DOUBLE, comm);
+    vector<double>().swap(send);
+
+    complex<double> *fine = reinterpret_cast<complex<double>*>(fftw_alloc_complex(fine_alloc));
+    fftw_plan fine_plan_b = fftw_mpi_plan_dft_2d(fine_nx, fine_ny,
+            reinterpret_cast<fftw_complex*>(fine), reinterpret_cast<fftw_complex*>(fine),
+            comm, FFTW_BACKWARD, FFTW_ESTIMATE);
+
+    phi.assign(local_n*fine_ny, 0.0);
+    amplitude.assign(local_n*fine_ny, 0.0);
+
+    double scale = 1.0/((double) nx*ny);
+    for (int c = 0; c < nc; c++) {
+        std::fill(fine, fine + local_n*fine_ny, complex<double>(0.0, 0.0));
+        for (size_t m = 0; m < fine_rows.size(); m++) {
+            const double *row = &recv[m*row_len + 2*c*ny];
+            complex<double> *fine_row = fine + fine_rows[m]*fine_ny;
+            for (int j = 0; j < ny; j++) {
+                fine_row[padded_index(j, ny, factor)] =
+                        scale*complex<double>(row[2*j], row[2*j+1]);
+            }
+        }
+        {
+            PROFILE_SCOPE("fft");
+            PROFILE_COUNT("fft_transforms", 1);
+            fftw_execute(fine_plan_b);
+        }
+        accumulate(fine, c, local_n, local_start, fine_ny, factor, phi, amplitude);
+    }
+
+    fftw_destroy_plan(fine_plan_b);
+    fftw_free(fine);
+}
+
+void DensityReconstruction::reconstruct(int factor, ptrdiff_t &local_n,
+        ptrdiff_t &local_start, vector<double> &phi, vector<double> &amplitude) {
+    PROFILE_SCOPE("density_reconstruction");
+
+    if (factor > 1) {
+        upsample(factor, local_n, local_start, phi, amplitude);
+        return;
+    }
+
+    local_n = pfc->local_nx;
+    local_start = pfc->local_nx_start;
+    phi.assign(local_n*pfc->ny, 0.0);
+    amplitude.assign(local_n*pfc->ny, 0.0);
+    for (int c = 0; c < pfc->nc; c++) {
+        accumulate(pfc->eta[c], c, local_n, local_start, pfc->ny, 1, phi, amplitude);
+    }
+}
+
+/*! Method, that writes the density and the amplitudes to a VTK file
+ *
+ *  Legacy VTK with big-endian floats, x is the fastest moving index. The
+ *  local rows of a process are columns of the VTK image, they are written
+ *  collectively through a subarray file view.
+ */
+void DensityReconstruction::write_vtk(string filepath, int factor) {
+    if (factor < 1) factor = 1;
+
+    ptrdiff_t local_n, local_start;
+    vector<double> phi, amplitude;
+    reconstruct(factor, local_n, local_start, phi, amplitude);
+
+    PROFILE_SCOPE("io_write");
+
+    int fine_nx = factor*pfc->nx, fine_ny = factor*pfc->ny;
+    long points = (long) fine_nx*fine_ny;
+
+    // same headers on every process, only root writes them
+    char header[512], phi_header[64];
+    snprintf(header, sizeof(header),
+            "# vtk DataFile Version 3.0\n"
+            "PFC amplitudes and density\n"
+            "BINARY\n"
+            "DATASET STRUCTURED_POINTS\n"
+            "DIMENSIONS %d %d 1\n"
+            "ORIGIN %.10g %.10g 0\n"
+            "SPACING %.10g %.10g 1\n"
+            "POINT_DATA %ld\n"
+            "SCALARS eta float\n"
+            "LOOKUP_TABLE default\n",
+            fine_nx, fine_ny,
+            (1 - pfc->nx/2.0)*pfc->dx, (1 - pfc->ny/2.0)*pfc->dy,
+            pfc->dx/factor, pfc->dy/factor, points);
+    snprintf(phi_header, sizeof(phi_header),
+            "\nSCALARS phi float\nLOOKUP_TABLE default\n");
+    MPI_Offset eta_offset = strlen(header);
+    MPI_Offset phi_offset = eta_offset + points*sizeof(float) + strlen(phi_header);
+
+    // transpose to x fastest and convert to big-endian floats
+    const uint16_t endian_test = 1;
+    bool little_endian = *reinterpret_cast<const char*>(&endian_test) == 1;
+    vector<float> eta_data(local_n*fine_ny + 1), phi_data(local_n*fine_ny + 1);
+    for (ptrdiff_t i = 0; i < local_n; i++) {
+        for (int j = 0; j < fine_ny; j++) {
+            eta_data[j*local_n + i] = (float) amplitude[i*fine_ny + j];
+            phi_data[j*local_n + i] = (float) phi[i*fine_ny + j];
+        }
+    }
+    if (little_endian) {
+        for (size_t k = 0; k < eta_data.size(); k++) {
+            char *e = reinterpret_cast<char*>(&eta_data[k]);
+            char *p = reinterpret_cast<char*>(&phi_data[k]);
+            std::swap(e[0], e[3]); std::swap(e[1], e[2]);
+            std::swap(p[0], p[3]); std::swap(p[1], p[2]);
+        }
+    }
+
+    if (pfc->mpi_rank == 0) MPI_File_delete(filepath.c_str(), MPI_INFO_NULL);
+
+    MPI_File mpi_file;
+    int rcode = MPI_File_open(pfc->comm, filepath.c_str(),
+            MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &mpi_file);
+    if (rcode != MPI_SUCCESS) {
+        cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+
+    if (pfc->mpi_rank == 0) {
+        MPI_File_write_at(mpi_file, 0, header, strlen(header), MPI_CHAR, MPI_STATUS_IGNORE);
+        MPI_File_write_at(mpi_file, phi_offset - strlen(phi_header), phi_header,
+                strlen(phi_header), MPI_CHAR, MPI_STATUS_IGNORE);
+        PROFILE_COUNT("io_bytes_written", strlen(header) + strlen(phi_header));
+    }
+    PROFILE_COUNT("io_bytes_written", 2.0*local_n*fine_ny*sizeof(float));
+
+    // columns [local_start, local_start+local_n) of the fine_ny x fine_nx image
+    MPI_Datatype columns = MPI_FLOAT;
+    if (local_n > 0) {
+        int sizes[2] = {fine_ny, fine_nx};
+        int subsizes[2] = {fine_ny, (int) local_n};
+        int starts[2] = {0, (int) local_start};
+        MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+                MPI_FLOAT, &columns);
+        MPI_Type_commit(&columns);
+    }
+
+    MPI_Offset offsets[2] = {eta_offset, phi_offset};
+    float *data[2] = {&eta_data[0], &phi_data[0]};
+    for (int s = 0; s < 2; s++) {
+        MPI_File_set_view(mpi_file, offsets[s], MPI_FLOAT, columns, "native", MPI_INFO_NULL);
+        rcode = MPI_File_write_all(mpi_file, data[s], local_n*fine_ny, MPI_FLOAT,
+                MPI_STATUS_IGNORE);
+        if (rcode != MPI_SUCCESS)
+            cerr << "Error: couldn't write " << filepath << endl;
+    }
+
+    if (local_n > 0) MPI_Type_free(&columns);
+    MPI_File_close(&mpi_file);
+}
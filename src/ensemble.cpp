@@ -0,0 +1,169 @@
+
+#include <iostream>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <mpi.h>
+
+#include "ensemble.h"
+
+#include <sys/stat.h> // mkdir
+
+Ensemble::Ensemble(MPI_Comm world_, int group_size_, std::string output_path_)
+        : world(world_), output_path(output_path_) {
+    MPI_Comm_rank(world, &world_rank);
+    MPI_Comm_size(world, &world_size);
+
+    if (group_size_ < 1 || group_size_ > world_size) group_size_ = world_size;
+    group_id = world_rank/group_size_;
+    num_groups = (world_size + group_size_ - 1)/group_size_;
+
+    MPI_Comm_split(world, group_id, world_rank, &group);
+    MPI_Comm_rank(group, &group_rank);
+    MPI_Comm_size(group, &group_size);
+
+    if (world_rank == 0 && world_size % group_size_ != 0)
+        cerr << "Warning: " << world_size << " processes don't divide into groups of "
+             << group_size_ << ", the last group is smaller" << endl;
+
+    // counter of the started replicas, lives on world root
+    MPI_Win_allocate(world_rank == 0 ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL,
+            world, &counter, &counter_win);
+    if (world_rank == 0) *counter = 0;
+    MPI_Barrier(world);
+}
+
+Ensemble::~Ensemble() {
+    MPI_Win_free(&counter_win);
+    MPI_Comm_free(&group);
+}
+
+bool Ensemble::read_replicas(string filepath) {
+    std::string text;
+    int len = 0;
+    if (world_rank == 0) {
+        std::ifstream file(filepath.c_str());
+        if (file) {
+            std::stringstream sstream;
+            sstream << file.rdbuf();
+            text = sstream.str();
+            len = text.size();
+        } else {
+            cerr << "Error: couldn't open " << filepath << endl;
+            len = -1;
+        }
+    }
+    MPI_Bcast(&len, 1, MPI_INT, 0, world);
+    if (len < 0) return false;
+    text.resize(len);
+    MPI_Bcast(&text[0], len, MPI_CHAR, 0, world);
+
+    // every process parses the same text
+    replicas.clear();
+    PhaseFieldParameters defaults;
+    std::istringstream lines(text);
+    std::string line;
+    int line_num = 0;
+    while (std::getline(lines, line)) {
+        line_num++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        Replica rep;
+        if (!(words >> rep.name)) continue;
+        rep.params = defaults;
+
+        std::string word;
+        while (words >> word) {
+            size_t eq = word.find('=');
+            if (eq == std::string::npos
+                    || !rep.params.set(word.substr(0, eq), word.substr(eq+1))) {
+                if (world_rank == 0)
+                    cerr << "Error: " << filepath << ":" << line_num
+                         << ": invalid parameter '" << word << "'" << endl;
+                return false;
+            }
+        }
+        if (rep.name == "default") defaults = rep.params;
+        else replicas.push_back(rep);
+    }
+
+    if (world_rank == 0)
+        printf("Ensemble: %d replicas on %d groups of %d processes\n",
+                (int) replicas.size(), num_groups, group_size);
+    return true;
+}
+
+/*! Index of the next replica for this group (collective in group) */
+int Ensemble::next_replica() {
+    int next = 0;
+    if (group_rank == 0) {
+        const int one = 1;
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, counter_win);
+        MPI_Fetch_and_op(&one, &next, MPI_INT, 0, 0, MPI_SUM, counter_win);
+        MPI_Win_unlock(0, counter_win);
+    }
+    MPI_Bcast(&next, 1, MPI_INT, 0, group);
+    return next;
+}
+
+void Ensemble::run() {
+    int n = replicas.size();
+
+    // results, filled on the root of the group that ran the replica
+    vector<double> results(3*n, 0.0);
+
+    double ensemble_start = MPI_Wtime();
+    int r;
+    while ((r = next_replica()) < n) {
+        Replica &rep = replicas[r];
+        std::string path = output_path + rep.name + "/";
+        if (group_rank == 0) {
+            mkdir(path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+            printf("Ensemble: replica %s (%d/%d) started on group %d\n",
+                    rep.name.c_str(), r+1, n, group_id);
+            fflush(stdout);
+        }
+
+        double start = MPI_Wtime();
+        double energy;
+        {
+            PhaseField pfc(group, path, rep.params);
+            pfc.set_log_prefix("[" + rep.name + "] ");
+            pfc.start_calculations("");
+            energy = pfc.calculate_energy(pfc.eta, pfc.eta_k);
+        }
+        double duration = MPI_Wtime() - start;
+
+        if (group_rank == 0) {
+            results[3*r] = group_id;
+            results[3*r+1] = duration;
+            results[3*r+2] = energy;
+            printf("Ensemble: replica %s (%d/%d) finished on group %d in %.1f s, "
+                   "energy: %.16e\n", rep.name.c_str(), r+1, n, group_id,
+                   duration, energy);
+            fflush(stdout);
+        }
+    }
+
+    if (n > 0) {
+        MPI_Allreduce(MPI_IN_PLACE, &results[0], 3*n, MPI_DOUBLE, MPI_SUM, world);
+    }
+    double total = MPI_Wtime() - ensemble_start;
+
+    if (world_rank != 0) return;
+
+    std::string filepath = output_path + "ensemble_summary.txt";
+    FILE *fp = fopen(filepath.c_str(), "w");
+    if (fp == NULL) {
+        cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+    fprintf(fp, "# name group time[s] energy\n");
+    for (int k = 0; k < n; k++) {
+        fprintf(fp, "%s %d %.2f %.16e\n", replicas[k].name.c_str(), (int) results[3*k],
+                results[3*k+1], results[3*k+2]);
+    }
+    fclose(fp);
+    printf("Ensemble: %d replicas finished in %.1f s\n", n, total);
+}
@@ -0,0 +1,67 @@
+
+#include <cstdio>
+#include <algorithm>
+
+#include "equilibration_scheduler.h"
+
+#include "pfc.h"
+
+EquilibrationScheduler::EquilibrationScheduler(PhaseField *pfc,
+        const PhaseFieldParameters &params)
+        : pfc(pfc), adaptive(params.meq_adaptive), fixed_interval(params.od_steps),
+          check_interval(params.meq_check_interval),
+          min_interval(params.meq_min_interval), max_interval(params.meq_max_interval),
+          threshold(params.meq_threshold), steps(0), last_norm(-1.0), reason(""),
+          peak_norm(-1.0) {
+    if (check_interval < 1) check_interval = 1;
+    if (max_interval < min_interval) max_interval = min_interval;
+}
+
+void EquilibrationScheduler::log_decision(int timestep, double norm,
+        const char *decision) {
+    if (log_filepath.empty() || pfc->mpi_rank != 0) return;
+    FILE *fp = fopen(log_filepath.c_str(), "a");
+    if (fp == NULL) return;
+    fprintf(fp, "%d %d %.6e %s\n", timestep, steps, norm, decision);
+    fclose(fp);
+}
+
+bool EquilibrationScheduler::step(int timestep) {
+    steps++;
+
+    const char *decision = NULL;
+    double norm = last_norm;
+
+    if (!adaptive) {
+        if (steps < fixed_interval) return false;
+        // the gradient is memoized for the equilibration that follows
+        norm = pfc->mech_eq.gradient_norm();
+        peak_norm = std::max(peak_norm, norm);
+        decision = "fixed";
+    } else if (steps >= max_interval) {
+        decision = "max_interval";
+    } else if (steps % check_interval == 0) {
+        // eta_k is up to date after an OD step
+        norm = pfc->mech_eq.gradient_norm();
+        peak_norm = std::max(peak_norm, norm);
+        if (steps >= min_interval) {
+            if (norm > threshold)
+                decision = "threshold";
+            else if (last_norm >= 0.0 && 2.0*norm - last_norm > threshold)
+                decision = "growth";
+        }
+        last_norm = norm;
+        if (decision == NULL) {
+            log_decision(timestep, norm, "wait");
+            return false;
+        }
+    } else {
+        return false;
+    }
+
+    log_decision(timestep, norm, decision);
+    reason = decision;
+    steps = 0;
+    last_norm = -1.0;
+    return true;
+}
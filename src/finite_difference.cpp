@@ -0,0 +1,302 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <mpi.h>
+
+#include "finite_difference.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+// fourth order central differences, offsets -2..2
+static const double d2_stencil[5] = {-1.0/12, 16.0/12, -30.0/12, 16.0/12, -1.0/12};
+static const double d1_stencil[5] = {1.0/12, -8.0/12, 0.0, 8.0/12, -1.0/12};
+
+FiniteDifference::FiniteDifference(PhaseField *pfc, const PhaseFieldParameters &params)
+        : pfc(pfc), enabled(params.backend == "finite_difference"),
+          prev_rank(0), next_rank(0), der_x(NULL), der_y(NULL), stages(0),
+          halo_lo(NULL), halo_hi(NULL), work(NULL), g_sq(NULL),
+          stage_a(NULL), stage_b(NULL) {}
+
+FiniteDifference::~FiniteDifference() {
+    free(der_x); free(der_y);
+    free_field(halo_lo); free_field(halo_hi);
+    free_field(work); free_field(g_sq); free_field(stage_a); free_field(stage_b);
+}
+
+complex<double> **FiniteDifference::allocate_field(int rows) {
+    complex<double> **field = (complex<double>**) malloc(sizeof(complex<double>*)*pfc->nc);
+    for (int c = 0; c < pfc->nc; c++)
+        field[c] = (complex<double>*) malloc(sizeof(complex<double>)*rows*pfc->ny);
+    return field;
+}
+
+void FiniteDifference::free_field(complex<double> **field) {
+    if (field == NULL) return;
+    for (int c = 0; c < pfc->nc; c++) free(field[c]);
+    free(field);
+}
+
+void FiniteDifference::setup() {
+    if (!enabled) return;
+    int nx = pfc->nx, nc = pfc->nc, size = pfc->mpi_size;
+
+    int range[2] = {(int) pfc->local_nx_start, (int) pfc->local_nx};
+    vector<int> ranges(2*size);
+    MPI_Allgather(range, 2, MPI_INT, ranges.data(), 2, MPI_INT, pfc->comm);
+
+    // the halos are two rows deep and come from one neighbour each
+    int min_rows = nx;
+    for (int r = 0; r < size; r++)
+        if (ranges[2*r+1] > 0 && ranges[2*r+1] < min_rows) min_rows = ranges[2*r+1];
+    if (min_rows < 2) {
+        if (pfc->mpi_rank == 0)
+            cerr << "Warning: the finite-difference backend needs at least 2 rows "
+                 << "per process, using the spectral backend" << endl;
+        enabled = false;
+        return;
+    }
+
+    // owners of the row before the first local row and after the last one
+    // (periodic), processes without rows are skipped
+    int prev_gl = (pfc->local_nx_start - 1 + nx) % nx;
+    int next_gl = (pfc->local_nx_start + pfc->local_nx) % nx;
+    for (int r = 0; r < size; r++) {
+        if (prev_gl >= ranges[2*r] && prev_gl < ranges[2*r] + ranges[2*r+1]) prev_rank = r;
+        if (next_gl >= ranges[2*r] && next_gl < ranges[2*r] + ranges[2*r+1]) next_rank = r;
+    }
+
+    // G_j = d_xx + d_yy + 2i (q_jx d_x + q_jy d_y)
+    for (int d = 0; d < 5; d++) {
+        lap_x[d] = d2_stencil[d]/(pfc->dx*pfc->dx);
+        lap_y[d] = d2_stencil[d]/(pfc->dy*pfc->dy);
+    }
+    der_x = (double(*)[5]) malloc(sizeof(double)*5*nc);
+    der_y = (double(*)[5]) malloc(sizeof(double)*5*nc);
+    for (int c = 0; c < nc; c++) {
+        for (int d = 0; d < 5; d++) {
+            der_x[c][d] = 2*pfc->q_vec[c][0]*d1_stencil[d]/pfc->dx;
+            der_y[c][d] = 2*pfc->q_vec[c][1]*d1_stencil[d]/pfc->dy;
+        }
+    }
+
+    row_lap.resize(2*pfc->ny);
+    row_der.resize(2*pfc->ny);
+    halo_lo = allocate_field(2);
+    halo_hi = allocate_field(2);
+    work = allocate_field(pfc->local_nx);
+    g_sq = allocate_field(pfc->local_nx);
+    stage_a = allocate_field(pfc->local_nx);
+    stage_b = allocate_field(pfc->local_nx);
+
+    calculate_coefficients();
+}
+
+/*! Upper bound of the spectral radius of the linear part of the OD step,
+ *  (B^l - B^x) + B^x G_j^2, from the symbol of the stencils
+ */
+double FiniteDifference::spectral_radius() const {
+    double g_max = 0.0;
+    for (int c = 0; c < pfc->nc; c++) {
+        // the symbol is f_x(k_x) + f_y(k_y)
+        double range[2][2];
+        for (int d = 0; d < 2; d++) {
+            int n = d == 0 ? pfc->nx : pfc->ny;
+            double h = d == 0 ? pfc->dx : pfc->dy;
+            range[d][0] = 1e300; range[d][1] = -1e300;
+            for (int m = 0; m < n; m++) {
+                double t = 2*PI*m/n;
+                double f = (16*cos(t) - cos(2*t) - 15)/(6*h*h)
+                         - pfc->q_vec[c][d]*(8*sin(t) - sin(2*t))/(3*h);
+                range[d][0] = std::min(range[d][0], f);
+                range[d][1] = std::max(range[d][1], f);
+            }
+        }
+        g_max = std::max(g_max, std::max(range[0][1] + range[1][1],
+                    -(range[0][0] + range[1][0])));
+    }
+    return pfc->bx*g_max*g_max + std::abs(pfc->bl - pfc->bx);
+}
+
+/*! Method, that chooses the number of RKC stages for the time step and
+ *  calculates the stage coefficients
+ *
+ *  With the damping eps, w0 = 1 + eps/s^2 and w1 = T_s(w0)/T_s'(w0) the
+ *  scheme is stable for dt*lambda in [-beta, 0], beta = (1 + w0)/w1. The
+ *  spectral radius gets a 10 % margin for the nonlinear part.
+ */
+void FiniteDifference::calculate_coefficients() {
+    const double eps = 0.05;
+    double rho = 1.1*spectral_radius()*pfc->dt;
+
+    vector<double> t, dt;
+    double w0 = 1.0, w1 = 1.0;
+    for (stages = 1; ; stages++) {
+        int s = stages;
+        w0 = 1.0 + eps/(s*s);
+        // Chebyshev polynomials T_j(w0) and their derivatives
+        t.assign(s+1, 1.0); dt.assign(s+1, 0.0);
+        t[1] = w0; dt[1] = 1.0;
+        for (int j = 2; j <= s; j++) {
+            t[j] = 2*w0*t[j-1] - t[j-2];
+            dt[j] = 2*t[j-1] + 2*w0*dt[j-1] - dt[j-2];
+        }
+        w1 = t[s]/dt[s];
+        if ((1.0 + w0)/w1 >= rho) break;
+    }
+
+    // b_j = 1/T_j(w0)
+    mu.assign(stages+1, 0.0); nu.assign(stages+1, 0.0); mut.assign(stages+1, 0.0);
+    mu[1] = 1.0; mut[1] = w1/w0;
+    for (int j = 2; j <= stages; j++) {
+        mu[j] = 2*w0*t[j-1]/t[j];
+        nu[j] = -t[j-2]/t[j];
+        mut[j] = 2*w1*t[j-1]/t[j];
+    }
+}
+
+double FiniteDifference::workspace_bytes() const {
+    if (!enabled) return 0.0;
+    return pfc->nc*(4.0*pfc->local_nx + 4.0)*pfc->ny*sizeof(complex<double>);
+}
+
+/*! Local row i of component c, -2 and -1 (local_nx and local_nx+1) are
+ *  the halo rows of the previous (next) process
+ */
+const complex<double> *FiniteDifference::row(complex<double> *const *field,
+        int c, int i) const {
+    if (i < 0) return halo_lo[c] + (i+2)*pfc->ny;
+    if (i >= pfc->local_nx) return halo_hi[c] + (i-pfc->local_nx)*pfc->ny;
+    return field[c] + i*pfc->ny;
+}
+
+/*! Method, that applies the stencil of G_c to the local row i of "in"
+ *
+ *  The coefficients are real: the second and the first derivatives are
+ *  summed separately over the doubles of the row (re and im alike, a
+ *  neighbour in y is 2 doubles away), the latter is multiplied by i at
+ *  the end. The first and last two cells wrap around in y.
+ */
+void FiniteDifference::stencil_row(complex<double> *out, complex<double> *const *in,
+        int c, int i) {
+    int ny = pfc->ny, n = 2*ny;
+    const double *r[5];
+    for (int d = 0; d < 5; d++) r[d] = reinterpret_cast<const double*>(row(in, c, i+d-2));
+    const double *dx = der_x[c], *dy = der_y[c];
+    const double center = lap_x[2] + lap_y[2];
+    const double *r0 = r[2];
+    double *lap = row_lap.data(), *der = row_der.data();
+
+    for (int k = 0; k < n; k++) {
+        lap[k] = lap_x[0]*r[0][k] + lap_x[1]*r[1][k] + center*r0[k]
+               + lap_x[3]*r[3][k] + lap_x[4]*r[4][k];
+        der[k] = dx[0]*r[0][k] + dx[1]*r[1][k] + dx[3]*r[3][k] + dx[4]*r[4][k];
+    }
+    for (int k = 4; k < n-4; k++) {
+        lap[k] += lap_y[0]*r0[k-4] + lap_y[1]*r0[k-2] + lap_y[3]*r0[k+2] + lap_y[4]*r0[k+4];
+        der[k] += dy[0]*r0[k-4] + dy[1]*r0[k-2] + dy[3]*r0[k+2] + dy[4]*r0[k+4];
+    }
+    for (int j = 0; j < ny; j++) {
+        if (j >= 2 && j < ny-2) continue;
+        for (int p = 0; p < 2; p++) {
+            double v[5];
+            for (int d = 0; d < 5; d++) v[d] = r0[2*((j+d-2+2*ny) % ny) + p];
+            lap[2*j+p] += lap_y[0]*v[0] + lap_y[1]*v[1] + lap_y[3]*v[3] + lap_y[4]*v[4];
+            der[2*j+p] += dy[0]*v[0] + dy[1]*v[1] + dy[3]*v[3] + dy[4]*v[4];
+        }
+    }
+
+    double *o = reinterpret_cast<double*>(out);
+    for (int j = 0; j < ny; j++) {
+        o[2*j] = lap[2*j] - der[2*j+1];
+        o[2*j+1] = lap[2*j+1] + der[2*j];
+    }
+}
+
+/*! Method, that calculates out_j = G_j in_j ("out" must not be "in")
+ *
+ *  The last two local rows are the lower halo of the next process and the
+ *  first two the upper halo of the previous one. The rows that don't need
+ *  the halos are calculated while the messages are in flight.
+ */
+void FiniteDifference::apply_g(complex<double> **out, complex<double> **in) {
+    PROFILE_SCOPE("fd_stencil");
+    PROFILE_COUNT("fd_halo_exchanges", 1);
+
+    int nc = pfc->nc, ny = pfc->ny, local_nx = pfc->local_nx;
+    if (local_nx == 0) return;
+
+    // rows as pairs of doubles, tags: 2c to the next process, 2c+1 to the previous
+    int count = 2*2*ny;
+    vector<MPI_Request> requests(4*nc);
+    for (int c = 0; c < nc; c++) {
+        MPI_Irecv(halo_lo[c], count, MPI_DOUBLE, prev_rank, 2*c, pfc->comm, &requests[4*c]);
+        MPI_Irecv(halo_hi[c], count, MPI_DOUBLE, next_rank, 2*c+1, pfc->comm,
+                &requests[4*c+1]);
+        MPI_Isend(in[c] + (local_nx-2)*ny, count, MPI_DOUBLE, next_rank, 2*c, pfc->comm,
+                &requests[4*c+2]);
+        MPI_Isend(in[c], count, MPI_DOUBLE, prev_rank, 2*c+1, pfc->comm, &requests[4*c+3]);
+    }
+
+    for (int c = 0; c < nc; c++)
+        for (int i = 2; i < local_nx-2; i++)
+            stencil_row(out[c] + i*ny, in, c, i);
+
+    {
+        PROFILE_SCOPE("fd_halo_wait");
+        MPI_Waitall(4*nc, requests.data(), MPI_STATUSES_IGNORE);
+    }
+
+    int upper_start = std::max(2, local_nx-2);
+    for (int c = 0; c < nc; c++) {
+        for (int i = 0; i < std::min(2, local_nx); i++)
+            stencil_row(out[c] + i*ny, in, c, i);
+        for (int i = upper_start; i < local_nx; i++)
+            stencil_row(out[c] + i*ny, in, c, i);
+    }
+}
+
+void FiniteDifference::apply_g_sq(complex<double> **out, complex<double> **in) {
+    apply_g(work, in);
+    apply_g(out, work);
+}
+
+/*! Method, that takes an overdamped time step with the RKC stages
+ *
+ *  The stages cycle through eta and two work fields. Every stage takes
+ *  one G_j^2 (two halo exchanges) and the nonlinear kernel of the
+ *  spectral step, which gives Y - mut_j dt N(Y) in buffer.
+ */
+void FiniteDifference::time_step(complex<double> **eta) {
+    PROFILE_SCOPE("fd_time_step");
+    PROFILE_COUNT("fd_rkc_stages", stages);
+
+    const KernelTable &kern = kernels(pfc->lattice.type);
+    long n = pfc->local_nx*pfc->ny;
+    double a = pfc->bl - pfc->bx, bx = pfc->bx;
+
+    complex<double> **fields[3] = {eta, stage_a, stage_b};
+    int prev2 = 0, prev = 0;
+    for (int j = 1; j <= stages; j++) {
+        int next = 0;
+        while (next == prev || next == prev2) next++;
+        complex<double> **y = fields[prev], **y2 = fields[prev2], **out = fields[next];
+        double h = mut[j]*pfc->dt;
+
+        apply_g_sq(g_sq, y);
+        kern.od_nonlinear(pfc->buffer, y, h, pfc->tt, pfc->vv, n);
+        for (int c = 0; c < pfc->nc; c++) {
+            for (long k = 0; k < n; k++) {
+                out[c][k] = pfc->buffer[c][k] + (mu[j]-1.0)*y[c][k] + nu[j]*y2[c][k]
+                          - h*(a*y[c][k] + bx*g_sq[c][k]);
+            }
+        }
+        prev2 = prev; prev = next;
+    }
+    if (prev != 0) pfc->memcopy_eta(eta, fields[prev]);
+}
@@ -0,0 +1,327 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <map>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "grain_analysis.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+// ---------------------------------------------------------------
+// PARAMETERS
+
+// cell is crystalline, if sum_j |eta_j| exceeds this fraction of the
+// perfect lattice value
+const double GrainAnalysis::solid_threshold = 0.5;
+// max misorientation of neighbouring cells in the same grain [rad]
+const double GrainAnalysis::angle_tolerance = 1.0*PI/180.0;
+// smaller clusters are not counted as grains
+const int    GrainAnalysis::min_grain_cells = 16;
+
+// ---------------------------------------------------------------
+
+GrainAnalysis::GrainAnalysis(PhaseField *pfc)
+        : pfc(pfc) {}
+
+/*! Wraps an angle to the symmetry period of the lattice centered at zero
+ *
+ *  The lattice is invariant with respect to rotations by 2*pi/(2*nc)
+ *  (60 degrees for the hexagonal lattice).
+ */
+double GrainAnalysis::wrap_angle(double angle) {
+    double period = 2*PI/(2*pfc->nc);
+    return angle - period*std::floor(angle/period + 0.5);
+}
+
+/*! Method, that calculates the local lattice rotation from the phase gradients
+ *
+ *  For a lattice rotated by angle a, eta_j ~ exp(i(R(-a) q_j - q_j).r), so the
+ *  rotated reciprocal vectors are q_j + grad(theta_j). The sign convention is
+ *  the same as in the initialization methods.
+ */
+void GrainAnalysis::calculate_orientation(vector<double> &orientation, vector<char> &solid) {
+    int nc = pfc->nc, ny = pfc->ny, local_nx = pfc->local_nx;
+
+    // first row of the next process is needed for the x differences
+    vector< complex<double> > first_row(nc*ny), next_row(nc*ny);
+    for (int c = 0; c < nc; c++)
+        for (int j = 0; j < ny && local_nx > 0; j++)
+            first_row[c*ny + j] = pfc->eta[c][j];
+    pfc->receive_next_row(&first_row[0], &next_row[0], 2*nc*ny, MPI_DOUBLE);
+
+    double solid_limit = solid_threshold*nc*pfc->amplitude;
+
+    orientation.assign(local_nx*ny, 0.0);
+    solid.assign(local_nx*ny, 0);
+    for (int i = 0; i < local_nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            double amplitude_sum = 0.0;
+            double dot = 0.0, cross = 0.0;
+            for (int c = 0; c < nc; c++) {
+                complex<double> e = pfc->eta[c][i*ny + j];
+                complex<double> e_x = (i+1 < local_nx) ? pfc->eta[c][(i+1)*ny + j]
+                                                       : next_row[c*ny + j];
+                complex<double> e_y = pfc->eta[c][i*ny + (j+1)%ny];
+                amplitude_sum += abs(e);
+
+                // phase differences are wrapped to (-pi, pi] by arg
+                double gx = arg(e_x*conj(e))/pfc->dx;
+                double gy = arg(e_y*conj(e))/pfc->dy;
+                double qx = pfc->q_vec[c][0], qy = pfc->q_vec[c][1];
+                dot += qx*(qx + gx) + qy*(qy + gy);
+                cross += (qx + gx)*qy - (qy + gy)*qx;
+            }
+            solid[i*ny + j] = amplitude_sum > solid_limit;
+            orientation[i*ny + j] = wrap_angle(atan2(cross, dot));
+        }
+    }
+}
+
+void GrainAnalysis::orientation_map(vector<double> &orientation, vector<char> &solid) {
+    calculate_orientation(orientation, solid);
+}
+
+static long find_root(vector<long> &parent, long a) {
+    while (parent[a] != a) {
+        parent[a] = parent[parent[a]];
+        a = parent[a];
+    }
+    return a;
+}
+
+static void unite(vector<long> &parent, long a, long b) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    // smaller index is the root, so that the root is the same on every process
+    if (a < b) parent[b] = a;
+    else if (b < a) parent[a] = b;
+}
+
+static long find_root(std::map<long, long> &parent, long a) {
+    while (parent[a] != a) a = parent[a];
+    return a;
+}
+
+/*! Method, that labels the grains with a parallel connected-components pass
+ *
+ *  Labels are global cell indices (i_gl*ny + j) of the first cell of the
+ *  grain; non-crystalline cells get -1.
+ */
+void GrainAnalysis::label_grains(const vector<double> &orientation,
+        const vector<char> &solid, vector<long> &labels) {
+    int ny = pfc->ny, local_nx = pfc->local_nx;
+    long offset = (long) pfc->local_nx_start*ny;
+
+    // 1) Local union-find
+    vector<long> parent(local_nx*ny);
+    for (long n = 0; n < local_nx*ny; n++) parent[n] = n;
+
+    for (int i = 0; i < local_nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            long n = i*ny + j;
+            if (!solid[n]) continue;
+            long n_y = i*ny + (j+1)%ny;
+            if (solid[n_y] && std::abs(wrap_angle(orientation[n]-orientation[n_y])) < angle_tolerance)
+                unite(parent, n, n_y);
+            if (i+1 < local_nx) {
+                long n_x = (i+1)*ny + j;
+                if (solid[n_x] && std::abs(wrap_angle(orientation[n]-orientation[n_x])) < angle_tolerance)
+                    unite(parent, n, n_x);
+            }
+        }
+    }
+    labels.assign(local_nx*ny, -1);
+    for (long n = 0; n < local_nx*ny; n++)
+        if (solid[n]) labels[n] = find_root(parent, n) + offset;
+
+    // 2) Equivalences across the slab boundary
+    // (label and orientation of the first row of the next process)
+    vector<double> first_row(2*ny, -1.0), next_row(2*ny, -1.0);
+    for (int j = 0; j < ny && local_nx > 0; j++) {
+        first_row[2*j] = labels[j];
+        first_row[2*j+1] = orientation[j];
+    }
+    pfc->receive_next_row(&first_row[0], &next_row[0], 2*ny, MPI_DOUBLE);
+
+    vector<long> pairs;
+    for (int j = 0; j < ny && local_nx > 0; j++) {
+        long n = (local_nx-1)*ny + j;
+        long next_label = (long) next_row[2*j];
+        if (labels[n] >= 0 && next_label >= 0 && next_label != labels[n]
+                && std::abs(wrap_angle(orientation[n]-next_row[2*j+1])) < angle_tolerance) {
+            pairs.push_back(labels[n]);
+            pairs.push_back(next_label);
+        }
+    }
+
+    // 3) Merge the equivalences globally; the number of pairs is at most
+    // ny per process, so every process can resolve all of them
+    int mpi_size = pfc->mpi_size;
+    int local_count = pairs.size();
+    vector<int> counts(mpi_size), displs(mpi_size);
+    MPI_Allgather(&local_count, 1, MPI_INT, &counts[0], 1, MPI_INT, pfc->comm);
+    int total = 0;
+    for (int r = 0; r < mpi_size; r++) {
+        displs[r] = total;
+        total += counts[r];
+    }
+    vector<long> all_pairs(total + 1);
+    MPI_Allgatherv(pairs.empty() ? NULL : &pairs[0], local_count, MPI_LONG,
+            &all_pairs[0], &counts[0], &displs[0], MPI_LONG, pfc->comm);
+
+    std::map<long, long> global_parent;
+    for (int p = 0; p < total; p++)
+        global_parent[all_pairs[p]] = all_pairs[p];
+    for (int p = 0; p < total; p += 2) {
+        long a = find_root(global_parent, all_pairs[p]);
+        long b = find_root(global_parent, all_pairs[p+1]);
+        if (a < b) global_parent[b] = a;
+        else if (b < a) global_parent[a] = b;
+    }
+    if (!global_parent.empty()) {
+        for (long n = 0; n < local_nx*ny; n++) {
+            if (labels[n] < 0) continue;
+            std::map<long, long>::iterator it = global_parent.find(labels[n]);
+            if (it != global_parent.end())
+                labels[n] = find_root(global_parent, labels[n]);
+        }
+    }
+}
+
+/*! Method, that calculates grain count, sizes, orientation and boundary length
+ *
+ *  Collective; the results are valid on root process only.
+ */
+GrainStatistics GrainAnalysis::calculate_statistics() {
+    PROFILE_SCOPE("grain_analysis");
+    int ny = pfc->ny, local_nx = pfc->local_nx;
+
+    vector<double> orientation;
+    vector<char> solid;
+    calculate_orientation(orientation, solid);
+
+    vector<long> labels;
+    label_grains(orientation, solid, labels);
+
+    // Local contributions per grain: <label, cells, sum cos, sum sin>
+    // (orientation is averaged as a direction with the lattice period)
+    double period_factor = 2*pfc->nc;
+    std::map<long, std::vector<double> > local_grains;
+    long solid_cells = 0;
+    for (long n = 0; n < local_nx*ny; n++) {
+        if (labels[n] < 0) continue;
+        std::vector<double> &g = local_grains[labels[n]];
+        if (g.empty()) g.assign(3, 0.0);
+        g[0] += 1.0;
+        g[1] += cos(period_factor*orientation[n]);
+        g[2] += sin(period_factor*orientation[n]);
+        solid_cells++;
+    }
+
+    // Grain perimeter: edges between cells with different labels
+    vector<double> first_row(ny, -1.0), next_row(ny, -1.0);
+    for (int j = 0; j < ny && local_nx > 0; j++)
+        first_row[j] = labels[j];
+    pfc->receive_next_row(&first_row[0], &next_row[0], ny, MPI_DOUBLE);
+
+    double perimeter = 0.0;
+    for (int i = 0; i < local_nx; i++) {
+        for (int j = 0; j < ny; j++) {
+            long a = labels[i*ny + j];
+            long b_y = labels[i*ny + (j+1)%ny];
+            long b_x = (i+1 < local_nx) ? labels[(i+1)*ny + j] : (long) next_row[j];
+            if (a != b_y) perimeter += ((a >= 0) + (b_y >= 0))*pfc->dx;
+            if (a != b_x) perimeter += ((a >= 0) + (b_x >= 0))*pfc->dy;
+        }
+    }
+
+    // Gather grain contributions to root
+    vector<double> local_data;
+    for (std::map<long, std::vector<double> >::iterator it = local_grains.begin();
+            it != local_grains.end(); ++it) {
+        local_data.push_back((double) it->first);
+        local_data.insert(local_data.end(), it->second.begin(), it->second.end());
+    }
+    int mpi_size = pfc->mpi_size;
+    int local_count = local_data.size();
+    vector<int> counts(mpi_size), displs(mpi_size);
+    MPI_Gather(&local_count, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, pfc->comm);
+    int total = 0;
+    for (int r = 0; r < mpi_size; r++) {
+        displs[r] = total;
+        total += counts[r];
+    }
+    vector<double> all_data(total + 1);
+    MPI_Gatherv(local_data.empty() ? NULL : &local_data[0], local_count, MPI_DOUBLE,
+            &all_data[0], &counts[0], &displs[0], MPI_DOUBLE, 0, pfc->comm);
+
+    double sums[2] = {perimeter, (double) solid_cells};
+    double global_sums[2] = {0.0, 0.0};
+    MPI_Reduce(sums, global_sums, 2, MPI_DOUBLE, MPI_SUM, 0, pfc->comm);
+
+    GrainStatistics stats;
+    stats.num_grains = 0;
+    stats.mean_area = stats.std_area = stats.mean_orientation = 0.0;
+    stats.boundary_length = 0.5*global_sums[0];
+    stats.solid_fraction = global_sums[1]/((double) pfc->nx*ny);
+
+    if (pfc->mpi_rank == 0) {
+        std::map<long, std::vector<double> > grains;
+        for (int p = 0; p < total; p += 4) {
+            std::vector<double> &g = grains[(long) all_data[p]];
+            if (g.empty()) g.assign(3, 0.0);
+            for (int k = 0; k < 3; k++) g[k] += all_data[p+1+k];
+        }
+        double cell_area = pfc->dx*pfc->dy;
+        double sum_cos = 0.0, sum_sin = 0.0;
+        for (std::map<long, std::vector<double> >::iterator it = grains.begin();
+                it != grains.end(); ++it) {
+            if (it->second[0] < min_grain_cells) continue;
+            stats.areas.push_back(it->second[0]*cell_area);
+            sum_cos += it->second[1];
+            sum_sin += it->second[2];
+        }
+        std::sort(stats.areas.rbegin(), stats.areas.rend());
+        stats.num_grains = stats.areas.size();
+        for (int g = 0; g < stats.num_grains; g++)
+            stats.mean_area += stats.areas[g]/stats.num_grains;
+        for (int g = 0; g < stats.num_grains; g++)
+            stats.std_area += (stats.areas[g]-stats.mean_area)*(stats.areas[g]-stats.mean_area)
+                              /stats.num_grains;
+        stats.std_area = std::sqrt(stats.std_area);
+        stats.mean_orientation = atan2(sum_sin, sum_cos)/period_factor;
+    }
+    return stats;
+}
+
+GrainStatistics GrainAnalysis::write_statistics(string filepath, string sizes_filepath,
+        int timestep) {
+    GrainStatistics stats = calculate_statistics();
+
+    if (pfc->mpi_rank == 0) {
+        FILE *fp = fopen(filepath.c_str(), "a");
+        if (fp == NULL) {
+            cerr << "Error: couldn't open " << filepath << endl;
+        } else {
+            fprintf(fp, "%d %.2f %d %.6e %.6e %.6f %.6e %.6f\n", timestep, timestep*pfc->dt,
+                    stats.num_grains, stats.mean_area, stats.std_area,
+                    stats.mean_orientation*180.0/PI, stats.boundary_length,
+                    stats.solid_fraction);
+            fclose(fp);
+        }
+        fp = fopen(sizes_filepath.c_str(), "a");
+        if (fp != NULL) {
+            fprintf(fp, "%d", timestep);
+            for (int g = 0; g < stats.num_grains; g++)
+                fprintf(fp, " %.4e", stats.areas[g]);
+            fprintf(fp, "\n");
+            fclose(fp);
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,226 @@
+
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+#include "kernels.h"
+
+// ---------------------------------------------------------------
+// Scalar reference kernels
+
+/*! Nonlinear parts N_c of the amplitudes of lattice L at one cell */
+template <typename L>
+static inline void nonlinear(const complex<double> *eta, double tt, double vv,
+        complex<double> *out) {
+    double nn[L::nc], aa = 0.0;
+    for (int c = 0; c < L::nc; c++) {
+        nn[c] = norm(eta[c]);
+        aa += nn[c];
+    }
+    aa *= 2;
+    for (int c = 0; c < L::nc; c++)
+        out[c] = 3*vv*(aa-nn[c])*eta[c];
+    for (int t = 0; t < L::num_triads; t++) {
+        const int *tr = L::triads[t];
+        out[tr[0]] -= 2*tt*conj(eta[tr[1]])*conj(eta[tr[2]]);
+        out[tr[1]] -= 2*tt*conj(eta[tr[0]])*conj(eta[tr[2]]);
+        out[tr[2]] -= 2*tt*conj(eta[tr[0]])*conj(eta[tr[1]]);
+    }
+}
+
+template <typename L>
+static void od_nonlinear_scalar(complex<double> *const out[], complex<double> *const eta[],
+        double dt, double tt, double vv, long n) {
+    for (long k = 0; k < n; k++) {
+        complex<double> e[L::nc], nl[L::nc];
+        for (int c = 0; c < L::nc; c++) e[c] = eta[c][k];
+        nonlinear<L>(e, tt, vv, nl);
+        for (int c = 0; c < L::nc; c++)
+            out[c][k] = e[c] - dt*nl[c];
+    }
+}
+
+template <typename L>
+static double energy_density_scalar(complex<double> *const eta[], complex<double> *const buf[],
+        double bx, double bl, double tt, double vv, long n) {
+    double sum = 0.0;
+    for (long k = 0; k < n; k++) {
+        double aa = 0.0, n4 = 0.0, gg = 0.0, cubic = 0.0;
+        for (int c = 0; c < L::nc; c++) {
+            double nn = norm(eta[c][k]);
+            aa += nn;
+            n4 += nn*nn;
+            gg += norm(buf[c][k]);
+        }
+        aa *= 2;
+        for (int t = 0; t < L::num_triads; t++) {
+            const int *tr = L::triads[t];
+            cubic += real(eta[tr[0]][k]*eta[tr[1]][k]*eta[tr[2]][k]);
+        }
+        sum += aa*(bl-bx)/2.0 + (3.0/4.0)*vv*aa*aa
+             - 4*tt*cubic
+             + bx*gg
+             - (3.0/2.0)*vv*n4;
+    }
+    return sum;
+}
+
+template <typename L>
+static void grad_theta_scalar(double *const grad[], complex<double> *const eta[],
+        complex<double> *const buf[], double bx, double bl, double tt, double vv, long n) {
+    for (long k = 0; k < n; k++) {
+        complex<double> e[L::nc], nl[L::nc];
+        for (int c = 0; c < L::nc; c++) e[c] = eta[c][k];
+        nonlinear<L>(e, tt, vv, nl);
+        double im[L::nc];
+        for (int c = 0; c < L::nc; c++) {
+            complex<double> var_f_eta = (bl-bx)*e[c] + bx*buf[c][k] + nl[c];
+            im[c] = imag(conj(e[c])*var_f_eta);
+        }
+        for (int c = 0; c < L::nc; c++) {
+            double dtheta = 0.0;
+            for (int d = 0; d < L::nc; d++)
+                dtheta += L::qq(c, d)*im[d];
+            grad[c][k] = dtheta;
+        }
+    }
+}
+
+static void scale_scalar(complex<double> *data, const double *f, long n) {
+    for (long k = 0; k < n; k++)
+        data[k] *= f[k];
+}
+
+static void scale_sq_scalar(complex<double> *data, const double *f, long n) {
+    for (long k = 0; k < n; k++)
+        data[k] *= f[k]*f[k];
+}
+
+static void od_kspace_scalar(complex<double> *out, const complex<double> *in, const double *g,
+        double dt, double bx, double bl, long n) {
+    for (long k = 0; k < n; k++)
+        out[k] = in[k] / (1.0 + dt*(bl-bx+bx*g[k]*g[k]));
+}
+
+// ---------------------------------------------------------------
+// Philox4x32-10 and the Gaussian noise
+
+static const double two_pow_32 = 4294967296.0;
+
+/*! ctr = Philox4x32-10(ctr, key) */
+static inline void philox(uint32_t ctr[4], uint64_t key) {
+    uint32_t k0 = (uint32_t) key, k1 = (uint32_t) (key >> 32);
+    for (int r = 0; r < 10; r++) {
+        uint64_t p0 = (uint64_t) 0xD2511F53u*ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57u*ctr[2];
+        uint32_t c0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[1] = (uint32_t) p1;
+        ctr[3] = (uint32_t) p0;
+        ctr[0] = c0;
+        ctr[2] = c2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+}
+
+/*! Complex Gaussian of cell noise.cell + k with E|xi|^2 = variance
+ *
+ *  A counter gives the cells 2p and 2p+1, each the Box-Muller transform of
+ *  two 32-bit words (the tails are cut at 6.8 standard deviations).
+ */
+static inline complex<double> gaussian(const NoiseStream &noise, long k, double variance) {
+    uint64_t cell = noise.cell + k;
+    uint64_t pair = cell/2;
+    uint32_t ctr[4] = {(uint32_t) pair, (uint32_t) (pair >> 32), noise.step, noise.component};
+    philox(ctr, noise.key);
+    int w = (cell % 2)*2;
+    double u1 = (ctr[w] + 0.5)/two_pow_32;      // (0, 1)
+    double u2 = ctr[w+1]/two_pow_32;            // [0, 1)
+    double r = sqrt(-log(u1)*variance);
+    return complex<double>(r*cos(2*M_PI*u2), r*sin(2*M_PI*u2));
+}
+
+static void od_kspace_noise_scalar(complex<double> *out, const complex<double> *in,
+        const double *g, double dt, double bx, double bl, const NoiseStream &noise, long n) {
+    double aa = noise.amplitude*noise.amplitude;
+    for (long k = 0; k < n; k++) {
+        double variance = (noise.q_sq < 0.0) ? aa : aa*std::max(noise.q_sq - g[k], 0.0);
+        out[k] = (in[k] + gaussian(noise, k, variance)) / (1.0 + dt*(bl-bx+bx*g[k]*g[k]));
+    }
+}
+
+static void add_noise_scalar(complex<double> *data, const NoiseStream &noise, long n) {
+    double aa = noise.amplitude*noise.amplitude;
+    for (long k = 0; k < n; k++)
+        data[k] += gaussian(noise, k, aa);
+}
+
+static void rotate_phases_scalar(complex<double> *out, const complex<double> *in,
+        const double *dir, double scale, double *angle_out, long n) {
+    for (long k = 0; k < n; k++) {
+        double angle = scale*dir[k];
+        out[k] = in[k]*exp(complex<double>(0.0, 1.0)*angle);
+        if (angle_out) angle_out[k] = angle;
+    }
+}
+
+#define SCALAR_KERNELS(L) {                 \
+        "scalar",                           \
+        od_nonlinear_scalar<L>,             \
+        energy_density_scalar<L>,           \
+        grad_theta_scalar<L>,               \
+        scale_scalar,                       \
+        scale_sq_scalar,                    \
+        od_kspace_scalar,                   \
+        od_kspace_noise_scalar,             \
+        add_noise_scalar,                   \
+        rotate_phases_scalar                \
+    }
+
+// in the order of LatticeType
+const KernelTable scalar_kernels[NUM_LATTICES] = {
+    SCALAR_KERNELS(HexagonalLattice),
+    SCALAR_KERNELS(SquareLattice)
+};
+
+// ---------------------------------------------------------------
+// Runtime dispatch
+
+static bool supported(const KernelTable *tables) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (tables == avx512_kernels) return __builtin_cpu_supports("avx512f");
+    if (tables == avx2_kernels)
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+    if (tables != scalar_kernels) return false;
+#endif
+    return true;
+}
+
+static const KernelTable *best_kernels() {
+    if (supported(avx512_kernels)) return avx512_kernels;
+    if (supported(avx2_kernels)) return avx2_kernels;
+    return scalar_kernels;
+}
+
+// tables of the selected instruction set
+static const KernelTable *selected = NULL;
+
+const KernelTable &kernels(LatticeType lattice) {
+    if (selected == NULL) selected = best_kernels();
+    return selected[lattice];
+}
+
+bool select_kernels(const std::string &name) {
+    const KernelTable *tables;
+    if (name == "auto") tables = best_kernels();
+    else if (name == "scalar") tables = scalar_kernels;
+    else if (name == "avx2") tables = avx2_kernels;
+    else if (name == "avx512") tables = avx512_kernels;
+    else return false;
+
+    if (!supported(tables)) return false;
+    selected = tables;
+    return true;
+}
@@ -0,0 +1,10 @@
+
+/*
+ *  AVX2 kernels (4 lanes), compiled with -mavx2 -mfma
+ */
+
+#define SIMD_WIDTH 4
+#define SIMD_NAME "avx2"
+#define SIMD_TABLE avx2_kernels
+
+#include "kernels_simd.h"
@@ -0,0 +1,10 @@
+
+/*
+ *  AVX-512 kernels (8 lanes), compiled with -mavx512f -mfma
+ */
+
+#define SIMD_WIDTH 8
+#define SIMD_NAME "avx512"
+#define SIMD_TABLE avx512_kernels
+
+#include "kernels_simd.h"
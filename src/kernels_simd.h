@@ -0,0 +1,480 @@
+/*
+ *  Vectorized kernels, written once with the GCC vector extensions and
+ *  compiled for every instruction set by kernels_<isa>.cpp, which defines
+ *
+ *    SIMD_WIDTH    doubles per vector (4: AVX2, 8: AVX-512)
+ *    SIMD_NAME     name of the kernel table
+ *    SIMD_TABLE    variable of the kernel tables (one per lattice)
+ *
+ *  The complex fields are split to real and imaginary lanes on load and
+ *  interleaved again on store. The remainder of n/SIMD_WIDTH cells is
+ *  done by the scalar kernels (the lattice independent ones are taken
+ *  from the hexagonal table).
+ *
+ *  The lattice dependent kernels are templates on the lattice descriptor,
+ *  their component loops have constant trip counts and q_c.q_d are
+ *  constants.
+ */
+
+#include <cstring>
+#include <cmath>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#include "kernels.h"
+
+namespace {
+
+const int W = SIMD_WIDTH;
+
+typedef double vd __attribute__((vector_size(8*SIMD_WIDTH)));
+typedef long long vl __attribute__((vector_size(8*SIMD_WIDTH)));
+typedef unsigned long long vu __attribute__((vector_size(8*SIMD_WIDTH)));
+
+#if SIMD_WIDTH == 4
+const vu lanes = {0, 1, 2, 3};
+const vl mask_re = {0, 2, 4, 6};
+const vl mask_im = {1, 3, 5, 7};
+const vl mask_lo = {0, 4, 1, 5};
+const vl mask_hi = {2, 6, 3, 7};
+#elif SIMD_WIDTH == 8
+const vu lanes = {0, 1, 2, 3, 4, 5, 6, 7};
+const vl mask_re = {0, 2, 4, 6, 8, 10, 12, 14};
+const vl mask_im = {1, 3, 5, 7, 9, 11, 13, 15};
+const vl mask_lo = {0, 8, 1, 9, 2, 10, 3, 11};
+const vl mask_hi = {4, 12, 5, 13, 6, 14, 7, 15};
+#endif
+
+inline vd load(const double *p) { vd v; std::memcpy(&v, p, sizeof(vd)); return v; }
+inline void store(double *p, vd v) { std::memcpy(p, &v, sizeof(vd)); }
+inline vd broadcast(double x) { vd v = {}; return v + x; }
+
+/*! Loads W complex numbers as real and imaginary lanes */
+inline void load_complex(const complex<double> *p, vd &re, vd &im) {
+    const double *d = reinterpret_cast<const double*>(p);
+    vd a = load(d), b = load(d + W);
+    re = __builtin_shuffle(a, b, mask_re);
+    im = __builtin_shuffle(a, b, mask_im);
+}
+
+inline void store_complex(complex<double> *p, vd re, vd im) {
+    double *d = reinterpret_cast<double*>(p);
+    store(d, __builtin_shuffle(re, im, mask_lo));
+    store(d + W, __builtin_shuffle(re, im, mask_hi));
+}
+
+inline double sum_lanes(vd v) {
+    double s = 0.0;
+    for (int l = 0; l < W; l++) s += v[l];
+    return s;
+}
+
+/*! Shifts the pointers of the nc components by k cells */
+template <int nc, typename T>
+inline void offset(T *const in[], T *out[], long k) {
+    for (int c = 0; c < nc; c++) out[c] = in[c] + k;
+}
+
+// ---------------------------------------------------------------
+// sincos: reduction by pi/2 in three parts and the minimax polynomials
+// of Cephes on [-pi/4, pi/4], accurate to ~1 ulp for |x| < sincos_limit
+
+const double sincos_limit = 1.0e6;
+const double two_over_pi = 0.63661977236758134308;
+const double pio2_1 = 1.57079625129699707031;
+const double pio2_2 = 7.54978941586159635335e-8;
+const double pio2_3 = 5.39030285815811905290e-15;
+const double round_magic = 6755399441055744.0;     // 1.5*2^52
+
+inline bool in_sincos_range(vd x) {
+    vl out = (x > sincos_limit) | (x < -sincos_limit) | (x != x);
+    for (int l = 0; l < W; l++)
+        if (out[l]) return false;
+    return true;
+}
+
+inline void sincos(vd x, vd &s, vd &c) {
+    vd t = x*two_over_pi + round_magic;
+    vl q = (vl) t;                      // n in the low bits
+    vd n = t - round_magic;
+    vd r = ((x - n*pio2_1) - n*pio2_2) - n*pio2_3;
+    vd z = r*r;
+
+    vd ps = ((((( 1.58962301576546568060e-10*z - 2.50507477628578072866e-8)*z
+            + 2.75573136213857245213e-6)*z - 1.98412698295895385996e-4)*z
+            + 8.33333333332211858878e-3)*z - 1.66666666666666307295e-1);
+    vd pc = (((((-1.13585365213876817300e-11*z + 2.08757008419747316778e-9)*z
+            - 2.75573141792967388112e-7)*z + 2.48015872888517045348e-5)*z
+            - 1.38888888888730564116e-3)*z + 4.16666666666665929218e-2);
+    vd sin_r = r + r*z*ps;
+    vd cos_r = 1.0 - 0.5*z + z*z*pc;
+
+    // quadrant: sin(x) = sin_r, cos_r, -sin_r, -cos_r for q = 0..3
+    vl swap = (q & 1) != 0;
+    vd sv = swap ? cos_r : sin_r;
+    vd cv = swap ? sin_r : cos_r;
+    s = ((q & 2) != 0) ? -sv : sv;
+    c = (((q + 1) & 2) != 0) ? -cv : cv;
+}
+
+// ---------------------------------------------------------------
+// log: fdlibm's reduction to [sqrt(2)/2, sqrt(2)) and its polynomial in
+// s = (m-1)/(m+1), for positive normal x
+
+const double two_pow_52 = 4503599627370496.0;
+const unsigned long long exponent_52 = 0x4330000000000000ULL;   // bits of 2^52
+const double sqrt2 = 1.41421356237309504880;
+const double ln2_hi = 6.93147180369123816490e-01;
+const double ln2_lo = 1.90821492927058770002e-10;
+
+/*! x as double, for x < 2^52 */
+inline vd to_double(vu x) { return (vd) (x | exponent_52) - two_pow_52; }
+
+inline vd logarithm(vd x) {
+    vu bits = (vu) x;
+    vd e = to_double(bits >> 52) - 1023.0;
+    vd m = (vd) ((bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL);
+    vl big = m > sqrt2;
+    m = big ? 0.5*m : m;
+    e = big ? e + 1.0 : e;
+
+    vd f = m - 1.0;
+    vd s = f/(2.0 + f);
+    vd z = s*s;
+    vd w = z*z;
+    vd t1 = w*(3.999999999940941908e-01 + w*(2.222219843214978396e-01
+            + w*1.531383769920937332e-01));
+    vd t2 = z*(6.666666666666735130e-01 + w*(2.857142874366239149e-01
+            + w*(1.818357216161805012e-01 + w*1.479819860511658591e-01)));
+    vd hfsq = 0.5*f*f;
+    return e*ln2_hi - ((hfsq - (s*(hfsq + t1 + t2) + e*ln2_lo)) - f);
+}
+
+// ---------------------------------------------------------------
+// Philox4x32-10 of W counters (32-bit words in 64-bit lanes) and the
+// Gaussian noise, the same numbers as gaussian() of kernels.cpp
+
+const unsigned long long low_32 = 0xFFFFFFFFULL;
+
+const double two_pow_32 = 4294967296.0;
+
+/*! Products of the low 32 bits of the lanes (GCC multiplies the full 64 bits,
+ *  so the intrinsics are used where available)
+ */
+inline vu mul_32(vu a, vu b) {
+#if SIMD_WIDTH == 8 && defined(__AVX512F__)
+    return (vu) _mm512_maskz_mul_epu32(0xFF, (__m512i) a, (__m512i) b);
+#elif SIMD_WIDTH == 4 && defined(__AVX2__)
+    return (vu) _mm256_mul_epu32((__m256i) a, (__m256i) b);
+#else
+    return (a & low_32)*(b & low_32);
+#endif
+}
+
+/*! sqrt of the lanes (the vector extensions have no sqrt) */
+inline vd sqrt_lanes(vd x) {
+#if SIMD_WIDTH == 8 && defined(__AVX512F__)
+    return (vd) _mm512_maskz_sqrt_pd(0xFF, (__m512d) x);
+#elif SIMD_WIDTH == 4 && defined(__AVX2__)
+    return (vd) _mm256_sqrt_pd((__m256d) x);
+#else
+    for (int k = 0; k < W; k++) x[k] = std::sqrt(x[k]);
+    return x;
+#endif
+}
+
+inline void philox(vu ctr[4], uint64_t key) {
+    vu zero = {};
+    vu m0 = zero + 0xD2511F53ULL, m1 = zero + 0xCD9E8D57ULL;
+    unsigned long long k0 = key & low_32, k1 = key >> 32;
+    for (int r = 0; r < 10; r++) {
+        vu p0 = mul_32(ctr[0], m0);
+        vu p1 = mul_32(ctr[2], m1);
+        vu c0 = (p1 >> 32) ^ ctr[1] ^ k0;
+        vu c2 = (p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[1] = p1 & low_32;
+        ctr[3] = p0 & low_32;
+        ctr[0] = c0;
+        ctr[2] = c2;
+        k0 = (k0 + 0x9E3779B9ULL) & low_32;
+        k1 = (k1 + 0xBB67AE85ULL) & low_32;
+    }
+}
+
+/*! Box-Muller of the 32-bit words x and y, E|xi|^2 = variance */
+inline void box_muller(vu x, vu y, vd variance, vd &re, vd &im) {
+    vd u1 = (to_double(x) + 0.5)/two_pow_32;
+    vd u2 = to_double(y)/two_pow_32;
+    vd r = sqrt_lanes(-logarithm(u1)*variance);
+    vd s, c;
+    sincos((2*M_PI)*u2, s, c);
+    re = r*c;
+    im = r*s;
+}
+
+/*! Complex Gaussians of the 2W cells noise.cell + k + [0, 2W), the cell
+ *  index has to be even; E|xi|^2 = variance_lo, variance_hi of the halves
+ */
+inline void gaussian(const NoiseStream &noise, long k, vd variance_lo, vd variance_hi,
+        vd re[2], vd im[2]) {
+    vu zero = {};
+    vu pair = lanes + (noise.cell + k)/2;
+    vu ctr[4] = {pair & low_32, pair >> 32, zero + noise.step, zero + noise.component};
+    philox(ctr, noise.key);
+    // even and odd cells, interleaved to the cell order
+    vd variance_even = __builtin_shuffle(variance_lo, variance_hi, mask_re);
+    vd variance_odd = __builtin_shuffle(variance_lo, variance_hi, mask_im);
+    vd even_re, even_im, odd_re, odd_im;
+    box_muller(ctr[0], ctr[1], variance_even, even_re, even_im);
+    box_muller(ctr[2], ctr[3], variance_odd, odd_re, odd_im);
+    re[0] = __builtin_shuffle(even_re, odd_re, mask_lo);
+    re[1] = __builtin_shuffle(even_re, odd_re, mask_hi);
+    im[0] = __builtin_shuffle(even_im, odd_im, mask_lo);
+    im[1] = __builtin_shuffle(even_im, odd_im, mask_hi);
+}
+
+// ---------------------------------------------------------------
+
+/*! Nonlinear parts N_c of the amplitudes of lattice L */
+template <typename L>
+inline void nonlinear(const vd er[], const vd ei[], vd tt, vd vv, vd nr[], vd ni[]) {
+    vd nn[L::nc], aa = broadcast(0.0);
+    for (int c = 0; c < L::nc; c++) {
+        nn[c] = er[c]*er[c] + ei[c]*ei[c];
+        aa += nn[c];
+    }
+    aa = 2.0*aa;
+    for (int c = 0; c < L::nc; c++) {
+        vd f = 3.0*vv*(aa - nn[c]);
+        nr[c] = f*er[c];
+        ni[c] = f*ei[c];
+    }
+    for (int t = 0; t < L::num_triads; t++) {
+        for (int m = 0; m < 3; m++) {
+            int c = L::triads[t][m], a = L::triads[t][(m+1) % 3], b = L::triads[t][(m+2) % 3];
+            // conj(eta_a)*conj(eta_b)
+            vd pr = er[a]*er[b] - ei[a]*ei[b];
+            vd pi = -(er[a]*ei[b] + ei[a]*er[b]);
+            nr[c] -= 2.0*tt*pr;
+            ni[c] -= 2.0*tt*pi;
+        }
+    }
+}
+
+template <typename L>
+void od_nonlinear_simd(complex<double> *const out[], complex<double> *const eta[],
+        double dt, double tt, double vv, long n) {
+    vd vdt = broadcast(dt), vtt = broadcast(tt), vvv = broadcast(vv);
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd er[L::nc], ei[L::nc], nr[L::nc], ni[L::nc];
+        for (int c = 0; c < L::nc; c++) load_complex(eta[c] + k, er[c], ei[c]);
+        nonlinear<L>(er, ei, vtt, vvv, nr, ni);
+        for (int c = 0; c < L::nc; c++)
+            store_complex(out[c] + k, er[c] - vdt*nr[c], ei[c] - vdt*ni[c]);
+    }
+    if (k < n) {
+        complex<double> *o[L::nc], *e[L::nc];
+        offset<L::nc>(out, o, k); offset<L::nc>(eta, e, k);
+        scalar_kernels[L::type].od_nonlinear(o, e, dt, tt, vv, n - k);
+    }
+}
+
+template <typename L>
+double energy_density_simd(complex<double> *const eta[], complex<double> *const buf[],
+        double bx, double bl, double tt, double vv, long n) {
+    vd acc = broadcast(0.0);
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd er[L::nc], ei[L::nc];
+        vd aa = broadcast(0.0), n4 = broadcast(0.0), gg = broadcast(0.0), cubic = broadcast(0.0);
+        for (int c = 0; c < L::nc; c++) {
+            vd br, bi;
+            load_complex(eta[c] + k, er[c], ei[c]);
+            load_complex(buf[c] + k, br, bi);
+            vd nn = er[c]*er[c] + ei[c]*ei[c];
+            aa += nn;
+            n4 += nn*nn;
+            gg += br*br + bi*bi;
+        }
+        aa = 2.0*aa;
+        for (int t = 0; t < L::num_triads; t++) {
+            // real(eta_a*eta_b*eta_c)
+            int a = L::triads[t][0], b = L::triads[t][1], c = L::triads[t][2];
+            vd pr = er[b]*er[c] - ei[b]*ei[c];
+            vd pi = er[b]*ei[c] + ei[b]*er[c];
+            cubic += er[a]*pr - ei[a]*pi;
+        }
+        acc += aa*((bl-bx)/2.0) + ((3.0/4.0)*vv)*aa*aa - (4*tt)*cubic
+               + bx*gg - ((3.0/2.0)*vv)*n4;
+    }
+    double sum = sum_lanes(acc);
+    if (k < n) {
+        complex<double> *e[L::nc], *b[L::nc];
+        offset<L::nc>(eta, e, k); offset<L::nc>(buf, b, k);
+        sum += scalar_kernels[L::type].energy_density(e, b, bx, bl, tt, vv, n - k);
+    }
+    return sum;
+}
+
+template <typename L>
+void grad_theta_simd(double *const grad[], complex<double> *const eta[],
+        complex<double> *const buf[], double bx, double bl, double tt, double vv, long n) {
+    vd vtt = broadcast(tt), vvv = broadcast(vv);
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd er[L::nc], ei[L::nc], br[L::nc], bi[L::nc], nr[L::nc], ni[L::nc], im[L::nc];
+        for (int c = 0; c < L::nc; c++) {
+            load_complex(eta[c] + k, er[c], ei[c]);
+            load_complex(buf[c] + k, br[c], bi[c]);
+        }
+        nonlinear<L>(er, ei, vtt, vvv, nr, ni);
+        for (int c = 0; c < L::nc; c++) {
+            vd var_r = (bl-bx)*er[c] + bx*br[c] + nr[c];
+            vd var_i = (bl-bx)*ei[c] + bx*bi[c] + ni[c];
+            im[c] = er[c]*var_i - ei[c]*var_r;
+        }
+        for (int c = 0; c < L::nc; c++) {
+            vd dtheta = broadcast(0.0);
+            for (int d = 0; d < L::nc; d++)
+                dtheta += L::qq(c, d)*im[d];
+            store(grad[c] + k, dtheta);
+        }
+    }
+    if (k < n) {
+        double *g[L::nc];
+        complex<double> *e[L::nc], *b[L::nc];
+        offset<L::nc>(grad, g, k); offset<L::nc>(eta, e, k); offset<L::nc>(buf, b, k);
+        scalar_kernels[L::type].grad_theta(g, e, b, bx, bl, tt, vv, n - k);
+    }
+}
+
+/*! data *= f, with f duplicated to the real and imaginary parts */
+inline void scale_block(complex<double> *data, vd f) {
+    double *d = reinterpret_cast<double*>(data);
+    store(d, load(d)*__builtin_shuffle(f, f, mask_lo));
+    store(d + W, load(d + W)*__builtin_shuffle(f, f, mask_hi));
+}
+
+void scale_simd(complex<double> *data, const double *f, long n) {
+    long k = 0;
+    for (; k + W <= n; k += W)
+        scale_block(data + k, load(f + k));
+    if (k < n) scalar_kernels[HEXAGONAL_LATTICE].scale(data + k, f + k, n - k);
+}
+
+void scale_sq_simd(complex<double> *data, const double *f, long n) {
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd fk = load(f + k);
+        scale_block(data + k, fk*fk);
+    }
+    if (k < n) scalar_kernels[HEXAGONAL_LATTICE].scale_sq(data + k, f + k, n - k);
+}
+
+void od_kspace_simd(complex<double> *out, const complex<double> *in, const double *g,
+        double dt, double bx, double bl, long n) {
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd gk = load(g + k);
+        vd d = 1.0 + dt*((bl-bx) + bx*gk*gk);
+        const double *src = reinterpret_cast<const double*>(in + k);
+        double *dst = reinterpret_cast<double*>(out + k);
+        store(dst, load(src)/__builtin_shuffle(d, d, mask_lo));
+        store(dst + W, load(src + W)/__builtin_shuffle(d, d, mask_hi));
+    }
+    if (k < n) scalar_kernels[HEXAGONAL_LATTICE].od_kspace(out + k, in + k, g + k, dt, bx, bl, n - k);
+}
+
+void od_kspace_noise_simd(complex<double> *out, const complex<double> *in, const double *g,
+        double dt, double bx, double bl, const NoiseStream &noise, long n) {
+    const KernelTable &scalar = scalar_kernels[HEXAGONAL_LATTICE];
+    double aa = noise.amplitude*noise.amplitude;
+    // the vectors start from an even cell (two cells per counter)
+    long k = (noise.cell % 2 == 1 && n > 0) ? 1 : 0;
+    if (k == 1) scalar.od_kspace_noise(out, in, g, dt, bx, bl, noise, 1);
+    for (; k + 2*W <= n; k += 2*W) {
+        vd gk[2] = {load(g + k), load(g + k + W)};
+        vd variance[2] = {broadcast(aa), broadcast(aa)};
+        for (int h = 0; h < 2 && noise.q_sq >= 0.0; h++) {
+            vd kq = noise.q_sq - gk[h];             // |k+q_c|^2
+            variance[h] = aa*((kq > 0.0) ? kq : broadcast(0.0));
+        }
+        vd nr[2], ni[2];
+        gaussian(noise, k, variance[0], variance[1], nr, ni);
+        for (int h = 0; h < 2; h++) {
+            vd re, im;
+            load_complex(in + k + h*W, re, im);
+            vd d = 1.0 + dt*((bl-bx) + bx*gk[h]*gk[h]);
+            store_complex(out + k + h*W, (re + nr[h])/d, (im + ni[h])/d);
+        }
+    }
+    if (k < n) {
+        NoiseStream rest = noise;
+        rest.cell += k;
+        scalar.od_kspace_noise(out + k, in + k, g + k, dt, bx, bl, rest, n - k);
+    }
+}
+
+void add_noise_simd(complex<double> *data, const NoiseStream &noise, long n) {
+    const KernelTable &scalar = scalar_kernels[HEXAGONAL_LATTICE];
+    vd variance = broadcast(noise.amplitude*noise.amplitude);
+    long k = (noise.cell % 2 == 1 && n > 0) ? 1 : 0;
+    if (k == 1) scalar.add_noise(data, noise, 1);
+    for (; k + 2*W <= n; k += 2*W) {
+        vd nr[2], ni[2];
+        gaussian(noise, k, variance, variance, nr, ni);
+        for (int h = 0; h < 2; h++) {
+            vd re, im;
+            load_complex(data + k + h*W, re, im);
+            store_complex(data + k + h*W, re + nr[h], im + ni[h]);
+        }
+    }
+    if (k < n) {
+        NoiseStream rest = noise;
+        rest.cell += k;
+        scalar.add_noise(data + k, rest, n - k);
+    }
+}
+
+void rotate_phases_simd(complex<double> *out, const complex<double> *in,
+        const double *dir, double scale, double *angle_out, long n) {
+    long k = 0;
+    for (; k + W <= n; k += W) {
+        vd angle = scale*load(dir + k);
+        if (!in_sincos_range(angle)) {
+            scalar_kernels[HEXAGONAL_LATTICE].rotate_phases(out + k, in + k, dir + k, scale,
+                    angle_out ? angle_out + k : NULL, W);
+            continue;
+        }
+        vd s, c, re, im;
+        sincos(angle, s, c);
+        load_complex(in + k, re, im);
+        store_complex(out + k, re*c - im*s, re*s + im*c);
+        if (angle_out) store(angle_out + k, angle);
+    }
+    if (k < n) scalar_kernels[HEXAGONAL_LATTICE].rotate_phases(out + k, in + k, dir + k, scale,
+            angle_out ? angle_out + k : NULL, n - k);
+}
+
+} // namespace
+
+#define SIMD_KERNELS(L) {                   \
+        SIMD_NAME,                          \
+        od_nonlinear_simd<L>,               \
+        energy_density_simd<L>,             \
+        grad_theta_simd<L>,                 \
+        scale_simd,                         \
+        scale_sq_simd,                      \
+        od_kspace_simd,                     \
+        od_kspace_noise_simd,               \
+        add_noise_simd,                     \
+        rotate_phases_simd                  \
+    }
+
+// in the order of LatticeType
+const KernelTable SIMD_TABLE[NUM_LATTICES] = {
+    SIMD_KERNELS(HexagonalLattice),
+    SIMD_KERNELS(SquareLattice)
+};
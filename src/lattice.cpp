@@ -0,0 +1,39 @@
+
+#include "lattice.h"
+
+constexpr LatticeType HexagonalLattice::type;
+constexpr int HexagonalLattice::nc;
+constexpr double HexagonalLattice::q[HexagonalLattice::nc][2];
+constexpr int HexagonalLattice::num_triads;
+constexpr int HexagonalLattice::triads[1][3];
+
+constexpr LatticeType SquareLattice::type;
+constexpr int SquareLattice::nc;
+constexpr double SquareLattice::q[SquareLattice::nc][2];
+constexpr int SquareLattice::num_triads;
+constexpr int SquareLattice::triads[1][3];
+
+template <typename L>
+static constexpr Lattice describe(const char *name) {
+    return Lattice{L::type, name, L::nc, L::q, L::num_triads, L::triads};
+}
+
+// in the order of LatticeType
+static const Lattice lattices[NUM_LATTICES] = {
+    describe<HexagonalLattice>("hexagonal"),
+    describe<SquareLattice>("square")
+};
+
+const Lattice &get_lattice(LatticeType type) {
+    return lattices[type];
+}
+
+bool find_lattice(const std::string &name, LatticeType *type) {
+    for (int t = 0; t < NUM_LATTICES; t++) {
+        if (name == lattices[t].name) {
+            *type = (LatticeType) t;
+            return true;
+        }
+    }
+    return false;
+}
@@ -6,22 +6,39 @@
 #include <mpi.h>
 
 #include "pfc.h"
+#include "ensemble.h"
+#include "profiler.h"
 
 #include <sys/stat.h> // mkdir("./output");
 
 using namespace std;
 
-void run_calculations(int mpi_rank, int mpi_size) {
+// write a Chrome trace timeline of all timed regions for every process
+const bool write_trace = false;
+
+void run_calculations() {
 
     mkdir("./output", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
 
-    PhaseField pfc(mpi_rank, mpi_size, "./output/");
+    PhaseField pfc(MPI_COMM_WORLD, "./output/");
 
     //pfc.start_calculations();
     pfc.test();
 
 }
 
+/*! Runs the replicas of "replica_file" in groups of "group_size" processes,
+ *  every replica writes to ./output/<name>/
+ */
+void run_ensemble(int group_size, string replica_file) {
+
+    mkdir("./output", S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    Ensemble ensemble(MPI_COMM_WORLD, group_size, "./output/");
+    if (ensemble.read_replicas(replica_file))
+        ensemble.run();
+}
+
 int main(int argc, char **argv) {
 
     MPI_Init(&argc, &argv);
@@ -33,7 +50,20 @@ int main(int argc, char **argv) {
     
     cout << "Process started: " << mpi_rank << "/" << mpi_size << endl;
 
-    run_calculations(mpi_rank, mpi_size);
+    Profiler::enable_trace(write_trace);
+
+    // usage: pfc [ensemble <group_size> <replica_file>]
+    if (argc == 4 && string(argv[1]) == "ensemble") {
+        run_ensemble(atoi(argv[2]), argv[3]);
+    } else if (argc == 1) {
+        run_calculations();
+    } else if (mpi_rank == 0) {
+        cerr << "Usage: " << argv[0] << " [ensemble <group_size> <replica_file>]" << endl;
+    }
+
+    Profiler::write_report("./output/profile.json", MPI_COMM_WORLD);
+    if (write_trace)
+        Profiler::write_trace("./output/trace_" + to_string(mpi_rank) + ".json", mpi_rank);
 
     MPI_Finalize();
     return EXIT_SUCCESS;
@@ -2,16 +2,132 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
+#include <cmath>
+#include <sstream>
+#include <algorithm>
+#include <map>
 
 #include <mpi.h>
 
 #include "mechanical_equilibrium.h"
 
 #include "pfc.h"
+#include "profiler.h"
+#include "kernels.h"
+
+
+// new rate = smoothing*old + (1-smoothing)*measured
+const double MechanicalEquilibrium::rate_smoothing = 0.5;
+// a solver stagnates if the error doesn't fall below stagnation_factor times
+// the best error in stagnation_checks consecutive checks
+const int    MechanicalEquilibrium::stagnation_checks = 3;
+const double MechanicalEquilibrium::stagnation_factor = 0.95;
+// power iterations of the curvature estimate and the factor it is
+// increased by (the estimate converges to the largest curvature from below)
+const int    MechanicalEquilibrium::curvature_iterations = 8;
+const double MechanicalEquilibrium::curvature_safety = 1.25;
+
+
+SolverConfig::SolverConfig(SolverMethod method_)
+        : method(method_), m(5), dz(1.0), gamma(0.992), check_freq(100),
+          max_iter(10000), tolerance(7.5e-9), accelerated_descent_iterations(400),
+          lbfgs_it_increase(500) {
+    if (method == SOLVER_STEEPEST_DESCENT) {
+        check_freq = 1;
+    } else if (method == SOLVER_LBFGS_ENHANCED) {
+        //dz = 1.0; // for dx=2.0
+        dz = 0.02; // for dx=0.5
+        tolerance = 5.0e-8;
+    }
+}
+
+std::string SolverConfig::name() const {
+    std::stringstream sstream;
+    switch (method) {
+        case SOLVER_STEEPEST_DESCENT:
+            sstream << "steepest_descent_line_search"; break;
+        case SOLVER_AGD:
+            sstream << "agd(dz=" << dz << ",gamma=" << gamma << ")"; break;
+        case SOLVER_LBFGS:
+            sstream << "lbfgs(m=" << m << ",dz=" << dz << ")"; break;
+        case SOLVER_LBFGS_ENHANCED:
+            sstream << "lbfgs_enhanced(m=" << m << ",dz=" << dz << ")"; break;
+    }
+    return sstream.str();
+}
+
+
+MechanicalEquilibrium::MechanicalEquilibrium(PhaseField *pfc,
+        const PhaseFieldParameters &params)
+        : pfc(pfc), autotune(false), stop_on_failure(false),
+          failure(NULL), best_error(0.0), stalled_checks(0),
+          calibrate(params.meq_calibrate_step), step_limit(0.0), line_search_step(0.0),
+          line_search_batch(std::max(params.meq_line_search_batch, 1)), batch(NULL) {
+
+    SolverMethod method = SOLVER_LBFGS_ENHANCED;
+    if (params.meq_solver == "lbfgs") method = SOLVER_LBFGS;
+    else if (params.meq_solver == "agd") method = SOLVER_AGD;
+    else if (params.meq_solver == "steepest_descent") method = SOLVER_STEEPEST_DESCENT;
+    else if (params.meq_solver == "auto") autotune = true;
+
+    config = SolverConfig(method);
+    if (params.meq_lbfgs_m > 0) config.m = params.meq_lbfgs_m;
+    // an explicitly given step size is used as is
+    if (params.meq_dz > 0.0) {
+        config.dz = params.meq_dz;
+        calibrate = false;
+    }
+
+    if (autotune) {
+        // the candidates share the step size and tolerance of the default solver
+        SolverMethod methods[] = {SOLVER_LBFGS_ENHANCED, SOLVER_LBFGS};
+        int ms[] = {5, 10};
+        for (int a = 0; a < 2; a++) {
+            for (int b = 0; b < 2; b++) {
+                SolverConfig c(methods[a]);
+                c.m = ms[b];
+                c.dz = config.dz;
+                c.tolerance = config.tolerance;
+                candidates.push_back(c);
+            }
+        }
+        SolverConfig agd(SOLVER_AGD);
+        agd.dz = config.dz;
+        agd.tolerance = config.tolerance;
+        candidates.push_back(agd);
+        rates.assign(candidates.size(), -1.0);
+    }
+}
 
+MechanicalEquilibrium::~MechanicalEquilibrium() {
+    free_batch();
+}
 
-MechanicalEquilibrium::MechanicalEquilibrium(PhaseField *pfc)
-        : pfc(pfc) {}
+SolverConfig MechanicalEquilibrium::settings(SolverMethod method) const {
+    if (config.method == method) return config;
+    return SolverConfig(method);
+}
+
+/*! Progress check at the check points of the solvers
+ *
+ *  Only with autotuning: returns true (and sets "failure") if the energy
+ *  increased or the error stagnated, so the solver should give up.
+ */
+bool MechanicalEquilibrium::failing(double energy, double last_energy, double error) {
+    if (!stop_on_failure) return false;
+    if (energy > last_energy) {
+        failure = "energy increased";
+        return true;
+    }
+    if (best_error == 0.0 || error < stagnation_factor*best_error) {
+        best_error = error;
+        stalled_checks = 0;
+    } else if (++stalled_checks >= stagnation_checks) {
+        failure = "stagnation";
+        return true;
+    }
+    return false;
+}
 
 
 /*! 
@@ -19,6 +135,15 @@ MechanicalEquilibrium::MechanicalEquilibrium(PhaseField *pfc)
  *  of the gradient, which is assumed to be in "grad_theta"
  */
 double MechanicalEquilibrium::elementwise_avg_norm() {
+    if (pfc->reproducible) {
+        vector<double> row_sums(pfc->local_nx, 0.0);
+        for (int i = 0; i < pfc->local_nx; i++)
+            for (int c = 0; c < pfc->nc; c++)
+                for (int j = 0; j < pfc->ny; j++)
+                    row_sums[i] += abs(pfc->grad_theta[c][i*pfc->ny + j]);
+        return pfc->reproducible_sum(row_sums.data())/(pfc->nc*pfc->nx*pfc->ny);
+    }
+
     double local_norm = 0.0;
     for (int c = 0; c < pfc->nc; c++) {
 		for (int i = 0; i < pfc->local_nx; i++) {
@@ -28,34 +153,138 @@ double MechanicalEquilibrium::elementwise_avg_norm() {
         }
     }
     double norm = 0.0;
-    MPI_Allreduce(&local_norm, &norm, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-    return norm/(3*pfc->nx*pfc->ny);
+    PROFILE_SCOPE("allreduce");
+    MPI_Allreduce(&local_norm, &norm, 1, MPI_DOUBLE, MPI_SUM, pfc->comm);
+    return norm/(pfc->nc*pfc->nx*pfc->ny);
 }
 
 
-void MechanicalEquilibrium::take_step(double dz, double **neg_direction,
-        complex<double> **eta_in, complex<double> **eta_out) {
-    for (int c = 0; c < pfc->nc; c++) {
-		for (int i = 0; i < pfc->local_nx; i++) {
-			for (int j = 0; j < pfc->ny; j++) {
-				double dtheta = -dz*neg_direction[c][i*pfc->ny + j];
-				eta_out[c][i*pfc->ny + j] = eta_in[c][i*pfc->ny + j]
-									   * exp(complex<double>(0.0,1.0)*dtheta);
+double MechanicalEquilibrium::gradient_norm() {
+    pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
+    return elementwise_avg_norm();
+}
+
+/*! 
+ *  The Hessian-vector product is approximated by the gradient difference
+ *  H v ~ (grad(theta + eps*v) - grad(theta))/eps. The start vector is a
+ *  fixed pseudo-random pattern of the global indices, so that the estimate
+ *  doesn't depend on the number of processes.
+ *  NB: requires eta_k to be set, overwrites eta_tmp and grad_theta
+ */
+double MechanicalEquilibrium::estimate_curvature(int iterations) {
+    PROFILE_SCOPE("curvature_estimate");
+    int nc = pfc->nc, ny = pfc->ny;
+    int local_n = pfc->local_nx*ny;
+
+    pfc->allocate_eta_tmp();
+
+    double **grad0 = (double**) malloc(sizeof(double*)*nc);
+    double **v = (double**) malloc(sizeof(double*)*nc);
+    for (int c = 0; c < nc; c++) {
+        grad0[c] = (double*) malloc(sizeof(double)*local_n);
+        v[c] = (double*) malloc(sizeof(double)*local_n);
+    }
+
+    pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
+    for (int c = 0; c < nc; c++) {
+        std::memcpy(grad0[c], pfc->grad_theta[c], sizeof(double)*local_n);
+        for (int i = 0; i < pfc->local_nx; i++) {
+            for (int j = 0; j < ny; j++) {
+                uint64_t h = ((uint64_t) (i + pfc->local_nx_start)*ny + j)*nc + c;
+                h = (h + 0x9E3779B97F4A7C15ULL)*0xBF58476D1CE4E5B9ULL;
+                h ^= h >> 31;
+                v[c][i*ny + j] = (h & 1) ? 1.0 : -1.0;
             }
         }
     }
+
+    // perturbation of ~1e-4 rad per cell
+    double eps = 1.0e-4*sqrt((double) nc*pfc->nx*pfc->ny);
+    double curvature = 0.0;
+    for (int it = 0; it < iterations; it++) {
+        double norm = sqrt(dot_prod(v, v));
+        if (norm == 0.0) break;
+        for (int c = 0; c < nc; c++)
+            for (int k = 0; k < local_n; k++)
+                v[c][k] /= norm;
+        if (it > 0) curvature = norm;
+
+        // theta + eps*v (take_step steps against the direction)
+        take_step(-eps, v, pfc->eta, pfc->eta_tmp);
+        pfc->take_fft(pfc->eta_tmp_plan_f);
+        pfc->calculate_grad_theta(pfc->eta_tmp, pfc->eta_tmp_k);
+
+        for (int c = 0; c < nc; c++)
+            for (int k = 0; k < local_n; k++)
+                v[c][k] = (pfc->grad_theta[c][k] - grad0[c][k])/eps;
+    }
+    curvature = std::max(curvature, sqrt(dot_prod(v, v)));
+
+    for (int c = 0; c < nc; c++) {
+        free(grad0[c]);
+        free(v[c]);
+    }
+    free(grad0); free(v);
+
+    return curvature;
+}
+
+/*! Fields allocated by the solver of "c" in addition to the PhaseField
+ *  fields: the L-BFGS history, direction and previous gradient, the AGD
+ *  velocity and the two complex fields of exp_line_search
+ */
+double MechanicalEquilibrium::solver_workspace(const SolverConfig &c) const {
+    double real_field = pfc->nc*pfc->local_nx*pfc->ny*sizeof(double);
+    double line_search = pfc->low_memory ? 0.0
+            : 2.0*pfc->nc*pfc->alloc_local*sizeof(complex<double>);
+    if (line_search_batch > 1 && !pfc->fd.active())
+        line_search += (double) line_search_batch*pfc->nc*pfc->alloc_local*sizeof(complex<double>);
+    switch (c.method) {
+    case SOLVER_LBFGS:          return (2*c.m + 2)*real_field + line_search;
+    case SOLVER_LBFGS_ENHANCED: return (2*c.m + 3)*real_field + line_search;
+    case SOLVER_AGD:            return real_field;
+    default:                    return line_search;
+    }
+}
+
+double MechanicalEquilibrium::workspace_bytes() const {
+    // the curvature estimate runs before the solvers
+    double bytes = calibrate ? 2.0*pfc->nc*pfc->local_nx*pfc->ny*sizeof(double) : 0.0;
+    bytes = std::max(bytes, solver_workspace(config));
+    if (autotune) {
+        for (size_t k = 0; k < candidates.size(); k++)
+            bytes = std::max(bytes, solver_workspace(candidates[k]));
+        bytes = std::max(bytes, solver_workspace(SolverConfig(SOLVER_STEEPEST_DESCENT)));
+    }
+    return bytes;
+}
+
+void MechanicalEquilibrium::calibrate_steps() {
+    double curvature = estimate_curvature(curvature_iterations);
+    step_limit = (curvature > 0.0) ? 1.0/(curvature_safety*curvature) : 0.0;
+    if (pfc->mpi_rank == 0)
+        printf("    Curvature: %.4e; step size: %.4e\n", curvature, step_limit);
+}
+
+
+void MechanicalEquilibrium::take_step(double dz, double **neg_direction,
+        complex<double> **eta_in, complex<double> **eta_out) {
+    PROFILE_SCOPE("kernel_phase_rotation");
+    const KernelTable &kern = kernels(pfc->lattice.type);
+    for (int c = 0; c < pfc->nc; c++)
+        kern.rotate_phases(eta_out[c], eta_in[c], neg_direction[c], -dz, NULL,
+                pfc->local_nx*pfc->ny);
+    pfc->field_changed(eta_out);
 }
 
 
 int MechanicalEquilibrium::steepest_descent_fixed_dz() {
-    double dz = 1.0;
+    PROFILE_SCOPE("mech_eq");
+    double dz = (step_limit > 0.0) ? step_limit : 1.0;
     int max_iter = 10000;
     int check_freq = 100;
     double tolerance = 7.5e-9;
 
-    // update eta_k (just in case)
-    pfc->take_fft(pfc->eta_plan_f);
-
     double last_energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
 
     Time::time_point time_var = Time::now();
@@ -100,30 +329,43 @@ int MechanicalEquilibrium::steepest_descent_fixed_dz() {
  *
  *  NB: Might be slow due to a lot of memory copying...
  *  (Or it might be negligible compared to ffts)
+ *  In the low memory mode the best step isn't saved but taken again
+ *  (one more fft), which saves two complex fields.
  *
  *  @param energy_io input: starting energy; output: energy of the taken step
  *  @return step size
  */
 double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_direction) {
+    PROFILE_SCOPE("line_search");
+    // calibrated: start from the previous accepted step (or the safe step),
+    // which saves most of the trials of a search from 1.0
     double dz_start = 1.0;
+    if (step_limit > 0.0)
+        dz_start = (line_search_step > 0.0) ? line_search_step : step_limit;
     double search_factor = 2.0;
 
     int largest_step_power = 20;
     int smallest_step_power = 6;
+
+    pfc->allocate_eta_tmp();
+    bool save_steps = !pfc->low_memory;
     
     // Allocate memory to hold saved eta values (no need for FFT plans)
-    complex<double> **eta_prev = (complex<double>**)
-        malloc(sizeof(complex<double>*)*pfc->nc);
-    complex<double> **eta_prev_k = (complex<double>**)
-        malloc(sizeof(complex<double>*)*pfc->nc);
-    for (int i = 0; i < pfc->nc; i++) {
-        eta_prev[i] = reinterpret_cast<complex<double>*>
-            (fftw_alloc_complex(pfc->alloc_local));
-        eta_prev_k[i] = reinterpret_cast<complex<double>*>
-            (fftw_alloc_complex(pfc->alloc_local));
+    complex<double> **eta_prev = NULL, **eta_prev_k = NULL;
+    unsigned long prev_version = 0;     // (its energy may still be memoized)
+    if (save_steps) {
+        eta_prev = (complex<double>**) malloc(sizeof(complex<double>*)*pfc->nc);
+        eta_prev_k = (complex<double>**) malloc(sizeof(complex<double>*)*pfc->nc);
+        for (int i = 0; i < pfc->nc; i++) {
+            eta_prev[i] = reinterpret_cast<complex<double>*>
+                (fftw_alloc_complex(pfc->alloc_local));
+            eta_prev_k[i] = reinterpret_cast<complex<double>*>
+                (fftw_alloc_complex(pfc->alloc_local));
+        }
     }
 
     // Take initial step and store result to eta_tmp
+    PROFILE_COUNT("line_search_trials", 1);
     take_step(dz_start, neg_direction, pfc->eta, pfc->eta_tmp);
     pfc->take_fft(pfc->eta_tmp_plan_f);
     double energy = pfc->calculate_energy(pfc->eta_tmp, pfc->eta_tmp_k);
@@ -131,8 +373,11 @@ double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_di
     if (energy < *energy_io) {
         // save the successful step
         // (in case next is worse, so it will be taken)
-        pfc->memcopy_eta(eta_prev, pfc->eta_tmp);
-        pfc->memcopy_eta(eta_prev_k, pfc->eta_tmp_k);
+        if (save_steps) {
+            pfc->memcopy_eta(eta_prev, pfc->eta_tmp);
+            pfc->memcopy_eta(eta_prev_k, pfc->eta_tmp_k);
+            prev_version = pfc->field_version(pfc->eta_tmp);
+        }
     } else {
         // search smaller steps
         search_factor = 1.0/search_factor;
@@ -146,6 +391,7 @@ double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_di
         // try to increase step size
         dz *= search_factor;
 
+        PROFILE_COUNT("line_search_trials", 1);
         take_step(dz, neg_direction, pfc->eta, pfc->eta_tmp);
         pfc->take_fft(pfc->eta_tmp_plan_f);
         double energy = pfc->calculate_energy(pfc->eta_tmp, pfc->eta_tmp_k);
@@ -155,14 +401,23 @@ double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_di
         if (search_factor > 1.0) {
             if (energy < last_energy) {
                 // save this step result and continue
-                pfc->memcopy_eta(eta_prev, pfc->eta_tmp);
-                pfc->memcopy_eta(eta_prev_k, pfc->eta_tmp_k);
+                if (save_steps) {
+                    pfc->memcopy_eta(eta_prev, pfc->eta_tmp);
+                    pfc->memcopy_eta(eta_prev_k, pfc->eta_tmp_k);
+                    prev_version = pfc->field_version(pfc->eta_tmp);
+                }
             } else {
                 // the previous step is chosen.
                 *energy_io = last_energy;
-                pfc->memcopy_eta(pfc->eta, eta_prev);
-                pfc->memcopy_eta(pfc->eta_k, eta_prev_k);
                 dz = dz/search_factor;
+                if (save_steps) {
+                    pfc->memcopy_eta(pfc->eta, eta_prev);
+                    pfc->memcopy_eta(pfc->eta_k, eta_prev_k);
+                    pfc->field_copied(pfc->eta, prev_version);
+                } else {
+                    take_step(dz, neg_direction, pfc->eta, pfc->eta);
+                    pfc->take_fft(pfc->eta_plan_f);
+                }
                 break;
             }
         } else {
@@ -171,6 +426,7 @@ double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_di
             if (energy < *energy_io) {
                 pfc->memcopy_eta(pfc->eta, pfc->eta_tmp);
                 pfc->memcopy_eta(pfc->eta_k, pfc->eta_tmp_k);
+                pfc->field_copied(pfc->eta, pfc->field_version(pfc->eta_tmp));
                 *energy_io = energy;
                 break;
             }
@@ -187,21 +443,253 @@ double MechanicalEquilibrium::exp_line_search(double *energy_io, double **neg_di
         }
     }
     
-    for (int i = 0; i < pfc->nc; i++) {
-        fftw_free(eta_prev[i]);
-        fftw_free(eta_prev_k[i]);
+    if (save_steps) {
+        for (int i = 0; i < pfc->nc; i++) {
+            fftw_free(eta_prev[i]);
+            fftw_free(eta_prev_k[i]);
+        }
+        free(eta_prev); free(eta_prev_k);
     }
-    free(eta_prev); free(eta_prev_k);
 
+    if (dz > 0.0) line_search_step = dz;
     return dz;
 }
 
-int MechanicalEquilibrium::steepest_descent_line_search() {
-    int max_iter = 10000;
-    double tolerance = 7.5e-9;
+void MechanicalEquilibrium::allocate_batch() {
+    if (batch != NULL) return;
+    ptrdiff_t n[2] = {pfc->nx, pfc->ny};
+    ptrdiff_t howmany = pfc->nc*line_search_batch;
+    ptrdiff_t local_n, local_start;
+    ptrdiff_t alloc = fftw_mpi_local_size_many(2, n, howmany, FFTW_MPI_DEFAULT_BLOCK,
+            pfc->comm, &local_n, &local_start);
+    batch = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc));
+    batch_plan_f = fftw_mpi_plan_many_dft(2, n, howmany, FFTW_MPI_DEFAULT_BLOCK,
+            FFTW_MPI_DEFAULT_BLOCK, reinterpret_cast<fftw_complex*>(batch),
+            reinterpret_cast<fftw_complex*>(batch), pfc->comm, FFTW_FORWARD, FFTW_ESTIMATE);
+    batch_plan_b = fftw_mpi_plan_many_dft(2, n, howmany, FFTW_MPI_DEFAULT_BLOCK,
+            FFTW_MPI_DEFAULT_BLOCK, reinterpret_cast<fftw_complex*>(batch),
+            reinterpret_cast<fftw_complex*>(batch), pfc->comm, FFTW_BACKWARD, FFTW_ESTIMATE);
+}
+
+void MechanicalEquilibrium::free_batch() {
+    if (batch == NULL) return;
+    fftw_destroy_plan(batch_plan_f);
+    fftw_destroy_plan(batch_plan_b);
+    fftw_free(batch);
+    batch = NULL;
+}
+
+/*! Energies of the steps dz[0..line_search_batch) in neg_direction
+ *
+ *  The trial states are interleaved in "batch" (cell-major, then trial,
+ *  then component), so that all of them are transformed by one plan: the
+ *  distributed transforms transpose nc*line_search_batch fields in one
+ *  all-to-all. The local energies are summed with one allreduce.
+ *  Uses eta_tmp and buffer.
+ */
+void MechanicalEquilibrium::batch_energies(const double *dz, double **neg_direction,
+        double *energies) {
+    PROFILE_COUNT("line_search_trials", line_search_batch);
+    int nc = pfc->nc, ny = pfc->ny, local_nx = pfc->local_nx;
+    int trials = line_search_batch;
+    long howmany = nc*trials;
+    long n = (long) local_nx*ny;
+    const KernelTable &kern = kernels(pfc->lattice.type);
+
+    for (int t = 0; t < trials; t++) {
+        take_step(dz[t], neg_direction, pfc->eta, pfc->eta_tmp);
+        for (int c = 0; c < nc; c++)
+            for (long k = 0; k < n; k++)
+                batch[k*howmany + t*nc + c] = pfc->eta_tmp[c][k];
+    }
+
+    {
+        PROFILE_SCOPE("fft");
+        PROFILE_COUNT("fft_transforms", howmany);
+        PROFILE_COUNT("fft_bytes_transposed", 2.0*howmany*n*sizeof(complex<double>));
+        fftw_execute(batch_plan_f);
+    }
+
+    // (G_j eta_j)_k, normalized for the backward transform
+    {
+        PROFILE_SCOPE("kernel_kspace_multiply");
+        double scale = 1.0/((double) pfc->nx*ny);
+        vector<double> g_scratch(ny);
+        for (int c = 0; c < nc; c++) {
+            for (int i = 0; i < local_nx; i++) {
+                const double *g = pfc->g_row(c, i, g_scratch.data());
+                for (int j = 0; j < ny; j++) {
+                    complex<double> *cell = batch + ((long) i*ny + j)*howmany + c;
+                    for (int t = 0; t < trials; t++)
+                        cell[t*nc] *= scale*g[j];
+                }
+            }
+        }
+    }
+
+    {
+        PROFILE_SCOPE("fft");
+        PROFILE_COUNT("fft_transforms", howmany);
+        PROFILE_COUNT("fft_bytes_transposed", 2.0*howmany*n*sizeof(complex<double>));
+        fftw_execute(batch_plan_b);
+    }
 
-    // update eta_k (just in case)
-    pfc->take_fft(pfc->eta_plan_f);
+    // energy densities: the trial state again in eta_tmp, its G_j eta_j in buffer
+    vector<double> local(trials, 0.0);
+    vector<double> row_sums(pfc->reproducible ? local_nx*trials : 0);
+    {
+        PROFILE_SCOPE("kernel_energy_density");
+        vector<complex<double>*> eta_row(nc), buffer_row(nc);
+        for (int t = 0; t < trials; t++) {
+            take_step(dz[t], neg_direction, pfc->eta, pfc->eta_tmp);
+            for (int c = 0; c < nc; c++)
+                for (long k = 0; k < n; k++)
+                    pfc->buffer[c][k] = batch[k*howmany + t*nc + c];
+            if (!pfc->reproducible) {
+                local[t] = kern.energy_density(pfc->eta_tmp, pfc->buffer, pfc->bx, pfc->bl,
+                        pfc->tt, pfc->vv, n);
+                continue;
+            }
+            for (int i = 0; i < local_nx; i++) {
+                for (int c = 0; c < nc; c++) {
+                    eta_row[c] = pfc->eta_tmp[c] + (long) i*ny;
+                    buffer_row[c] = pfc->buffer[c] + (long) i*ny;
+                }
+                row_sums[t*local_nx + i] = kern.energy_density(eta_row.data(),
+                        buffer_row.data(), pfc->bx, pfc->bl, pfc->tt, pfc->vv, ny);
+            }
+        }
+    }
+
+    double cells = (double) pfc->nx*ny;
+    if (pfc->reproducible) {
+        // (one reduction per trial, in the fixed order of the rows)
+        for (int t = 0; t < trials; t++)
+            energies[t] = pfc->reproducible_sum(&row_sums[t*local_nx])/cells;
+        return;
+    }
+    {
+        PROFILE_SCOPE("allreduce");
+        MPI_Allreduce(local.data(), energies, trials, MPI_DOUBLE, MPI_SUM, pfc->comm);
+    }
+    for (int t = 0; t < trials; t++) energies[t] /= cells;
+}
+
+/*! Batched line search with quadratic interpolation
+ *
+ *  Evaluates line_search_batch steps dz_0 2^p at once (see batch_energies),
+ *  the first batch from one halving below the start step dz_0. Until the
+ *  lowest energy has evaluated steps on both sides, the next batch continues
+ *  with longer steps (or shorter ones, if no step lowered the energy). The
+ *  minimum of the parabola through the lowest energy and its neighbours
+ *  (as exp_line_search_with_interpolation in python_code/) is evaluated
+ *  once more and taken if it is lower. Sets "eta" and "eta_k".
+ *
+ *  @param energy_io input: starting energy; output: energy of the taken step
+ *  @return step size
+ */
+double MechanicalEquilibrium::batched_line_search(double *energy_io,
+        double **neg_direction) {
+    PROFILE_SCOPE("line_search");
+    double dz_start = 1.0;
+    if (step_limit > 0.0)
+        dz_start = (line_search_step > 0.0) ? line_search_step : step_limit;
+
+    // same range as exp_line_search: 2^-6 to 2^20 times the start step
+    int largest_step_power = 20;
+    int smallest_step_power = -6;
+
+    pfc->allocate_eta_tmp();
+    allocate_batch();
+
+    int trials = line_search_batch;
+    vector<double> dz(trials), energies(trials);
+    // evaluated steps and energies, sorted by step
+    std::map<double, double> points;
+    points[0.0] = *energy_io;
+
+    int p_low = (trials > 2) ? -1 : 0;
+    int p_min = p_low, p_max = p_low;
+    while (true) {
+        for (int t = 0; t < trials; t++)
+            dz[t] = dz_start*pow(2.0, p_low + t);
+        batch_energies(dz.data(), neg_direction, energies.data());
+        for (int t = 0; t < trials; t++)
+            points[dz[t]] = energies[t];
+        p_min = std::min(p_min, p_low);
+        p_max = std::max(p_max, p_low + trials - 1);
+
+        std::map<double, double>::iterator best = points.begin();
+        for (std::map<double, double>::iterator it = points.begin(); it != points.end(); ++it)
+            if (it->second < best->second) best = it;
+
+        if (best == points.begin()) {
+            // no step lowered the energy: shorter steps
+            if (p_min <= smallest_step_power) {
+                if (pfc->mpi_rank == 0) cout << "Warning: didn't find step." << endl;
+                if (pfc->low_memory) free_batch();
+                return 0.0;
+            }
+            p_low = std::max(p_min - trials, smallest_step_power);
+            continue;
+        }
+        std::map<double, double>::iterator next = best;
+        ++next;
+        if (next == points.end()) {
+            // the longest step is the lowest: longer steps
+            if (p_max < largest_step_power) {
+                p_low = p_max + 1;
+                continue;
+            }
+            if (pfc->mpi_rank == 0) cout << "Warning: longest step limit reached." << endl;
+        }
+
+        std::map<double, double>::iterator prev = best;
+        --prev;
+        double a = prev->first, b = best->first, fa = prev->second, fb = best->second;
+        double dz_best = b, energy_best = fb;
+        if (next != points.end()) {
+            double c = next->first, fc = next->second;
+            double num = (b-a)*(b-a)*(fb-fc) - (b-c)*(b-c)*(fb-fa);
+            double den = (b-a)*(fb-fc) - (b-c)*(fb-fa);
+            double dz_parabola = (den != 0.0) ? b - 0.5*num/den : b;
+            if (dz_parabola > a && dz_parabola < c && dz_parabola != b) {
+                PROFILE_COUNT("line_search_trials", 1);
+                take_step(dz_parabola, neg_direction, pfc->eta, pfc->eta_tmp);
+                double energy = pfc->calculate_energy(pfc->eta_tmp, pfc->eta_tmp_k);
+                if (energy < fb) {
+                    pfc->memcopy_eta(pfc->eta, pfc->eta_tmp);
+                    pfc->memcopy_eta(pfc->eta_k, pfc->eta_tmp_k);
+                    pfc->field_copied(pfc->eta, pfc->field_version(pfc->eta_tmp));
+                    *energy_io = energy;
+                    line_search_step = dz_parabola;
+                    if (pfc->low_memory) free_batch();
+                    return dz_parabola;
+                }
+            }
+        }
+
+        take_step(dz_best, neg_direction, pfc->eta, pfc->eta);
+        pfc->take_fft(pfc->eta_plan_f);
+        *energy_io = energy_best;
+        line_search_step = dz_best;
+        if (pfc->low_memory) free_batch();
+        return dz_best;
+    }
+}
+
+double MechanicalEquilibrium::line_search(double *energy_io, double **neg_direction) {
+    // the finite-difference backend has no transforms to batch
+    if (line_search_batch > 1 && !pfc->fd.active())
+        return batched_line_search(energy_io, neg_direction);
+    return exp_line_search(energy_io, neg_direction);
+}
+
+int MechanicalEquilibrium::steepest_descent_line_search() {
+    PROFILE_SCOPE("mech_eq");
+    SolverConfig c = settings(SOLVER_STEEPEST_DESCENT);
+    int max_iter = c.max_iter;
+    double tolerance = c.tolerance;
 
     double energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
     double last_energy = energy;
@@ -216,7 +704,7 @@ int MechanicalEquilibrium::steepest_descent_line_search() {
     for (; it <= max_iter; it++) {
         // Do the exponential line search to find optimal step
         // will update eta, eta_k and also store new energy value
-        double dz = exp_line_search(&energy, pfc->grad_theta);
+        double dz = line_search(&energy, pfc->grad_theta);
 
         // for this iteration's error check and next iteration's step
         pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
@@ -246,27 +734,32 @@ int MechanicalEquilibrium::steepest_descent_line_search() {
 int MechanicalEquilibrium::accelerated_gradient_descent(
 		double dz, int max_iter, double tolerance, bool print
 		) {
+	PROFILE_SCOPE("accelerated_gradient_descent");
 	//double dz = 1.0;
 	//int max_iter = 10000;
 	//double tolerance = 1.0e-7;
 	//bool print = true;
 
-	int check_freq = 100;
+	// lbfgs_enhanced runs AGD with its own momentum
+	SolverConfig c = (config.method == SOLVER_LBFGS_ENHANCED) ? config
+	                                                          : settings(SOLVER_AGD);
+	int check_freq = c.check_freq;
 
-	double gamma = 0.992;
+	double gamma = c.gamma;
 
 	//Time::time_point time_start = Time::now();
 	Time::time_point time_var = Time::now();
 
+	pfc->allocate_eta_tmp();
+
 	// Allocate memory to hold velocity values (no need for FFT plans)
 	// Note that the actual steps will be taken in negative direction of velocity
 	double **velocity= (double **) malloc(sizeof(double*)*pfc->nc);
 	for (int i = 0; i < pfc->nc; i++)
 		velocity[i] = (double*) malloc(sizeof(double)*pfc->local_nx*pfc->ny);
 
+	// (updates eta_k if needed)
 	double last_energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
-	// update eta_k
-	pfc->take_fft(pfc->eta_plan_f);
 
 	int it = 1;
 	while (it <= max_iter) {
@@ -277,15 +770,12 @@ int MechanicalEquilibrium::accelerated_gradient_descent(
 		} else {
 			// If last step velocity is not zero, take a prediction gradient
 			take_step(gamma, velocity, pfc->eta, pfc->eta_tmp);
-			// update eta_tmp_k
-			pfc->take_fft(pfc->eta_tmp_plan_f);
-			// calculate gradient based on eta_tmp
+			// calculate gradient based on eta_tmp (updates eta_tmp_k)
 			pfc->calculate_grad_theta(pfc->eta_tmp, pfc->eta_tmp_k);
 		}
 		update_velocity_and_take_step(dz, gamma, velocity, it == 1);
 
 		if (it % check_freq == 0) {
-			pfc->take_fft(pfc->eta_plan_f);
 			double energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
 			double error = elementwise_avg_norm();
 			if (pfc->mpi_rank == 0 && print) {
@@ -300,8 +790,9 @@ int MechanicalEquilibrium::accelerated_gradient_descent(
 				if (energy > last_energy) cout << "    Warning: energy increased." << endl;
 				if (error < tolerance) cout << "    Solution found." << endl;
 			}
-			last_energy = energy;
 			if (error < tolerance) break;
+			if (failing(energy, last_energy, error)) break;
+			last_energy = energy;
 		}
 		if (it >= max_iter && print && pfc->mpi_rank == 0)
 			printf("    Solution was not found within %d iterations.\n", max_iter);
@@ -319,19 +810,19 @@ int MechanicalEquilibrium::accelerated_gradient_descent(
 
 void MechanicalEquilibrium::update_velocity_and_take_step(double dz, double gamma,
         double **velocity, bool zero_vel) {
+    PROFILE_SCOPE("kernel_phase_rotation");
+    const KernelTable &kern = kernels(pfc->lattice.type);
+    long n = pfc->local_nx*pfc->ny;
     for (int c = 0; c < pfc->nc; c++) {
-		for (int i = 0; i < pfc->local_nx; i++) {
-			for (int j = 0; j < pfc->ny; j++) {
-				if (zero_vel)
-					velocity[c][i*pfc->ny + j] = dz * pfc->grad_theta[c][i*pfc->ny + j];
-				else
-					velocity[c][i*pfc->ny + j] = gamma*velocity[c][i*pfc->ny+j]
-											+ dz*pfc->grad_theta[c][i*pfc->ny + j];
-				pfc->eta[c][i*pfc->ny + j] *= exp(complex<double>(0.0, 1.0)
-						*(-1.0)*velocity[c][i*pfc->ny + j]);
-            }
-        }
+        double *v = velocity[c];
+        const double *g = pfc->grad_theta[c];
+        if (zero_vel)
+            for (long k = 0; k < n; k++) v[k] = dz*g[k];
+        else
+            for (long k = 0; k < n; k++) v[k] = gamma*v[k] + dz*g[k];
+        kern.rotate_phases(pfc->eta[c], pfc->eta[c], v, -1.0, NULL, n);
     }
+    pfc->field_changed(pfc->eta);
 }
 
 
@@ -339,6 +830,7 @@ void MechanicalEquilibrium::update_velocity_and_take_step(double dz, double gamm
  *  Accelerated steepest descent with occasional line search
  */
 int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
+    PROFILE_SCOPE("mech_eq");
     double dz_accd = 1.0;
     int max_iter = 10000;
     double tolerance = 7.5e-9;
@@ -355,6 +847,8 @@ int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
     Time::time_point time_var = time_start;
 
 
+    pfc->allocate_eta_tmp();
+
     // Allocate memory to hold velocity values (no need for FFT plans)
     // Note that the actual steps will be taken in negative direction of velocity
     double **velocity= (double **) malloc(sizeof(double*)*pfc->nc);
@@ -364,9 +858,8 @@ int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
     // Boolean when to ignore velocity (first iteration and after adaptive steps)
     bool zero_velocity = true;
 
+    // (updates eta_k if needed)
     double last_energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
-    // update eta_k 
-    pfc->take_fft(pfc->eta_plan_f);
 
     int it = 1;
     while (it <= max_iter) {
@@ -377,7 +870,7 @@ int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
                 pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
 
                 double energy_io = pfc->calculate_energy(pfc->eta, pfc->eta_k);
-                double dz = exp_line_search(&energy_io, pfc->grad_theta);
+                double dz = line_search(&energy_io, pfc->grad_theta);
                 
                 double error = elementwise_avg_norm();
 
@@ -399,16 +892,13 @@ int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
         } else {
             // If last step velocity is not zero, take a prediction gradient
             take_step(gamma, velocity, pfc->eta, pfc->eta_tmp);
-            // update eta_tmp_k
-            pfc->take_fft(pfc->eta_tmp_plan_f);
-            // calculate gradient based on eta_tmp_k
+            // calculate gradient based on eta_tmp (updates eta_tmp_k)
             pfc->calculate_grad_theta(pfc->eta_tmp, pfc->eta_tmp_k);
         }
         update_velocity_and_take_step(dz_accd, gamma, velocity, zero_velocity);
         zero_velocity = false;
 
         if (it % check_freq == 0) {
-            pfc->take_fft(pfc->eta_plan_f);
             double energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
             double error = elementwise_avg_norm();
             if (pfc->mpi_rank == 0 && print) {
@@ -439,17 +929,31 @@ int MechanicalEquilibrium::accelerated_gradient_descent_line_search() {
 }
 
 double MechanicalEquilibrium::dot_prod(double **v1, double **v2) {
+	if (pfc->reproducible) {
+		vector<double> row_sums(pfc->local_nx, 0.0);
+		for (int i = 0; i < pfc->local_nx; i++)
+			for (int c = 0; c < pfc->nc; c++)
+				for (int j = 0; j < pfc->ny; j++)
+					row_sums[i] += v1[c][i*pfc->ny+j] * v2[c][i*pfc->ny+j];
+		return pfc->reproducible_sum(row_sums.data());
+	}
+
 	double res = 0.0;
 	for (int c = 0; c < pfc->nc; c++)
 		for (int i = 0; i < pfc->local_nx; i++)
 			for (int j = 0; j < pfc->ny; j++)
 				res += v1[c][i*pfc->ny+j] * v2[c][i*pfc->ny+j];
-	MPI_Allreduce(&res, &res, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+	PROFILE_SCOPE("allreduce");
+	MPI_Allreduce(MPI_IN_PLACE, &res, 1, MPI_DOUBLE, MPI_SUM, pfc->comm);
 	return res;
 }
 
+/*! Two-loop recursion for the L-BFGS direction, the initial inverse
+ *  Hessian is h0 times identity
+ */
 void MechanicalEquilibrium::lbfgs_direction(int m, double ***s, double ***y,
-		double **grad, double **result) {
+		double **grad, double **result, double h0) {
+	PROFILE_SCOPE("lbfgs_direction");
 
 	double* alpha = (double*) malloc(sizeof(double)*m);
 	double* rho = (double*) malloc(sizeof(double)*m);
@@ -469,7 +973,11 @@ void MechanicalEquilibrium::lbfgs_direction(int m, double ***s, double ***y,
 				for (int j = 0; j < pfc->ny; j++)
 					result[c][i*pfc->ny+j] -= alpha[i_m] * y[i_m][c][i*pfc->ny+j];
 	}
-	// H_0 = Identity matrix, so "r = q"
+	// H_0 = h0*Identity matrix, so "r = h0*q"
+	if (h0 != 1.0)
+		for (int c = 0; c < pfc->nc; c++)
+			for (int k = 0; k < pfc->local_nx*pfc->ny; k++)
+				result[c][k] *= h0;
 
 	for (int i_m = m-1; i_m > -1; i_m--) {
 		double beta = rho[i_m] * dot_prod(y[i_m], result);
@@ -501,15 +1009,23 @@ void MechanicalEquilibrium::move_queue(int m, double ***queue) {
  * (number of iterations might fluctuate by ~1000)
  *
  */
-int MechanicalEquilibrium::lbfgs() {
+int MechanicalEquilibrium::lbfgs(int max_it, bool print) {
+	PROFILE_SCOPE("mech_eq");
 
-	double tolerance = 7.5e-9;
+	SolverConfig c = settings(SOLVER_LBFGS);
+	double tolerance = c.tolerance;
 	//double tolerance = 1.0e-7;
-	int check_freq = 100;
-	bool print = true;
-
-	int m = 5;
-	double dz = 1.0;
+	int check_freq = c.check_freq;
+
+	int m = c.m;
+	double dz = c.dz;
+	// calibrated: the initial inverse Hessian is 1/L and the L-BFGS
+	// direction has the right scale, so the full step is taken
+	double h0 = 1.0;
+	if (step_limit > 0.0) {
+		h0 = step_limit;
+		dz = 1.0;
+	}
 
 	Time::time_point time_var = Time::now();
 
@@ -537,6 +1053,7 @@ int MechanicalEquilibrium::lbfgs() {
 	}
 	// -----------------------------------------------------------------------------
 	// Initial gradient
+	double last_energy = pfc->calculate_energy(pfc->eta, pfc->eta_k);
 	pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
 
 	for (int c = 0; c < pfc->nc; c++)
@@ -546,11 +1063,10 @@ int MechanicalEquilibrium::lbfgs() {
 	int m_c = 0; // current changed value; goes up to m-1
 	int m_q = 0; // queue length (s, y); goes up to m
 
-	int max_it = 10000;
 	int it = 0;
 	for (; it < max_it; it++) {
 
-		lbfgs_direction(m_q, s, y, prev_grad, lbfgs_dir);
+		lbfgs_direction(m_q, s, y, prev_grad, lbfgs_dir, h0);
 
 		// Move queues if they're "full"
 		if (m_q == m) {
@@ -560,12 +1076,8 @@ int MechanicalEquilibrium::lbfgs() {
 
 		// take step and update s
 		for (int c = 0; c < pfc->nc; c++)
-			for (int i = 0; i < pfc->local_nx; i++)
-				for (int j = 0; j < pfc->ny; j++) {
-					double dtheta = - dz*lbfgs_dir[c][i*pfc->ny+j];
-					pfc->eta[c][i*pfc->ny+j] *= std::exp(complex<double>(0.0, 1.0)*dtheta);
-					s[m_c][c][i*pfc->ny+j] = dtheta;
-				}
+			kernels(pfc->lattice.type).rotate_phases(pfc->eta[c], pfc->eta[c], lbfgs_dir[c], -dz, s[m_c][c],
+					pfc->local_nx*pfc->ny);
 		// update eta_k, calculate new gradient and update y
 		pfc->take_fft(pfc->eta_plan_f);
 		pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
@@ -592,6 +1104,9 @@ int MechanicalEquilibrium::lbfgs() {
 			}
 			if (error < tolerance)
 				break;
+			if (failing(energy, last_energy, error))
+				break;
+			last_energy = energy;
 		}
 	}
 
@@ -623,21 +1138,31 @@ int MechanicalEquilibrium::lbfgs() {
 int MechanicalEquilibrium::lbfgs_iterations = 500;
 
 int MechanicalEquilibrium::lbfgs_enhanced() {
+	PROFILE_SCOPE("mech_eq");
 
-	//double tolerance = 7.5e-9;
-	double tolerance = 5.0e-8;
-	int check_freq = 100;
+	SolverConfig c = settings(SOLVER_LBFGS_ENHANCED);
+	double tolerance = c.tolerance;
+	int check_freq = c.check_freq;
 	bool print = true;
 
-	int m = 5;
-	//double dz = 1.0; // for dx=2.0
-	double dz = 0.02; // for dx=0.5
+	int m = c.m;
+	double dz = c.dz;
+	double h0 = 1.0;
+	double dz_agd = dz;
+	if (step_limit > 0.0) {
+		h0 = step_limit;
+		dz = 1.0;
+		dz_agd = step_limit;
+	}
 
-	int accelerated_descent_iterations = 400;
-	int lbfgs_it_increase = 500;
+	int accelerated_descent_iterations = c.accelerated_descent_iterations;
+	int lbfgs_it_increase = c.lbfgs_it_increase;
 
 	Time::time_point time_var = Time::now();
 
+	// nothing to do if already in equilibrium (saves the line search)
+	if (gradient_norm() < tolerance) return 0;
+
 	// -----------------------------------------------------------------------------
 	// Memory allocations
 	// Will hold the arrays to theta and grad differences for past states
@@ -676,7 +1201,7 @@ int MechanicalEquilibrium::lbfgs_enhanced() {
 
 		// Do the exponential line search to find optimal step
 		// will update eta, eta_k and also store new energy value
-		double dz_ls = exp_line_search(&last_energy, pfc->grad_theta);
+		double dz_ls = line_search(&last_energy, pfc->grad_theta);
 
 		if (pfc->mpi_rank == 0 && print) printf("    Line search step: %.2f\n", dz_ls);
 		// -----------------------------------------------------------------------------------
@@ -695,7 +1220,7 @@ int MechanicalEquilibrium::lbfgs_enhanced() {
 		else current_lbfgs_iterations = lbfgs_it_increase;
 
 		for (int it = 1; it < current_lbfgs_iterations + 1; it++) {
-			lbfgs_direction(m_q, s, y, prev_grad, lbfgs_dir);
+			lbfgs_direction(m_q, s, y, prev_grad, lbfgs_dir, h0);
 
 			// Move queues if they're "full"
 			if (m_q == m) {
@@ -705,12 +1230,8 @@ int MechanicalEquilibrium::lbfgs_enhanced() {
 
 			// take step and update s
 			for (int c = 0; c < pfc->nc; c++)
-				for (int i = 0; i < pfc->local_nx; i++)
-					for (int j = 0; j < pfc->ny; j++) {
-						double dtheta = - dz*lbfgs_dir[c][i*pfc->ny+j];
-						pfc->eta[c][i*pfc->ny+j] *= std::exp(complex<double>(0.0, 1.0)*dtheta);
-						s[m_c][c][i*pfc->ny+j] = dtheta;
-					}
+				kernels(pfc->lattice.type).rotate_phases(pfc->eta[c], pfc->eta[c], lbfgs_dir[c], -dz,
+						s[m_c][c], pfc->local_nx*pfc->ny);
 			// update eta_k, calculate new gradient and update y
 			pfc->take_fft(pfc->eta_plan_f);
 			pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
@@ -739,15 +1260,17 @@ int MechanicalEquilibrium::lbfgs_enhanced() {
 				}
 				if (pfc->mpi_rank == 0 && energy > last_energy)
 					printf("    Warning: energy increased during LBFGS steps!\n");
-				last_energy = energy;
 				if (error < tolerance) break;
+				if (failing(energy, last_energy, error)) break;
+				last_energy = energy;
 			}
 		}
-		if (error < tolerance) break;
+		if (error < tolerance || failure) break;
 		// -----------------------------------------------------------------------------------
 		// 3) Error reducing accelerated descent
 		if (pfc->mpi_rank == 0 && print) printf("    Error reduction:\n");
-		accelerated_gradient_descent(dz, accelerated_descent_iterations, tolerance, print);
+		accelerated_gradient_descent(dz_agd, accelerated_descent_iterations, tolerance, print);
+		if (failure) break;
 
 		pfc->calculate_grad_theta(pfc->eta, pfc->eta_k);
 		error = elementwise_avg_norm();
@@ -780,3 +1303,98 @@ int MechanicalEquilibrium::lbfgs_enhanced() {
 }
 
 
+
+
+/*! Runs the solver of "config" */
+int MechanicalEquilibrium::run_solver() {
+	switch (config.method) {
+		case SOLVER_STEEPEST_DESCENT:
+			return steepest_descent_line_search();
+		case SOLVER_AGD:
+			return accelerated_gradient_descent(
+					(step_limit > 0.0) ? step_limit : config.dz, config.max_iter,
+					config.tolerance, true);
+		case SOLVER_LBFGS:
+			return lbfgs(config.max_iter, true);
+		case SOLVER_LBFGS_ENHANCED:
+		default:
+			return lbfgs_enhanced();
+	}
+}
+
+/*! Next candidate to run: while tuning the first unmeasured one, then the
+ *  fastest one not yet tried in this equilibration (-1: none left)
+ */
+int MechanicalEquilibrium::choose_candidate(const vector<bool> &tried) const {
+	int best = -1;
+	for (unsigned int k = 0; k < candidates.size(); k++) {
+		if (tried[k]) continue;
+		if (rates[k] < 0.0) return k;
+		if (best < 0 || rates[k] > rates[best]) best = k;
+	}
+	return best;
+}
+
+int MechanicalEquilibrium::equilibrate() {
+	// the solver work fields of the low memory mode exist only from here
+	pfc->allocate_eta_tmp();
+	if (calibrate) calibrate_steps();
+
+	if (!autotune) {
+		int iterations = run_solver();
+		pfc->release_eta_tmp();
+		return iterations;
+	}
+
+	vector<bool> tried(candidates.size(), false);
+	int total_iterations = 0;
+
+	while (true) {
+		int k = choose_candidate(tried);
+		// steepest descent with line search never increases the energy,
+		// it is the last resort if all the candidates fail
+		config = (k >= 0) ? candidates[k] : SolverConfig(SOLVER_STEEPEST_DESCENT);
+		if (k < 0) config.tolerance = candidates[0].tolerance;
+
+		double start = MPI_Wtime();
+		double error_start = gradient_norm();
+		if (error_start < config.tolerance) break;
+
+		stop_on_failure = (k >= 0);
+		failure = NULL;
+		best_error = 0.0;
+		stalled_checks = 0;
+
+		total_iterations += run_solver();
+
+		// (updates eta_k, AGD doesn't leave it up to date)
+		double error_end = gradient_norm();
+		double duration = MPI_Wtime() - start;
+
+		// processes may differ slightly in time, but must agree on the choice
+		MPI_Bcast(&duration, 1, MPI_DOUBLE, 0, pfc->comm);
+
+		if (k < 0) break;
+
+		// decades of error reduction per second, failures count as no progress
+		double rate = 0.0;
+		if (!failure && error_end < error_start && duration > 0.0)
+			rate = log10(error_start/error_end)/duration;
+		rates[k] = (rates[k] < 0.0) ? rate
+		                            : rate_smoothing*rates[k] + (1.0-rate_smoothing)*rate;
+		tried[k] = true;
+
+		if (pfc->mpi_rank == 0) {
+			printf("    Autotune: %s: err %.3e -> %.3e in %.1f s, rate %.3f%s%s\n",
+					candidates[k].name().c_str(), error_start, error_end, duration,
+					rate, failure ? ", stopped: " : "", failure ? failure : "");
+		}
+		if (!failure && error_end < config.tolerance) break;
+	}
+	stop_on_failure = false;
+
+	// nothing is locked in: the rates keep being updated, so a candidate that
+	// slows down or fails gives way to the next fastest one
+	pfc->release_eta_tmp();
+	return total_iterations;
+}
@@ -0,0 +1,104 @@
+
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "output_policy.h"
+
+#include "pfc.h"
+
+OutputPolicy::OutputPolicy(PhaseField *pfc, const PhaseFieldParameters &params)
+        : pfc(pfc), adaptive(params.output_adaptive),
+          check_interval(params.output_check_interval),
+          min_interval(params.output_min_interval), max_interval(params.output_max_interval),
+          energy_change(params.output_energy_change), norm_factor(params.output_norm_factor),
+          grain_change(params.output_grain_change), norm_floor(params.meq_threshold),
+          max_bytes(params.output_max_bytes),
+          bytes_written(0), snapshots(0), reason("") {
+    if (check_interval < 1) check_interval = 1;
+    if (max_interval < min_interval) max_interval = min_interval;
+    if (norm_factor <= 1.0) norm_factor = 1.0;
+    start(0);
+}
+
+void OutputPolicy::start(int timestep) {
+    last_timestep = timestep;
+    checks = 0;
+    have_energy = false;
+    ref_energy = 0.0;
+    ref_norm = -1.0;
+    ref_grains = -1;
+}
+
+void OutputPolicy::log_decision(int timestep, double energy, double norm,
+        int num_grains, const char *decision) {
+    if (log_filepath.empty() || pfc->mpi_rank != 0) return;
+    FILE *fp = fopen(log_filepath.c_str(), "a");
+    if (fp == NULL) return;
+    fprintf(fp, "%d %d %.16e %.6e %d %s\n", timestep, timestep - last_timestep,
+            energy, norm, num_grains, decision);
+    fclose(fp);
+}
+
+bool OutputPolicy::check(int timestep, double energy, double norm, int num_grains,
+        int remaining) {
+    // only the root process has the grain count
+    MPI_Bcast(&num_grains, 1, MPI_INT, 0, pfc->comm);
+    checks++;
+    int steps = timestep - last_timestep;
+
+    // the first measurements after the start are the references
+    if (!have_energy) {
+        ref_energy = energy;
+        have_energy = true;
+    }
+    if (ref_norm < 0.0) ref_norm = norm;
+    if (ref_grains < 0) ref_grains = num_grains;
+
+    // snapshots the budget still allows, spread over the remaining checks
+    bool allowed = true;
+    if (max_bytes > 0.0 && snapshots > 0) {
+        double mean_bytes = (double) bytes_written/snapshots;
+        double affordable = std::floor((max_bytes - bytes_written)/mean_bytes);
+        allowed = affordable >= 1.0 && checks >= remaining/affordable;
+    }
+
+    const char *decision = NULL;
+    if (!allowed) {
+        log_decision(timestep, energy, norm, num_grains, "budget");
+        return false;
+    } else if (remaining <= 0) {
+        decision = "final";
+    } else if (steps >= max_interval) {
+        decision = "max_interval";
+    } else if (steps >= min_interval) {
+        if (std::fabs(energy - ref_energy) > energy_change*std::fabs(ref_energy))
+            decision = "energy";
+        else if (norm > 0.0 && norm > norm_factor*std::max(ref_norm, norm_floor))
+            decision = "norm";
+        else if (num_grains >= 0 && ref_grains >= 0
+                && std::abs(num_grains - ref_grains) >= std::max(1.0, grain_change*ref_grains))
+            decision = "grains";
+    }
+    if (decision == NULL) {
+        log_decision(timestep, energy, norm, num_grains, "wait");
+        return false;
+    }
+
+    log_decision(timestep, energy, norm, num_grains, decision);
+    reason = decision;
+    last_timestep = timestep;
+    checks = 0;
+    ref_energy = energy;
+    if (norm > 0.0) ref_norm = norm;
+    if (num_grains >= 0) ref_grains = num_grains;
+    return true;
+}
+
+void OutputPolicy::written(uint64_t bytes) {
+    bytes_written += bytes;
+    snapshots++;
+}
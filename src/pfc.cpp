@@ -6,55 +6,267 @@
 #include <vector>
 #include <cstring>
 #include <array>
-#include <tuple>
+#include <algorithm>
+#include <ctime>
 
 #include <mpi.h>
 #include <fftw3-mpi.h>
 
 #include "pfc.h"
+#include "profiler.h"
 
 #include <random>
 
 // ---------------------------------------------------------------
 // PARAMETERS
 //
-// initialization could also be done in header, if const->constexpr 
-
-const int PhaseField::nx = 512;      //grid size in x direction
-const int PhaseField::ny = 512;      //grid size in y direction
-
-const double PhaseField::dx = 0.25;  //space step in x dir.
-const double PhaseField::dy = 0.25;  //space step in x dir.
-const double PhaseField::dt = 0.125; //time step
+// defaults of every simulation, single values can be overridden with
+// PhaseFieldParameters::set (e.g. by the ensemble parameter file)
+
+PhaseFieldParameters::PhaseFieldParameters() {
+    nx = 512;       //grid size in x direction
+    ny = 512;       //grid size in y direction
+
+    dx = 0.25;      //space step in x dir.
+    dy = 0.25;      //space step in x dir.
+    dt = 0.125;     //time step
+
+    lattice = "hexagonal";  // amplitudes and reciprocal lattice vectors (lattice.h)
+
+    bx = 1.0;       //B^x in Eq.(2.7)
+    bl = 0.95;      //B^l = B^x - dB
+    tt = 0.585;     //tau * - (phi^3)/3, Eq.(2.1) and Eq.(2.2)
+    vv = 1.0;       //nu  * (phi^4)/4,, Eq.(2.2)
+
+    initial_state = "seeds";
+    initial_file = "";              // "file": snapshot of any grid of the same lattice
+    nparticles = 5;                 // number of particles
+    particle_radius = 0.15;         // (max)
+    angle = 3.1415926/180*20.0;     // (max) the grain rotation angle [rad] (e.g., 5 [degree])
+    amplitude = 0.10867304595992146;//the perfect lattice equilibrium value
+    seed = 0;                       // 0: seeded from the current time
+    grain_distribution = "uniform"; // "reference": fixed radius, angles in [0, angle), as in examples/
+    seed_exponent = 16;             // seed profile amplitude/(rd^16+1) (examples/: 12)
+    coarse_levels = 0;              // e.g. 2: relax on nx/4 x ny/4, then nx/2 x ny/2
+    coarse_steps = 500;
+
+    repetitions = 50000;
+    od_steps = 80;
+    out_time = 80;
+    max_iterations = 8000;
+    grain_stats_freq = 1;           // in repetitions of run_calculations
+    defect_freq = 1;                // dislocations.txt, in repetitions (0: off)
+    spectra_freq = 1;               // spectra.txt and spectral_stats.txt (0: off)
+    vtk_upsampling = 1;             // phi in the VTK files on a finer grid (spectral interpolation)
+    write_vtk = false;              // also write phi with every snapshot of run_calculations
+
+    noise_strength = 0.0;           // <xi xi*> = 2 T delta(r-r') delta(t-t')
+    noise_conserved = false;
+
+    // meq_adaptive = true: equilibrate when the phase gradient norm exceeds
+    // the threshold (2x the lbfgs_enhanced tolerance), checked every 20 OD
+    // steps; off by default, so that a repetition stays od_steps OD steps
+    meq_adaptive = false;
+    meq_check_interval = 20;
+    meq_min_interval = 40;
+    meq_max_interval = 400;
+    meq_threshold = 1.0e-7;
+
+    // output_adaptive = true: write a snapshot when the energy, the phase
+    // gradient norm or the grain count has changed enough since the last
+    // one; off by default: every 5 repetitions (every out_time OD steps in test)
+    output_adaptive = false;
+    output_check_interval = 10;
+    output_min_interval = 80;
+    output_max_interval = 4000;
+    output_energy_change = 0.02;
+    output_norm_factor = 4.0;
+    output_grain_change = 0.1;
+    output_max_bytes = 0.0;
+
+    // "auto": measure candidate solvers in the first equilibrations and use
+    // the fastest one (see MechanicalEquilibrium::equilibrate)
+    meq_solver = "lbfgs_enhanced";
+    meq_lbfgs_m = 0;
+    meq_dz = 0.0;
+    meq_calibrate_step = true;  // estimate the step sizes at every equilibration
+    meq_line_search_batch = 1;  // > 1: batched line search with interpolation
+
+    // trade some speed for memory: 3 instead of 9 complex fields between
+    // the equilibrations (see PhaseField::report_memory)
+    low_memory = false;
+
+    // vectorized pointwise kernels, "auto": the best the CPU supports
+    simd = "auto";
+
+    // "finite_difference": G_j with 4th order stencils and halo exchange
+    // between neighbouring processes instead of FFTs (see FiniteDifference)
+    backend = "spectral";
+
+    // sum the energies and norms row by row and over the rows in a fixed
+    // order, so that they don't depend on the number of processes
+    reproducible = false;
+}
 
-//one mode approximation lowest order reciprocal lattice vectors
-//2D hexagonal crystal symmetry. Eq.(2.4)
-const double PhaseField::q_vec[][2] = 
-    {{-0.5*sq3, -0.5},
-     {0.0, 1.0},
-     {0.5*sq3, -0.5}};
+// ---------------------------------------------------------------
 
-const int    PhaseField::nparticles = 5; // number of particles
-const double PhaseField::particle_radius = 0.15; // (max)
-const double PhaseField::angle = 3.1415926/180*20.0; // (max) the grain rotation angle [rad] (e.g., 5 [degree])
-const double PhaseField::amplitude = 0.10867304595992146;//the perfect lattice equilibrium value
+bool PhaseFieldParameters::set(const std::string &key, const std::string &value) {
+    char *end;
+    double v = strtod(value.c_str(), &end);
+    bool number = !value.empty() && *end == '\0';
 
-const double PhaseField::bx = 1.0;  //B^x in Eq.(2.7)
-const double PhaseField::bl = 0.95; //B^l = B^x - dB
-const double PhaseField::tt = 0.585;//tau * - (phi^3)/3, Eq.(2.1) and Eq.(2.2)
-const double PhaseField::vv = 1.0;  //nu  * (phi^4)/4,, Eq.(2.2)
+    if (key == "initial_state") {
+        if (value != "circle" && value != "seed" && value != "seeds"
+                && value != "voronoi" && value != "file") return false;
+        initial_state = value;
+        return true;
+    }
+    if (key == "initial_file") {
+        initial_file = value;
+        return true;
+    }
+    if (key == "meq_solver") {
+        if (value != "lbfgs_enhanced" && value != "lbfgs" && value != "agd"
+                && value != "steepest_descent" && value != "auto") return false;
+        meq_solver = value;
+        return true;
+    }
+    if (key == "grain_distribution") {
+        if (value != "uniform" && value != "reference") return false;
+        grain_distribution = value;
+        return true;
+    }
+    if (key == "lattice") {
+        LatticeType type;
+        if (!find_lattice(value, &type)) return false;
+        lattice = value;
+        return true;
+    }
+    if (key == "simd") {
+        if (value != "auto" && value != "scalar" && value != "avx2"
+                && value != "avx512") return false;
+        simd = value;
+        return true;
+    }
+    if (key == "backend") {
+        if (value != "spectral" && value != "finite_difference") return false;
+        backend = value;
+        return true;
+    }
+    if (!number) return false;
+
+    if      (key == "nx") nx = (int) v;
+    else if (key == "ny") ny = (int) v;
+    else if (key == "dx") dx = v;
+    else if (key == "dy") dy = v;
+    else if (key == "dt") dt = v;
+    else if (key == "bx") bx = v;
+    else if (key == "bl") bl = v;
+    else if (key == "tt") tt = v;
+    else if (key == "vv") vv = v;
+    else if (key == "nparticles") nparticles = (int) v;
+    else if (key == "particle_radius") particle_radius = v;
+    else if (key == "angle") angle = v;
+    else if (key == "angle_deg") angle = v*PI/180.0;
+    else if (key == "amplitude") amplitude = v;
+    else if (key == "seed") seed = (unsigned int) v;
+    else if (key == "repetitions") repetitions = (int) v;
+    else if (key == "od_steps") od_steps = (int) v;
+    else if (key == "out_time") out_time = (int) v;
+    else if (key == "max_iterations") max_iterations = (int) v;
+    else if (key == "grain_stats_freq") grain_stats_freq = (int) v;
+    else if (key == "defect_freq") defect_freq = (int) v;
+    else if (key == "spectra_freq") spectra_freq = (int) v;
+    else if (key == "vtk_upsampling") vtk_upsampling = (int) v;
+    else if (key == "write_vtk") write_vtk = (v != 0.0);
+    else if (key == "seed_exponent") seed_exponent = (int) v;
+    else if (key == "coarse_levels") coarse_levels = (int) v;
+    else if (key == "coarse_steps") coarse_steps = (int) v;
+    else if (key == "low_memory") low_memory = (v != 0.0);
+    else if (key == "reproducible") reproducible = (v != 0.0);
+    else if (key == "noise_strength") noise_strength = v;
+    else if (key == "noise_conserved") noise_conserved = (v != 0.0);
+    else if (key == "meq_adaptive") meq_adaptive = (v != 0.0);
+    else if (key == "meq_check_interval") meq_check_interval = (int) v;
+    else if (key == "meq_min_interval") meq_min_interval = (int) v;
+    else if (key == "meq_max_interval") meq_max_interval = (int) v;
+    else if (key == "meq_threshold") meq_threshold = v;
+    else if (key == "output_adaptive") output_adaptive = (v != 0.0);
+    else if (key == "output_check_interval") output_check_interval = (int) v;
+    else if (key == "output_min_interval") output_min_interval = (int) v;
+    else if (key == "output_max_interval") output_max_interval = (int) v;
+    else if (key == "output_energy_change") output_energy_change = v;
+    else if (key == "output_norm_factor") output_norm_factor = v;
+    else if (key == "output_grain_change") output_grain_change = v;
+    else if (key == "output_max_bytes") output_max_bytes = v;
+    else if (key == "meq_lbfgs_m") meq_lbfgs_m = (int) v;
+    else if (key == "meq_dz") meq_dz = v;
+    else if (key == "meq_calibrate_step") meq_calibrate_step = (v != 0.0);
+    else if (key == "meq_line_search_batch") meq_line_search_batch = (int) v;
+    else return false;
+    return true;
+}
 
-const int    PhaseField::out_time = 80;
-const int    PhaseField::max_iterations = 8000; 
+/*! The lattice of the parameters, hexagonal if the name is not known */
+static const Lattice &parameter_lattice(const std::string &name) {
+    LatticeType type = HEXAGONAL_LATTICE;
+    if (!find_lattice(name, &type))
+        cerr << "Warning: unknown lattice " << name << ", using hexagonal" << endl;
+    return get_lattice(type);
+}
 
-const int    PhaseField::nc = 3;
+PhaseField::PhaseField(MPI_Comm comm_, std::string output_path_,
+        const PhaseFieldParameters &params)
+        : nx(params.nx), ny(params.ny), dx(params.dx), dy(params.dy), dt(params.dt),
+          lattice(parameter_lattice(params.lattice)), nc(lattice.nc), q_vec(lattice.q),
+          bx(params.bx), bl(params.bl), tt(params.tt), vv(params.vv),
+          comm(comm_), output_path(output_path_), mech_eq(this, params),
+          snapshot_writer(comm_), grain_analysis(this),
+          defect_detection(this), spectral_analysis(this), meq_scheduler(this, params),
+          output_policy(this, params),
+          density(this), fd(this, params),
+          parameters(params), initial_state(params.initial_state),
+          nparticles(params.nparticles),
+          particle_radius(params.particle_radius), angle(params.angle),
+          amplitude(params.amplitude), seed(params.seed),
+          grain_distribution(params.grain_distribution == "reference"
+                  ? REFERENCE_GRAINS : UNIFORM_GRAINS),
+          seed_exponent(params.seed_exponent),
+          repetitions(params.repetitions),
+          out_time(params.out_time), max_iterations(params.max_iterations),
+          grain_stats_freq(params.grain_stats_freq), defect_freq(params.defect_freq),
+          spectra_freq(params.spectra_freq),
+          vtk_upsampling(params.vtk_upsampling), write_vtk(params.write_vtk),
+          low_memory(params.low_memory), reproducible(params.reproducible),
+          noise_strength(params.noise_strength), noise_conserved(params.noise_conserved),
+          noise_key(0), timestep(0) {
+
+    MPI_Comm_rank(comm, &mpi_rank);
+    MPI_Comm_size(comm, &mpi_size);
 
-// ---------------------------------------------------------------
+    fftw_mpi_init();
 
-PhaseField::PhaseField(int mpi_rank_, int mpi_size_, std::string output_path_)
-        : mpi_rank(mpi_rank_), mpi_size(mpi_size_), output_path(output_path_), mech_eq(this) {
+    if (!select_kernels(params.simd) && mpi_rank == 0)
+        cerr << "Warning: " << params.simd << " kernels are not supported, using "
+             << kernels(lattice.type).name << endl;
 
-    fftw_mpi_init();
+    if (noise_strength > 0.0) {
+        if (noise_conserved && fd.active()) {
+            if (mpi_rank == 0)
+                cerr << "Warning: conserved noise needs the spectral backend, "
+                     << "using non-conserved noise" << endl;
+            noise_conserved = false;
+        }
+        // the key of the root process, so that the noise is independent of the
+        // process count (and the same again after a restart with this seed)
+        unsigned long long key = seed;
+        if (key == 0 && mpi_rank == 0) key = (unsigned long long) std::time(nullptr);
+        MPI_Bcast(&key, 1, MPI_UNSIGNED_LONG_LONG, 0, comm);
+        noise_key = key;
+        if (mpi_rank == 0)
+            printf("Noise: T = %g, %s, random seed %llu\n", noise_strength,
+                    noise_conserved ? "conserved" : "non-conserved", key);
+    }
    
     // Allocate and calculate k values
     k_x_values = (double*) malloc(sizeof(double)*nx);
@@ -78,19 +290,29 @@ PhaseField::PhaseField(int mpi_rank_, int mpi_size_, std::string output_path_)
     buffer_plan_f = (fftw_plan*) malloc(sizeof(fftw_plan)*nc);
     buffer_plan_b = (fftw_plan*) malloc(sizeof(fftw_plan)*nc);
 
-	exp_part = (complex<double>**) malloc(sizeof(complex<double>*)*nc);
-
-    alloc_local = fftw_mpi_local_size_2d(nx, ny, MPI_COMM_WORLD,
+    alloc_local = fftw_mpi_local_size_2d(nx, ny, comm,
             &local_nx, &local_nx_start);
 
-    // Allocate memory for G_j values and theta gradient
-    g_values = (double**) malloc(sizeof(double*)*nc);
+    int rows[2] = {(int) local_nx, (int) local_nx_start};
+    vector<int> all_rows(2*mpi_size);
+    MPI_Allgather(rows, 2, MPI_INT, all_rows.data(), 2, MPI_INT, comm);
+    for (int r = 0; r < mpi_size; r++) {
+        row_counts.push_back(all_rows[2*r]);
+        row_offsets.push_back(all_rows[2*r+1]);
+    }
+
+    // Allocate memory for G_j values and theta gradient,
+    // in the low memory mode G_j is calculated when needed (see g_value)
+    g_values = NULL;
+    if (!low_memory) {
+        g_values = (double**) malloc(sizeof(double*)*nc);
+        for (int c = 0; c < nc; c++)
+            g_values[c] = (double*) malloc(sizeof(double)*local_nx*ny);
+        calculate_g_values(g_values);
+    }
     grad_theta = (double**) malloc(sizeof(double*)*nc);
-    for (int c = 0; c < nc; c++) {
-        g_values[c] = (double*) malloc(sizeof(double)*local_nx*ny);
+    for (int c = 0; c < nc; c++)
         grad_theta[c] = (double*) malloc(sizeof(double)*local_nx*ny);
-    }
-    calculate_g_values(g_values);
 
 
     for (int i = 0; i < nc; i++) {
@@ -99,37 +321,39 @@ PhaseField::PhaseField(int mpi_rank_, int mpi_size_, std::string output_path_)
         eta_plan_f[i] = fftw_mpi_plan_dft_2d(nx, ny,
                 reinterpret_cast<fftw_complex*>(eta[i]),
                 reinterpret_cast<fftw_complex*>(eta_k[i]),
-                MPI_COMM_WORLD, FFTW_FORWARD, FFTW_ESTIMATE);
+                comm, FFTW_FORWARD, FFTW_ESTIMATE);
         eta_plan_b[i] = fftw_mpi_plan_dft_2d(nx, ny,
                 reinterpret_cast<fftw_complex*>(eta_k[i]),
                 reinterpret_cast<fftw_complex*>(eta[i]),
-                MPI_COMM_WORLD, FFTW_BACKWARD, FFTW_ESTIMATE);
-
-        eta_tmp[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
-        eta_tmp_k[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
-        eta_tmp_plan_f[i] = fftw_mpi_plan_dft_2d(nx, ny,
-                reinterpret_cast<fftw_complex*>(eta_tmp[i]),
-                reinterpret_cast<fftw_complex*>(eta_tmp_k[i]),
-                MPI_COMM_WORLD, FFTW_FORWARD, FFTW_ESTIMATE);
-        eta_tmp_plan_b[i] = fftw_mpi_plan_dft_2d(nx, ny,
-                reinterpret_cast<fftw_complex*>(eta_tmp_k[i]),
-                reinterpret_cast<fftw_complex*>(eta_tmp[i]),
-                MPI_COMM_WORLD, FFTW_BACKWARD, FFTW_ESTIMATE);
+                comm, FFTW_BACKWARD, FFTW_ESTIMATE);
 
+        // buffer and buffer_k are never needed at the same time,
+        // the low memory mode transforms buffer in place
         buffer[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
-        buffer_k[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
+        buffer_k[i] = low_memory ? buffer[i]
+                : reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
         buffer_plan_f[i] = fftw_mpi_plan_dft_2d(nx, ny,
                 reinterpret_cast<fftw_complex*>(buffer[i]),
                 reinterpret_cast<fftw_complex*>(buffer_k[i]),
-                MPI_COMM_WORLD, FFTW_FORWARD, FFTW_ESTIMATE);
+                comm, FFTW_FORWARD, FFTW_ESTIMATE);
         buffer_plan_b[i] = fftw_mpi_plan_dft_2d(nx, ny,
                 reinterpret_cast<fftw_complex*>(buffer_k[i]),
                 reinterpret_cast<fftw_complex*>(buffer[i]),
-                MPI_COMM_WORLD, FFTW_BACKWARD, FFTW_ESTIMATE);
-    	
-    	exp_part[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
+                comm, FFTW_BACKWARD, FFTW_ESTIMATE);
+
+        eta_tmp[i] = NULL; eta_tmp_k[i] = NULL;
     }
 
+    last_version = 0;
+    eta_version = ++last_version;
+    eta_k_version = eta_tmp_version = eta_tmp_k_version = 0;
+    energy_versions[0] = energy_versions[1] = grad_version = 0;
+    energy_slot = 0;
+
+    // the solver work fields are allocated on demand in the low memory mode
+    if (!low_memory) allocate_eta_tmp();
+
+    fd.setup();
 }
 
 PhaseField::~PhaseField() {
@@ -137,21 +361,26 @@ PhaseField::~PhaseField() {
         fftw_free(eta[i]); fftw_free(eta_k[i]);
         fftw_destroy_plan(eta_plan_f[i]); fftw_destroy_plan(eta_plan_b[i]);
 
-        fftw_free(buffer[i]); fftw_free(buffer_k[i]);
+        fftw_free(buffer[i]);
+        if (buffer_k[i] != buffer[i]) fftw_free(buffer_k[i]);
         fftw_destroy_plan(buffer_plan_f[i]); fftw_destroy_plan(buffer_plan_b[i]);
 
-        free(g_values[i]);
+        if (g_values) free(g_values[i]);
+        free(grad_theta[i]);
     }
+    free_eta_tmp();
+
     free(eta); free(eta_k);
     free(eta_plan_f); free(eta_plan_b);
 
+    free(eta_tmp); free(eta_tmp_k);
+    free(eta_tmp_plan_f); free(eta_tmp_plan_b);
+
     free(buffer); free(buffer_k);
     free(buffer_plan_f); free(buffer_plan_b);
 
     free(k_x_values); free(k_y_values);
-    free(g_values);
-	
-	free(exp_part);
+    free(g_values); free(grad_theta);
 }
 
 /*! Method, that initializes the state to a elastically rotated circle
@@ -203,91 +432,122 @@ void PhaseField::initialize_eta_seed() {
     }
 }
 
-/*! Method, that initializes the state of eta to liquid with a seed in center
- *
+/*! Method, that initializes the state of eta to liquid with nparticles
+ *  rotated seeds (see Polycrystal::seeds)
  */
 void PhaseField::initialize_eta_multiple_seeds() {
-    //double amplitude = 0.10867304595992146;
+    Polycrystal polycrystal(this, nparticles, particle_radius, angle, seed,
+            grain_distribution, seed_exponent);
+    polycrystal.seeds();
+    if (mpi_rank == 0)
+        printf("%sInitial state: %d seeds, random seed %llu\n", log_prefix.c_str(),
+                nparticles, (unsigned long long) polycrystal.get_seed());
+}
 
-    // <rel_x, rel_y, size, angle>
-    /*
-    std::vector<std::tuple<double, double, double, double>> seeds = {
-    		std::make_tuple(0.86, 0.66, 0.06, -0.20),
-			std::make_tuple(0.59, 0.21, 0.03, -0.10),
-			std::make_tuple(0.33, 0.80, 0.06,  0.00),
-			std::make_tuple(0.38, 0.41, 0.06,  0.05),
-			std::make_tuple(0.51, 0.17, 0.03,  0.20),
-			std::make_tuple(0.16, 0.19, 0.03,  0.10),
-			std::make_tuple(0.99, 0.99, 0.12,  0.15)
-    };
-    */
+/*! Method, that initializes eta from the snapshot initial_file, resampled
+ *  to the grid if needed (see resample_spectra)
+ */
+void PhaseField::initialize_eta_from_file() {
+    if (!read_eta_from_snapshot(parameters.initial_file)) {
+        if (mpi_rank == 0)
+            cerr << "Error: couldn't start from '" << parameters.initial_file << "'" << endl;
+        MPI_Abort(comm, 1);
+    }
+    if (mpi_rank == 0)
+        printf("%sInitial state: %s\n", log_prefix.c_str(), parameters.initial_file.c_str());
+}
 
-    //std::vector<std::tuple<double, double, double, double>> seeds = {
-	//		std::make_tuple(0.3, 0.5, 0.15, 0.0),
-	//		std::make_tuple(0.7, 0.5, 0.15, 0.2),
-    //};
-	
-	std::srand(std::time(nullptr));
-    std::vector<std::tuple<double, double, double, double>> seeds;
-	for (int i = 0; i < nparticles; i++) {
-		seeds.push_back( std::make_tuple( 
-			(double) rand()/RAND_MAX, 
-			(double) rand()/RAND_MAX,
-			(double) rand()/RAND_MAX*particle_radius, 
-			(double) rand()/RAND_MAX*2.0*angle - angle
-		) );
-	}
+/*! Method, that initializes the state of eta to a polycrystal of nparticles
+ *  grains (see Polycrystal::voronoi)
+ */
+void PhaseField::initialize_eta_voronoi() {
+    Polycrystal polycrystal(this, nparticles, particle_radius, angle, seed,
+            grain_distribution, seed_exponent);
+    polycrystal.voronoi();
+    if (mpi_rank == 0)
+        printf("%sInitial state: %d grains, random seed %llu\n", log_prefix.c_str(),
+                nparticles, (unsigned long long) polycrystal.get_seed());
+}
 
 
-    for (int i = 0; i < local_nx; i++) {
-        int i_gl = i + local_nx_start;
-        for (int j = 0; j < ny; j++) {
-            for (int c = 0; c < nc; c++) {
-            	eta[c][i*ny + j] = 0.0;
-            	for (auto seed : seeds) {
-            		// current coordinates
-            		double x = i_gl*dx;
-            		double y = j*dy;
+/*! Initializes eta to the initial state chosen in the parameters
+ *
+ */
+void PhaseField::initialize_eta() {
+    if (parameters.coarse_levels > 0) {
+        warm_start();
+        return;
+    }
+    initialize_eta_state();
+}
 
-            		// seed center coordinates
-            		double x_c = (nx-1)*std::get<0>(seed)*dx;
-            		double y_c = (ny-1)*std::get<1>(seed)*dy;
+void PhaseField::initialize_eta_state() {
+    if (initial_state == "circle") initialize_eta_circle();
+    else if (initial_state == "file") initialize_eta_from_file();
+    else if (initial_state == "seed") initialize_eta_seed();
+    else if (initial_state == "voronoi") initialize_eta_voronoi();
+    else initialize_eta_multiple_seeds();
+    field_changed(eta);
+}
 
-            		// differences considering periodic boundary
-            		double x_dif = (abs(x-x_c) < nx*dx-abs(x-x_c)) ? (x-x_c) : (nx*dx-(x-x_c));
-            		double y_dif = (abs(y-y_c) < ny*dy-abs(y-y_c)) ? (y-y_c) : (ny*dy-(y-y_c));
 
-            		if (abs(x-x_c) < nx*dx-abs(x-x_c)) x_dif = x-x_c;
-            		else if (abs((x+nx*dx)-x_c) < abs((x-nx*dx)-x_c)) x_dif = (x+nx*dx)-x_c;
-            		else x_dif = (x-nx*dx)-x_c;
+void PhaseField::take_fft(fftw_plan *plan) {
+    // a transform of eta (eta_tmp) makes its fields a new consistent state
+    unsigned long *real = NULL, *k = NULL;
+    if (plan == eta_plan_f || plan == eta_plan_b) {
+        real = &eta_version; k = &eta_k_version;
+    } else if (plan == eta_tmp_plan_f || plan == eta_tmp_plan_b) {
+        real = &eta_tmp_version; k = &eta_tmp_k_version;
+    }
+    if (real) *real = *k = ++last_version;
 
-            		if (abs(y-y_c) < ny*dy-abs(y-y_c)) y_dif = y-y_c;
-					else if (abs((y+ny*dy)-y_c) < abs((y-ny*dy)-y_c)) y_dif = (y+ny*dy)-y_c;
-					else y_dif = (y-ny*dy)-y_c;
+    // the finite-difference backend doesn't use eta_k (or eta_tmp_k),
+    // only their copies are moved around
+    if (fd.active() && (plan == eta_plan_f || plan == eta_tmp_plan_f)) return;
 
-            		// distance from center (considering periodic boundary)
-            		double center_dist = std::sqrt(x_dif*x_dif + y_dif*y_dif);
-            		double rd = center_dist/(std::get<2>(seed)*nx*dx);
+    PROFILE_SCOPE("fft");
+    PROFILE_COUNT("fft_transforms", nc);
+    // a distributed 2D transform transposes the local data twice
+    PROFILE_COUNT("fft_bytes_transposed", 2.0*nc*local_nx*ny*sizeof(complex<double>));
+    for (int i = 0; i < nc; i++) {
+        fftw_execute(plan[i]);
+    }
+}
 
-            		// apply a rotation around point (x_c, y_c) by the angle
-            		double ang = std::get<3>(seed);
+/*! Stamp of the real (or k space) field of eta or eta_tmp, NULL for
+ *  untracked fields
+ */
+unsigned long *PhaseField::version_of(complex<double> **field, bool k_space) {
+    if (field == eta || field == eta_k)
+        return k_space ? &eta_k_version : &eta_version;
+    if (field == eta_tmp || field == eta_tmp_k)
+        return k_space ? &eta_tmp_k_version : &eta_tmp_version;
+    return NULL;
+}
 
-            		double theta = q_vec[c][0]*((cos(ang)-1)*x_dif - sin(ang)*y_dif)
-								   + q_vec[c][1]*(sin(ang)*x_dif + (cos(ang)-1)*y_dif);
+void PhaseField::field_changed(complex<double> **field) {
+    unsigned long *real = version_of(field, false);
+    if (real) *real = ++last_version;
+}
 
-                    eta[c][i*ny + j] += amplitude/(std::pow(rd, 16)+1)
-                    					* exp(complex<double>(0.0, 1.0)*theta);
-            	}
-            }
-        }
-    }
+void PhaseField::field_copied(complex<double> **field, unsigned long version) {
+    unsigned long *real = version_of(field, false), *k = version_of(field, true);
+    if (real) *real = *k = version;
 }
 
+unsigned long PhaseField::field_version(complex<double> **field) {
+    unsigned long *real = version_of(field, false);
+    return real ? *real : 0;
+}
 
-void PhaseField::take_fft(fftw_plan *plan) {
-    for (int i = 0; i < nc; i++) {
-        fftw_execute(plan[i]);
+void PhaseField::update_k(complex<double> **field) {
+    unsigned long *real = version_of(field, false), *k = version_of(field, true);
+    if (real == NULL) return;
+    if (*k == *real) {
+        PROFILE_COUNT("fft_skipped", nc);
+        return;
     }
+    take_fft((field == eta || field == eta_k) ? eta_plan_f : eta_tmp_plan_f);
 }
 
 void PhaseField::normalize_field(complex<double> **field) {
@@ -319,7 +579,7 @@ void PhaseField::output_field(complex<double>*field) {
             fftw_malloc(sizeof(complex<double>)*nx*ny);
 
     // local_nx*ny*2, because one fftw_complex element contains 2 doubles
-    MPI_Gather(field, local_nx*ny*2, MPI_DOUBLE, field_total, local_nx*ny*2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    MPI_Gather(field, local_nx*ny*2, MPI_DOUBLE, field_total, local_nx*ny*2, MPI_DOUBLE, 0, comm);
     if (mpi_rank == 0) {
         for (int i = 0; i < nx; i++) {
             std::cout << "|";
@@ -362,18 +622,70 @@ void PhaseField::calculate_k_values(double *k_values, int n, double d) {
  */
 void PhaseField::calculate_g_values(double **g_values) {
     for (int i = 0; i < local_nx; i++) {
-        int i_shift = i + local_nx_start;
         for (int j = 0; j < ny; j++) {
-            double k_sq = k_x_values[i_shift]*k_x_values[i_shift]
-                + k_y_values[j]*k_y_values[j];
-            for (int n = 0; n < 3; n++) {
-                g_values[n][i*ny + j] = - k_sq - 2*(q_vec[n][0]*k_x_values[i_shift]
-                        + q_vec[n][1]*k_y_values[j]);
+            for (int n = 0; n < nc; n++) {
+                g_values[n][i*ny + j] = calculate_g_value(n, i, j);
             }
         }
     }
 }
 
+/*! Method, that allocates eta_tmp, eta_tmp_k and their plans, if they
+ *  aren't allocated yet
+ */
+void PhaseField::allocate_eta_tmp() {
+    if (eta_tmp[0] != NULL) return;
+    for (int i = 0; i < nc; i++) {
+        eta_tmp[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
+        eta_tmp_k[i] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(alloc_local));
+        eta_tmp_plan_f[i] = fftw_mpi_plan_dft_2d(nx, ny,
+                reinterpret_cast<fftw_complex*>(eta_tmp[i]),
+                reinterpret_cast<fftw_complex*>(eta_tmp_k[i]),
+                comm, FFTW_FORWARD, FFTW_ESTIMATE);
+        eta_tmp_plan_b[i] = fftw_mpi_plan_dft_2d(nx, ny,
+                reinterpret_cast<fftw_complex*>(eta_tmp_k[i]),
+                reinterpret_cast<fftw_complex*>(eta_tmp[i]),
+                comm, FFTW_BACKWARD, FFTW_ESTIMATE);
+    }
+    eta_tmp_version = ++last_version;
+    eta_tmp_k_version = 0;
+}
+
+void PhaseField::free_eta_tmp() {
+    if (eta_tmp[0] == NULL) return;
+    for (int i = 0; i < nc; i++) {
+        fftw_free(eta_tmp[i]); fftw_free(eta_tmp_k[i]);
+        fftw_destroy_plan(eta_tmp_plan_f[i]); fftw_destroy_plan(eta_tmp_plan_b[i]);
+        eta_tmp[i] = NULL; eta_tmp_k[i] = NULL;
+    }
+}
+
+/*! Method, that frees the solver work fields in the low memory mode */
+void PhaseField::release_eta_tmp() {
+    if (low_memory) free_eta_tmp();
+}
+
+void PhaseField::report_memory() {
+    double complex_field = nc*alloc_local*sizeof(complex<double>);
+    double real_field = nc*local_nx*ny*sizeof(double);
+
+    // eta, eta_k, buffer(_k), eta_tmp(_k), grad_theta, g_values
+    double fields = (low_memory ? 3 : 6)*complex_field + (low_memory ? 1 : 2)*real_field;
+    fields += fd.workspace_bytes();
+    double peak = fields + mech_eq.workspace_bytes()
+                  + (low_memory ? 2*complex_field : 0.0);
+
+    double mb[2] = {fields/1048576.0, peak/1048576.0};
+    MPI_Allreduce(MPI_IN_PLACE, mb, 2, MPI_DOUBLE, MPI_MAX, comm);
+    string backend = fd.active() ? "finite-difference backend ("
+            + to_string(fd.get_stages()) + " stages per OD step)" : "spectral backend";
+    if (mpi_rank == 0)
+        printf("%sMemory per process%s: fields %.1f MB, equilibration peak %.1f MB; "
+                "%s kernels, %s\n", log_prefix.c_str(),
+                low_memory ? " (low memory mode)" : "", mb[0], mb[1],
+                kernels(lattice.type).name, backend.c_str());
+}
+
 
 void PhaseField::memcopy_eta(complex<double> **eta_to, complex<double> **eta_from) {
     for (int c = 0; c < nc; c++) {
@@ -381,52 +693,151 @@ void PhaseField::memcopy_eta(complex<double> **eta_to, complex<double> **eta_fro
     }
 }
 
+/*! Method, that receives the first local row of the next process
+ *
+ *  Neighbour of the last global row is the first global row (periodic).
+ *  Processes without any rows are skipped. "count" elements of "type"
+ *  are sent from first_row and received to next_row.
+ */
+void PhaseField::receive_next_row(void *first_row, void *next_row, int count,
+        MPI_Datatype type) {
+    int range[2] = {(int) local_nx_start, (int) local_nx};
+    int *ranges = (int*) malloc(sizeof(int)*2*mpi_size);
+    MPI_Allgather(range, 2, MPI_INT, ranges, 2, MPI_INT, comm);
+
+    // owners of the row after the last local row and before the first one
+    int next_gl = (local_nx_start + local_nx) % nx;
+    int prev_gl = (local_nx_start - 1 + nx) % nx;
+    int next_owner = 0, prev_owner = 0;
+    for (int r = 0; r < mpi_size; r++) {
+        if (next_gl >= ranges[2*r] && next_gl < ranges[2*r] + ranges[2*r+1]) next_owner = r;
+        if (prev_gl >= ranges[2*r] && prev_gl < ranges[2*r] + ranges[2*r+1]) prev_owner = r;
+    }
+    free(ranges);
+
+    if (local_nx > 0) {
+        MPI_Request requests[2];
+        MPI_Irecv(next_row, count, type, next_owner, 0, comm, &requests[0]);
+        MPI_Isend(first_row, count, type, prev_owner, 0, comm, &requests[1]);
+        MPI_Waitall(2, requests, MPI_STATUSES_IGNORE);
+    }
+}
+
+
+/*! Sum of n doubles, halves are summed recursively (the order depends
+ *  only on n)
+ */
+static double pairwise_sum(const double *v, int n) {
+    if (n <= 8) {
+        double sum = 0.0;
+        for (int k = 0; k < n; k++) sum += v[k];
+        return sum;
+    }
+    return pairwise_sum(v, n/2) + pairwise_sum(v + n/2, n - n/2);
+}
+
+/*! Method, that sums a value over the whole grid reproducibly
+ *
+ *  The local row sums are gathered in the global row order and summed
+ *  pairwise on every process, so the result is the same for any number of
+ *  processes (if the row sums are), and the same on every process.
+ */
+double PhaseField::reproducible_sum(const double *row_sums) {
+    PROFILE_SCOPE("allreduce");
+    vector<double> all_sums(nx);
+    MPI_Allgatherv(row_sums, local_nx, MPI_DOUBLE, all_sums.data(), row_counts.data(),
+            row_offsets.data(), MPI_DOUBLE, comm);
+    return pairwise_sum(all_sums.data(), nx);
+}
 
 /*! Method to calculate energy.
  *
- *  NB: This method assumes that eta_k is set beforehand.
- *  Takes 1 fft
+ *  eta_k of eta and eta_tmp is updated if needed, for other fields it has
+ *  to be set beforehand. The energies of the last two states of eta and
+ *  eta_tmp are memoized.
+ *  Takes 1 fft (1 halo exchange with the finite-difference backend)
  */
 double PhaseField::calculate_energy(complex<double> **eta_, complex<double> **eta_k_) {
-    // will use the member variable buffer_k to hold (G_j eta_j)_k
-    memcopy_eta(buffer_k, eta_k_);
+    update_k(eta_);
+    unsigned long version = field_version(eta_);
+    for (int m = 0; m < 2 && version; m++) {
+        if (energy_versions[m] == version) {
+            PROFILE_COUNT("energy_memo_hits", 1);
+            return energy_values[m];
+        }
+    }
 
-    //  Multiply eta_k by G_j in k space
-    for (int c = 0; c < nc; c++) {
-        for (int i = 0; i < local_nx; i++) {
-            for (int j = 0; j < ny; j++) {
-                buffer_k[c][i*ny + j] *= g_values[c][i*ny + j];
+    double energy = evaluate_energy(eta_, eta_k_);
+    if (version) {
+        energy_versions[energy_slot] = version;
+        energy_values[energy_slot] = energy;
+        energy_slot = 1 - energy_slot;
+    }
+    return energy;
+}
+
+double PhaseField::evaluate_energy(complex<double> **eta_, complex<double> **eta_k_) {
+    PROFILE_SCOPE("energy");
+    PROFILE_COUNT("energy_evaluations", 1);
+
+    const KernelTable &kern = kernels(lattice.type);
+
+    if (fd.active()) {
+        // (G_j eta_j) with the stencils
+        fd.apply_g(buffer, eta_);
+    } else {
+        // will use the member variable buffer_k to hold (G_j eta_j)_k
+        memcopy_eta(buffer_k, eta_k_);
+
+        vector<double> g_scratch(ny);
+
+        //  Multiply eta_k by G_j in k space
+        {
+            PROFILE_SCOPE("kernel_kspace_multiply");
+            for (int c = 0; c < nc; c++) {
+                for (int i = 0; i < local_nx; i++) {
+                    kern.scale(buffer_k[c] + i*ny, g_row(c, i, g_scratch.data()), ny);
+                }
             }
         }
+
+        // Go to real space for (G_j eta_j)
+        take_fft(buffer_plan_b);
+        normalize_field(buffer);
     }
 
-    // Go to real space for (G_j eta_j)
-    take_fft(buffer_plan_b);
-    normalize_field(buffer);
+    if (reproducible) {
+        // energy density summed by rows
+        vector<double> row_sums(local_nx);
+        {
+            PROFILE_SCOPE("kernel_energy_density");
+            vector<complex<double>*> eta_row(nc), buffer_row(nc);
+            for (int i = 0; i < local_nx; i++) {
+                for (int c = 0; c < nc; c++) {
+                    eta_row[c] = eta_[c] + i*ny;
+                    buffer_row[c] = buffer[c] + i*ny;
+                }
+                row_sums[i] = kern.energy_density(eta_row.data(), buffer_row.data(),
+                        bx, bl, tt, vv, ny);
+            }
+        }
+        return reproducible_sum(row_sums.data())/(nx*ny);
+    }
 
     // Integrate the whole expression over space and divide by num cells to get density
     // NB: this will be the contribution from local MPI process only
     double local_energy = 0.0;
-    for (int i = 0; i < local_nx; i++) {
-        for (int j = 0; j < ny; j++) {
-            complex<double> eta0=eta_[0][i*ny+j]; complex<double> buf0=buffer[0][i*ny+j];
-            complex<double> eta1=eta_[1][i*ny+j]; complex<double> buf1=buffer[1][i*ny+j];
-            complex<double> eta2=eta_[2][i*ny+j]; complex<double> buf2=buffer[2][i*ny+j];
-            double aa = 2*(abs(eta0)*abs(eta0) + abs(eta1)*abs(eta1) + abs(eta2)*abs(eta2));
-
-            local_energy += aa*(bl-bx)/2.0 + (3.0/4.0)*vv*aa*aa
-                         - 4*tt*real(eta0*eta1*eta2)
-                         + bx*(abs(buf0)*abs(buf0)+abs(buf1)*abs(buf1)+abs(buf2)*abs(buf2))
-                         - (3.0/2.0)*vv*(abs(eta0)*abs(eta0)*abs(eta0)*abs(eta0)
-                                            + abs(eta1)*abs(eta1)*abs(eta1)*abs(eta1)
-                                            + abs(eta2)*abs(eta2)*abs(eta2)*abs(eta2));
-        }
+    {
+        PROFILE_SCOPE("kernel_energy_density");
+        local_energy = kern.energy_density(eta_, buffer, bx, bl, tt, vv, local_nx*ny);
     }
     local_energy *= 1.0/(nx*ny);
 
     double energy = 0.0;
-    
-    MPI_Allreduce(&local_energy, &energy, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    {
+        PROFILE_SCOPE("allreduce");
+        MPI_Allreduce(&local_energy, &energy, 1, MPI_DOUBLE, MPI_SUM, comm);
+    }
     /*
     if (mpi_rank == 0) {
         printf("Energy: %.16e\n", energy);
@@ -442,46 +853,88 @@ double PhaseField::calculate_energy(complex<double> **eta_, complex<double> **et
  */
 void PhaseField::calculate_nonlinear_part(int i, int j, complex<double> *components,
         complex<double> **eta_) {
-    complex<double> eta0 = eta_[0][i*ny+j];
-    complex<double> eta1 = eta_[1][i*ny+j];
-    complex<double> eta2 = eta_[2][i*ny+j];
-    double aa = 2*(abs(eta0)*abs(eta0) + abs(eta1)*abs(eta1) + abs(eta2)*abs(eta2));
-    components[0] = 3*vv*(aa-abs(eta0)*abs(eta0))*eta0 - 2*tt*conj(eta1)*conj(eta2);
-    components[1] = 3*vv*(aa-abs(eta1)*abs(eta1))*eta1 - 2*tt*conj(eta0)*conj(eta2);
-    components[2] = 3*vv*(aa-abs(eta2)*abs(eta2))*eta2 - 2*tt*conj(eta1)*conj(eta0);
+    double aa = 0.0;
+    for (int c = 0; c < nc; c++)
+        aa += 2*norm(eta_[c][i*ny+j]);
+    for (int c = 0; c < nc; c++)
+        components[c] = 3*vv*(aa-norm(eta_[c][i*ny+j]))*eta_[c][i*ny+j];
+    // the cubic term couples the amplitudes of the resonant triads
+    for (int t = 0; t < lattice.num_triads; t++) {
+        const int *tr = lattice.triads[t];
+        for (int m = 0; m < 3; m++) {
+            int a = tr[(m+1) % 3], b = tr[(m+2) % 3];
+            components[tr[m]] -= 2*tt*conj(eta_[a][i*ny+j])*conj(eta_[b][i*ny+j]);
+        }
+    }
+}
+
+NoiseStream PhaseField::noise_stream(int c, long cell, bool k_space) const {
+    NoiseStream noise;
+    noise.key = noise_key;
+    noise.cell = cell;
+    noise.step = (uint32_t) timestep;
+    noise.component = c;
+    // the time integral of the noise over a step, averaged over a cell,
+    // and its transform (nx ny times the variance)
+    double variance = 2*noise_strength*dt/(dx*dy);
+    if (k_space) variance *= (double) nx*ny;
+    noise.amplitude = sqrt(variance);
+    noise.q_sq = noise_conserved ? q_vec[c][0]*q_vec[c][0] + q_vec[c][1]*q_vec[c][1] : -1.0;
+    return noise;
 }
 
 /*! Method, which takes an overdamped dynamics time step
  *
+ *  With noise_strength > 0, the Langevin noise of the step "timestep" is
+ *  added (see NoiseStream): the same for any number of processes, and
+ *  regenerated after a restart from the step count.
  */
 void PhaseField::overdamped_time_step() {
-    // Will use buffer to hold intermediate results
-    memcopy_eta(buffer, eta);
-
-    // allocate memory for the nonlinear part
-    complex<double> *nonlinear_part = (complex<double>*) malloc(sizeof(complex<double>)*nc);
-
-    // buffer contains eta, let's subtract dt*(nonlinear part)
-    // to get the numerator in the OD time stepping scheme (in real space)
-    for (int i = 0; i < local_nx; i++) {
-        for (int j = 0; j < ny; j++) {
-            calculate_nonlinear_part(i, j, nonlinear_part, eta);
+    PROFILE_SCOPE("od_step");
+
+    if (fd.active()) {
+        fd.time_step(eta);
+        if (noise_strength > 0.0) {
+            PROFILE_SCOPE("kernel_noise");
+            const KernelTable &kern = kernels(lattice.type);
+            // by rows, so that the vectorized part doesn't depend on local_nx
             for (int c = 0; c < nc; c++) {
-                buffer[c][i*ny + j] -= dt*nonlinear_part[c];
+                for (int i = 0; i < local_nx; i++) {
+                    kern.add_noise(eta[c] + i*ny,
+                            noise_stream(c, (long) (i + local_nx_start)*ny, false), ny);
+                }
             }
         }
+        field_changed(eta);
+        timestep++;
+        return;
+    }
+
+    const KernelTable &kern = kernels(lattice.type);
+
+    // Will use buffer to hold intermediate results: eta - dt*(nonlinear part),
+    // the numerator in the OD time stepping scheme (in real space)
+    {
+        PROFILE_SCOPE("kernel_od_nonlinear");
+        kern.od_nonlinear(buffer, eta, dt, tt, vv, local_nx*ny);
     }
-    free(nonlinear_part);
     
     // take buffer into k space
     take_fft(buffer_plan_f);
     
-    // now eta_k can be evaluated correspondingly to the scheme
-    for (int c = 0; c < nc; c++) {
-		for (int i = 0; i < local_nx; i++) {
-			for (int j = 0; j < ny; j++) {
-				eta_k[c][i*ny + j] = buffer_k[c][i*ny + j] / (1.0 + dt*(bl-bx
-										+bx*g_values[c][i*ny + j]*g_values[c][i*ny + j]));
+    // now eta_k can be evaluated correspondingly to the scheme, with the
+    // noise added to the numerator (white noise is also white in k space)
+    {
+        PROFILE_SCOPE("kernel_od_kspace");
+        vector<double> g_scratch(ny);
+        for (int c = 0; c < nc; c++) {
+            for (int i = 0; i < local_nx; i++) {
+                const double *g = g_row(c, i, g_scratch.data());
+                if (noise_strength > 0.0)
+                    kern.od_kspace_noise(eta_k[c] + i*ny, buffer_k[c] + i*ny, g, dt, bx, bl,
+                            noise_stream(c, (long) (i + local_nx_start)*ny, true), ny);
+                else
+                    kern.od_kspace(eta_k[c] + i*ny, buffer_k[c] + i*ny, g, dt, bx, bl, ny);
             }
         }
     }
@@ -489,6 +942,7 @@ void PhaseField::overdamped_time_step() {
     // Take eta back to real space
     take_fft(eta_plan_b);
     normalize_field(eta);
+    timestep++;
 
 }
 
@@ -502,50 +956,54 @@ double PhaseField::dot_prod(const double* v1, const double* v2, const int len) {
 
 /*! Method, which calculates the gradient of thetas
  *
- *  The resulting gradient will be stored in "grad_theta"
- *  NB: required eta_k to be set
- *  Takes 1 fft
+ *  The resulting gradient will be stored in "grad_theta", it is not
+ *  calculated again for the same state of eta or eta_tmp.
+ *  NB: eta_k of other fields has to be set
+ *  Takes 1 fft (2 halo exchanges with the finite-difference backend)
  */
 void PhaseField::calculate_grad_theta(complex<double> **eta_, complex<double> **eta_k_) {
-    // will use the member variable buffer_k to hold (G_j^2 eta_j)_k
-    memcopy_eta(buffer_k, eta_k_);
-
-    //  Multiply eta_k by G_j^2 in k space
-    for (int c = 0; c < nc; c++) {
-        for (int i = 0; i < local_nx; i++) {
-            for (int j = 0; j < ny; j++) {
-                buffer_k[c][i*ny + j] *= g_values[c][i*ny + j]*g_values[c][i*ny + j];
-            }
-        }
+    update_k(eta_);
+    unsigned long version = field_version(eta_);
+    if (version && version == grad_version) {
+        PROFILE_COUNT("gradient_memo_hits", 1);
+        return;
     }
+    evaluate_grad_theta(eta_, eta_k_);
+    grad_version = version;
+}
 
-    // Go to real space for (G_j^2 eta_j)
-    take_fft(buffer_plan_b);
-    normalize_field(buffer);
+void PhaseField::evaluate_grad_theta(complex<double> **eta_, complex<double> **eta_k_) {
+    PROFILE_SCOPE("grad_theta");
+    PROFILE_COUNT("gradient_evaluations", 1);
 
-    // allocate memory for the nonlinear part and a temporary result
-    complex<double> *nonlinear_part = (complex<double>*) malloc(sizeof(complex<double>)*nc);
-    double *im = (double*) malloc(sizeof(double)*nc);
+    const KernelTable &kern = kernels(lattice.type);
 
-    for (int i = 0; i < local_nx; i++) {
-        for (int j = 0; j < ny; j++) {
-           calculate_nonlinear_part(i, j, nonlinear_part, eta_);
-           for (int c = 0; c < nc; c++) {
-                complex<double> var_f_eta = (bl-bx)*eta_[c][i*ny+j] + bx*buffer[c][i*ny+j]
-                                            + nonlinear_part[c];
-                im[c] = imag(conj(eta_[c][i*ny+j])*var_f_eta);
-           }
-           for (int c = 0; c < nc; c++) {
-                double dtheta = dot_prod(q_vec[c], q_vec[0], 2)*im[0]
-                               + dot_prod(q_vec[c], q_vec[1], 2)*im[1]
-                               + dot_prod(q_vec[c], q_vec[2], 2)*im[2];
-                grad_theta[c][i*ny+j] = dtheta;
-           }
+    if (fd.active()) {
+        // (G_j^2 eta_j) with the stencils
+        fd.apply_g_sq(buffer, eta_);
+    } else {
+        // will use the member variable buffer_k to hold (G_j^2 eta_j)_k
+        memcopy_eta(buffer_k, eta_k_);
+
+        vector<double> g_scratch(ny);
+
+        //  Multiply eta_k by G_j^2 in k space
+        {
+            PROFILE_SCOPE("kernel_kspace_multiply");
+            for (int c = 0; c < nc; c++) {
+                for (int i = 0; i < local_nx; i++) {
+                    kern.scale_sq(buffer_k[c] + i*ny, g_row(c, i, g_scratch.data()), ny);
+                }
+            }
         }
+
+        // Go to real space for (G_j^2 eta_j)
+        take_fft(buffer_plan_b);
+        normalize_field(buffer);
     }
 
-    free(nonlinear_part);
-    free(im);
+    PROFILE_SCOPE("kernel_grad_theta");
+    kern.grad_theta(grad_theta, eta_, buffer, bx, bl, tt, vv, local_nx*ny);
 }
 
 /*! Method, that writes current eta to a binary file
@@ -555,13 +1013,15 @@ void PhaseField::calculate_grad_theta(complex<double> **eta_, complex<double> **
  *  if eta[c][i*ny+j], then fastest moving index is j, then i and finally c
  */
 void PhaseField::write_eta_to_file(string filepath) {
+    PROFILE_SCOPE("io_write");
+    PROFILE_COUNT("io_bytes_written", 2.0*nc*local_nx*ny*sizeof(double));
 
 
     // delete old file
     if (mpi_rank == 0) MPI_File_delete(filepath.c_str(), MPI_INFO_NULL);
 
     MPI_File mpi_file;
-    int rcode = MPI_File_open(MPI_COMM_WORLD, filepath.c_str(),
+    int rcode = MPI_File_open(comm, filepath.c_str(),
             MPI_MODE_CREATE | MPI_MODE_RDWR, MPI_INFO_NULL, &mpi_file);
 
     if (rcode != MPI_SUCCESS)
@@ -584,43 +1044,29 @@ void PhaseField::write_eta_to_file(string filepath) {
     MPI_File_close(&mpi_file);
 }
 
+/*! Method, that writes sum_j |eta_j| and the atomic density phi to a VTK file
+ *
+ *  phi is reconstructed on a grid vtk_upsampling times finer (see
+ *  DensityReconstruction)
+ */
 void PhaseField::write_eta_to_vtk_file(string filepath) {
-
-	FILE *fp;
-	fp = fopen(filepath.c_str(), "w");
-	fprintf(fp,"# vtk DataFile Version 3.0 \n");
-	fprintf(fp,"output.vtk \n");
-	fprintf(fp,"ASCII \n");
-	fprintf(fp,"DATASET STRUCTURED_POINTS \n");
-	fprintf(fp,"DIMENSIONS %5d %5d %5d \n",(nx),(ny),(1));
-	fprintf(fp,"ORIGIN 0.0 0.0 0.0 \n");
-	fprintf(fp,"ASPECT_RATIO %f %f %f \n",float(nx/nx),float(ny/nx),float(1));
-	fprintf(fp,"POINT_DATA %16d \n",((nx)*(ny)*(1)));
-	fprintf(fp,"SCALARS eta float \n");
-	fprintf(fp,"LOOKUP_TABLE default \n");
-	for(int j=0;j<ny;j++){
-		for(int i=0;i<nx;i++){
-			fprintf(fp,"%10.6f\n", (abs(eta[0][i*ny+j])+abs(eta[1][i*ny+j])+abs(eta[2][i*ny+j])));
-		}
-	}
-	fprintf(fp,"SCALARS phi float \n");
-	fprintf(fp,"LOOKUP_TABLE default \n");
-	for(int j=0;j<ny;j++){
-		for(int i=0;i<nx;i++){
-			fprintf(fp,"%10.6f\n",  (abs(eta[0][i*ny+j] *exp_part[0][i*ny+j]+conj(eta[0][i*ny+j]*exp_part[0][i*ny+j]))
-									+abs(eta[1][i*ny+j] *exp_part[1][i*ny+j]+conj(eta[1][i*ny+j]*exp_part[1][i*ny+j]))
-									+abs(eta[2][i*ny+j] *exp_part[2][i*ny+j]+conj(eta[2][i*ny+j]*exp_part[2][i*ny+j]))));
-		}
-	}
+    density.write_vtk(filepath, vtk_upsampling);
 }
 
 /*! Reads eta from a binary file written by write_eta_to_file
  *
+ *  Snapshot files (see write_eta_to_snapshot) are recognized and read as well
  */
 void PhaseField::read_eta_from_file(string filepath) {
+    PROFILE_SCOPE("io_read");
+
+    if (is_snapshot_file(filepath)) {
+        read_eta_from_snapshot(filepath);
+        return;
+    }
 
     MPI_File mpi_file;
-    int rcode = MPI_File_open(MPI_COMM_WORLD, filepath.c_str(), MPI_MODE_RDWR,
+    int rcode = MPI_File_open(comm, filepath.c_str(), MPI_MODE_RDWR,
             MPI_INFO_NULL, &mpi_file);
 
     if (rcode != MPI_SUCCESS)
@@ -641,6 +1087,268 @@ void PhaseField::read_eta_from_file(string filepath) {
             cerr << "Error: couldn't read file" << endl;
     }
     MPI_File_close(&mpi_file);
+    field_changed(eta);
+}
+
+/*! Method, that writes current eta to a compressed snapshot file
+ *
+ *  The file contains a header with the grid and model parameters,
+ *  the encoding is set by the options of snapshot_writer (see snapshot.h)
+ *  @return size of the file in bytes
+ */
+uint64_t PhaseField::write_eta_to_snapshot(string filepath, int timestep) {
+    PROFILE_SCOPE("io_write");
+    SnapshotHeader header;
+    header.nx = nx; header.ny = ny; header.nc = nc;
+    header.dx = dx; header.dy = dy; header.dt = dt;
+    header.timestep = timestep;
+    header.time = timestep*dt;
+    header.bx = bx; header.bl = bl; header.tt = tt; header.vv = vv;
+    for (int c = 0; c < nc; c++) {
+        header.q_vec.push_back(q_vec[c][0]);
+        header.q_vec.push_back(q_vec[c][1]);
+    }
+    uint64_t bytes = snapshot_writer.write(filepath, header, eta, local_nx, local_nx_start);
+    if (mpi_rank == 0) PROFILE_COUNT("io_bytes_written", bytes);
+    return bytes;
+}
+
+/*! Reads eta from a snapshot file written by write_eta_to_snapshot
+ *
+ *  The file may be written with a different number of processes,
+ *  but the grid has to match.
+ */
+bool PhaseField::read_eta_from_snapshot(string filepath) {
+    PROFILE_SCOPE("io_read");
+    SnapshotHeader header;
+    if (!read_snapshot_header(filepath, comm, header))
+        return false;
+    if (header.nc != nc) {
+        if (mpi_rank == 0)
+            cerr << "Error: " << filepath << " has " << header.nc
+                 << " amplitudes, the lattice " << nc << endl;
+        return false;
+    }
+    if (header.nx != nx || header.ny != ny || header.dx != dx || header.dy != dy) {
+        if (!resample_snapshot(filepath, header)) return false;
+        timestep = header.timestep;
+        return true;
+    }
+    if (!read_snapshot(filepath, comm, eta, local_nx, local_nx_start, header)) {
+        if (mpi_rank == 0)
+            cerr << "Error: couldn't read snapshot " << filepath << endl;
+        return false;
+    }
+    field_changed(eta);
+    timestep = header.timestep;
+    return true;
+}
+
+
+/*! Index of wave number index "k" of a src_n point spectrum in the spectrum of
+ *  n points of an s times longer period, -1 outside of the band of n points
+ */
+static ptrdiff_t resampled_index(ptrdiff_t k, ptrdiff_t src_n, ptrdiff_t n, int s) {
+    ptrdiff_t f = s*(k <= (src_n-1)/2 ? k : k - src_n);
+    if (f < -(n/2) || f > (n-1)/2) return -1;
+    return f >= 0 ? f : f + n;
+}
+
+/*! Method, that sets eta from the spectra of the amplitudes on another grid
+ *
+ *  src_k are the unnormalized transforms of a src_nx x src_ny grid, in the
+ *  FFTW slabs of that grid. The domain has to be s_x = nx dx/(src_nx src_dx)
+ *  (and s_y) times the source domain, s_x a positive integer: the mode f of
+ *  the source is the mode s_x f here. s = 1 interpolates spectrally to a finer
+ *  grid (zero padding) or truncates to a coarser one, s > 1 tiles the source
+ *  periodically (exactly, at any resolution). As in
+ *  DensityReconstruction::upsample, the kept rows are sent to the processes of
+ *  their new wave numbers, the order of the rows doesn't change.
+ */
+void PhaseField::resample_spectra(complex<double> **src_k, int src_nx, int src_ny,
+        double src_dx, double src_dy) {
+    PROFILE_SCOPE("resample");
+    double ratio_x = nx*dx/(src_nx*src_dx), ratio_y = ny*dy/(src_ny*src_dy);
+    int sx = (int) std::floor(ratio_x + 0.5), sy = (int) std::floor(ratio_y + 0.5);
+
+    ptrdiff_t src_local_n, src_local_start;
+    fftw_mpi_local_size_2d(src_nx, src_ny, comm, &src_local_n, &src_local_start);
+
+    long slab[4] = {(long) src_local_start, (long) src_local_n,
+                    (long) local_nx_start, (long) local_nx};
+    vector<long> slabs(4*mpi_size);
+    MPI_Allgather(slab, 4, MPI_LONG, &slabs[0], 4, MPI_LONG, comm);
+
+    int row_len = 2*nc*src_ny;
+    vector<int> send_counts(mpi_size, 0), send_displs(mpi_size, 0);
+    vector<int> recv_counts(mpi_size, 0), recv_displs(mpi_size, 0);
+
+    vector<double> send;
+    int p = 0;
+    for (ptrdiff_t i = 0; i < src_local_n; i++) {
+        ptrdiff_t f = resampled_index(src_local_start + i, src_nx, nx, sx);
+        if (f < 0) continue;
+        while (f >= slabs[4*p+2] + slabs[4*p+3]) p++;
+        send_counts[p] += row_len;
+        for (int c = 0; c < nc; c++) {
+            for (int j = 0; j < src_ny; j++) {
+                send.push_back(real(src_k[c][i*src_ny + j]));
+                send.push_back(imag(src_k[c][i*src_ny + j]));
+            }
+        }
+    }
+
+    // rows of the received source rows, in the order of receiving
+    vector<ptrdiff_t> rows;
+    p = 0;
+    for (ptrdiff_t k = 0; k < src_nx; k++) {
+        ptrdiff_t f = resampled_index(k, src_nx, nx, sx);
+        if (f < local_nx_start || f >= local_nx_start + local_nx) continue;
+        while (k >= slabs[4*p] + slabs[4*p+1]) p++;
+        recv_counts[p] += row_len;
+        rows.push_back(f - local_nx_start);
+    }
+
+    for (int r = 1; r < mpi_size; r++) {
+        send_displs[r] = send_displs[r-1] + send_counts[r-1];
+        recv_displs[r] = recv_displs[r-1] + recv_counts[r-1];
+    }
+    send.push_back(0.0);
+    vector<double> recv(rows.size()*row_len + 1);
+    MPI_Alltoallv(&send[0], &send_counts[0], &send_displs[0], MPI_DOUBLE,
+            &recv[0], &recv_counts[0], &recv_displs[0], MPI_DOUBLE, comm);
+
+    // the transform of nx*ny points of the same function is nx*ny/(src_nx*src_ny) times larger
+    double scale = ((double) nx*ny)/((double) src_nx*src_ny);
+    vector<ptrdiff_t> columns(src_ny);
+    for (int j = 0; j < src_ny; j++) columns[j] = resampled_index(j, src_ny, ny, sy);
+    for (int c = 0; c < nc; c++) {
+        std::fill(eta_k[c], eta_k[c] + local_nx*ny, complex<double>(0.0, 0.0));
+        for (size_t m = 0; m < rows.size(); m++) {
+            const double *row = &recv[m*row_len + 2*c*src_ny];
+            for (int j = 0; j < src_ny; j++) {
+                if (columns[j] < 0) continue;
+                eta_k[c][rows[m]*ny + columns[j]] = scale*complex<double>(row[2*j], row[2*j+1]);
+            }
+        }
+    }
+
+    take_fft(eta_plan_b);
+    normalize_field(eta);
+
+    if (mpi_rank == 0)
+        printf("%sResampled %dx%d (dx %g, dy %g) to %dx%d, tiled %dx%d\n", log_prefix.c_str(),
+                src_nx, src_ny, src_dx, src_dy, nx, ny, sx, sy);
+}
+
+/*! Method, that reads a snapshot of another grid and resamples it (see
+ *  resample_spectra), returns false if the domains don't fit
+ */
+bool PhaseField::resample_snapshot(string filepath, const SnapshotHeader &header) {
+    double ratio_x = nx*dx/(header.nx*header.dx), ratio_y = ny*dy/(header.ny*header.dy);
+    int sx = (int) std::floor(ratio_x + 0.5), sy = (int) std::floor(ratio_y + 0.5);
+    if (sx < 1 || sy < 1 || abs(ratio_x - sx) > 1.0e-6*ratio_x
+            || abs(ratio_y - sy) > 1.0e-6*ratio_y) {
+        if (mpi_rank == 0)
+            cerr << "Error: the domain of " << filepath << " (" << header.nx*header.dx
+                 << " x " << header.ny*header.dy << ") doesn't tile " << nx*dx
+                 << " x " << ny*dy << endl;
+        return false;
+    }
+
+    ptrdiff_t src_local_n, src_local_start;
+    ptrdiff_t src_alloc = fftw_mpi_local_size_2d(header.nx, header.ny, comm,
+            &src_local_n, &src_local_start);
+    vector<complex<double>*> src(nc);
+    for (int c = 0; c < nc; c++)
+        src[c] = reinterpret_cast<complex<double>*>(fftw_alloc_complex(src_alloc));
+
+    SnapshotHeader h = header;
+    bool ok = read_snapshot(filepath, comm, src.data(), src_local_n, src_local_start, h);
+    if (!ok) {
+        if (mpi_rank == 0)
+            cerr << "Error: couldn't read snapshot " << filepath << endl;
+    } else {
+        for (int c = 0; c < nc; c++) {
+            fftw_plan plan = fftw_mpi_plan_dft_2d(header.nx, header.ny,
+                    reinterpret_cast<fftw_complex*>(src[c]),
+                    reinterpret_cast<fftw_complex*>(src[c]),
+                    comm, FFTW_FORWARD, FFTW_ESTIMATE);
+            {
+                PROFILE_SCOPE("fft");
+                PROFILE_COUNT("fft_transforms", 1);
+                fftw_execute(plan);
+            }
+            fftw_destroy_plan(plan);
+        }
+        resample_spectra(src.data(), header.nx, header.ny, header.dx, header.dy);
+    }
+
+    for (int c = 0; c < nc; c++) fftw_free(src[c]);
+    return ok;
+}
+
+/*! Method, that relaxes the initial state on coarser grids first
+ *
+ *  The initial state of the parameters is set on the grid 2^coarse_levels
+ *  times coarser (dx, dy as many times larger), and coarse_steps OD steps are
+ *  taken on it. The result is interpolated to the grid 2 times finer, and so
+ *  on up to this grid. The coarse fields exist one level at a time.
+ */
+void PhaseField::warm_start() {
+    PROFILE_SCOPE("warm_start");
+    int levels = parameters.coarse_levels;
+    while (levels > 0 && (nx % (1 << levels) != 0 || ny % (1 << levels) != 0))
+        levels--;
+    if (levels < parameters.coarse_levels && mpi_rank == 0)
+        cerr << "Warning: " << nx << "x" << ny << " can't be coarsened "
+             << parameters.coarse_levels << " times, using " << levels << endl;
+    if (levels == 0) {
+        initialize_eta_state();
+        return;
+    }
+
+    PhaseField *prev = NULL;
+    for (int l = levels; l >= 0; l--) {
+        PhaseField *level = this;
+        if (l > 0) {
+            PhaseFieldParameters p = parameters;
+            p.nx = nx >> l;
+            p.ny = ny >> l;
+            p.dx = dx*(1 << l);
+            p.dy = dy*(1 << l);
+            p.coarse_levels = 0;
+            level = new PhaseField(comm, output_path, p);
+            level->set_log_prefix(log_prefix);
+        }
+        if (prev == NULL) {
+            level->initialize_eta_state();
+            level->take_fft(level->eta_plan_f);
+        } else {
+            // the finite-difference backend doesn't keep eta_k
+            complex<double> **prev_k = prev->eta_k;
+            if (prev->fd.active()) {
+                for (int c = 0; c < nc; c++)
+                    for (int n = 0; n < prev->local_nx*prev->ny; n++)
+                        prev->buffer[c][n] = prev->eta[c][n];
+                prev->take_fft(prev->buffer_plan_f);
+                prev_k = prev->buffer_k;
+            } else {
+                prev->update_k(prev->eta);
+            }
+            level->resample_spectra(prev_k, prev->nx, prev->ny, prev->dx, prev->dy);
+            delete prev;
+            prev = NULL;
+        }
+        if (l == 0) break;
+
+        level->step(parameters.coarse_steps);
+        double energy = level->energy();
+        if (mpi_rank == 0)
+            printf("%sWarm start: %d steps on %dx%d, energy %.16e\n", log_prefix.c_str(),
+                    parameters.coarse_steps, level->nx, level->ny, energy);
+        prev = level;
+    }
 }
 
 
@@ -672,17 +1380,18 @@ double PhaseField::calculate_radius() {
         }
     }
     double radius = abs(argmin2 - argmin1)*dy; 
-    MPI_Allreduce(&radius, &radius, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&radius, &radius, 1, MPI_DOUBLE, MPI_SUM, comm);
 
     return radius;
 }
 
-/*! Method, does the initial setup to run the circle calculations from scratch
+/*! Method, does the initial setup to run the calculations from scratch
  *
+ *  The results are written to output_path + subdir
  */
-void PhaseField::start_calculations() {
+void PhaseField::start_calculations(string subdir) {
 
-    string path = output_path + "seed_run/";
+    string path = output_path + subdir;
     string run_info_filename = "run_info.txt";
 
     // check if program can find the path
@@ -690,21 +1399,23 @@ void PhaseField::start_calculations() {
 		FILE * run_info_file = fopen((path+run_info_filename).c_str(), "w");
 		if (run_info_file == NULL) {
 			std::cout << "Can't access " << (path+run_info_filename) << std::endl;
-			MPI_Abort(MPI_COMM_WORLD, 1);
+			MPI_Abort(comm, 1);
 		}
 		fclose(run_info_file);
     }
 
     // initialize eta and eta_k
-    initialize_eta_multiple_seeds();
+    initialize_eta();
     take_fft(eta_plan_f);
 
+    report_memory();
+
     // write initial conf to file
 	write_eta_to_file(path+"initial_conf.bin");
 
     double energy = calculate_energy(eta, eta_k);
     if (mpi_rank == 0)
-        printf("Initial state - energy: %.16e\n", energy);
+        printf("%sInitial state - energy: %.16e\n", log_prefix.c_str(), energy);
 
     run_calculations(0, 0.0, path, run_info_filename);
 }
@@ -717,24 +1428,27 @@ void PhaseField::run_calculations(int init_it, double time_so_far,
     Time::time_point time_var = Time::now();
 
     // Start repetitions of overdamped steps and mechanical equilibrium
-    int repetitions = 50000;
-    int od_steps = 80;
-
     int save_freq = 5;
     FILE * run_info_file;
 
     int ts = init_it; // total over-damped timesteps counter
+    timestep = init_it;
+
+    meq_scheduler.set_log_file(path+"meq_schedule.txt");
+    output_policy.set_log_file(path+"output_schedule.txt");
+    output_policy.start(ts);
+    meq_scheduler.reset_peak_norm();
 
-    for (int rep = 1; rep < repetitions; rep++) {
+    for (int rep = 1; rep <= repetitions; rep++) {
         time_var = Time::now();
-        // Over-damped timesteps
-        for (int ts_ = 0; ts_ < od_steps; ts_++) {
+        // Over-damped timesteps until the scheduler asks for equilibration
+        do {
             overdamped_time_step();
-        }
-        ts += od_steps;
+            ts++;
+        } while (!meq_scheduler.step(ts));
         double od_dur = std::chrono::duration<double>(Time::now()-time_var).count();
         // Mechanical equilibration
-        int meq_iter = mech_eq.lbfgs_enhanced();
+        int meq_iter = mech_eq.equilibrate();
         //int meq_iter = 0;
         double meq_dur = std::chrono::duration<double>(Time::now()-time_var).count()
                            - od_dur;
@@ -743,10 +1457,10 @@ void PhaseField::run_calculations(int init_it, double time_so_far,
                             + time_so_far;
         if (mpi_rank == 0) {
             // Print run information
-            printf("ts: %5d; stime: %7.1f; energy: %.16e; od_time: %4.1f; "
-                   "meq_iter: %d; meq_time: %5.1f; total_time: %7.1f\n",
-				   ts, ts*dt, energy, od_dur,
-                   meq_iter, meq_dur, total_dur);
+            printf("%sts: %5d; stime: %7.1f; energy: %.16e; od_time: %4.1f; "
+                   "meq_iter: %d; meq_time: %5.1f; total_time: %7.1f; meq: %s\n",
+				   log_prefix.c_str(), ts, ts*dt, energy, od_dur,
+                   meq_iter, meq_dur, total_dur, meq_scheduler.reason);
             // Save run information also to a file
             run_info_file = fopen((path+run_info_filename).c_str(), "a");
             fprintf(run_info_file, "%d %.1f %.16e %.1f %d %.1f %.1f\n",
@@ -754,24 +1468,83 @@ void PhaseField::run_calculations(int init_it, double time_so_far,
                     meq_iter, meq_dur, total_dur);
             fclose(run_info_file);
         }
-	if ((rep-1)*od_steps*dt > 700 && save_freq < 20) {
+	if (ts*dt > 700 && save_freq < 20) {
 	    save_freq = 100;
 	}
-        if (rep % save_freq == 0) {
+        int num_grains = -1;
+        if (rep % grain_stats_freq == 0) {
+            num_grains = grain_analysis.write_statistics(path+"grain_stats.txt",
+                    path+"grain_sizes.txt", ts).num_grains;
+        }
+        if (defect_freq > 0 && rep % defect_freq == 0)
+            defect_detection.write_dislocations(path+"dislocations.txt", ts);
+        if (spectra_freq > 0 && rep % spectra_freq == 0)
+            spectral_analysis.write_spectra(path+"spectra.txt", path+"spectral_stats.txt", ts);
+        bool save = output_policy.is_adaptive()
+                ? output_policy.check(ts, energy, meq_scheduler.peak_norm, num_grains,
+                        repetitions - rep)
+                : rep % save_freq == 0;
+        if (save) {
+            meq_scheduler.reset_peak_norm();
             std::stringstream sstream;
             sstream << std::fixed << std::setprecision(0) << ts*dt;
-            write_eta_to_file(path+"eta_"+sstream.str()+".bin");
+            output_policy.written(write_eta_to_snapshot(path+"eta_"+sstream.str()+".pfc", ts));
+            if (write_vtk)
+                write_eta_to_vtk_file(path+"eta_"+sstream.str()+".vtk");
         }
     }
 }
 
 
+/*! Method, that sets eta to the initial state of the parameters */
+void PhaseField::initialize() {
+    initialize_eta();
+    take_fft(eta_plan_f);
+    timestep = 0;
+}
+
+/*! Method, that takes "steps" overdamped time steps */
+void PhaseField::step(int steps) {
+    for (int s = 0; s < steps; s++)
+        overdamped_time_step();
+}
+
+/*! Method, that equilibrates eta mechanically, returns the iterations */
+int PhaseField::equilibrate() {
+    int iterations = mech_eq.equilibrate();
+    // not every solver leaves eta_k up to date
+    update_k(eta);
+    return iterations;
+}
+
+double PhaseField::energy() {
+    return calculate_energy(eta, eta_k);
+}
+
+/*! Method, that updates eta_k after eta was changed from outside */
+void PhaseField::fields_changed() {
+    take_fft(eta_plan_f);
+}
+
+void PhaseField::invalidate_cache() {
+    energy_versions[0] = energy_versions[1] = grad_version = 0;
+}
+
+/*! Method, that copies the local rows (local_nx x ny) of component c
+ *  to eta, followed by fields_changed() when all components are set
+ */
+void PhaseField::set_eta(int c, const complex<double> *local_field) {
+    std::memcpy(eta[c], local_field, sizeof(complex<double>)*local_nx*ny);
+    field_changed(eta);
+}
+
+
 void PhaseField::continue_calculations() {
 
     string path = output_path + "testrun/";
     string run_info_filename = "run_info.txt";
 
-    string continue_from_file = "eta_10.bin";
+    string continue_from_file = "eta_10.pfc";
     double continue_stime = 10.0;
     
     // Load eta
@@ -833,22 +1606,24 @@ void PhaseField::test() {
 
     //write_eta_to_file(output_path + "eta100.bin");
 
-	double theta_phi;
-	for(int i=0;i<nx;i++){
-		for(int j=0;j<ny;j++){
-			for(int c=0;c<nc;c++){
-				theta_phi = ( q_vec[c][0] * (double)(i+1 - nx/2.0) * dx/2.0
-							+ q_vec[c][1] * (double)(j+1 - ny/2.0) * dy/2.0 );
-				exp_part[c][i*ny+j] = exp(complex<double>(0.0, 1.0)*theta_phi);
-			}
-		}
-	}
-	
+    output_policy.set_log_file(output_path+"output_schedule.txt");
+    output_policy.start(0);
+    int check_interval = output_policy.get_check_interval();
+
     for (int it = 0; it < max_iterations; it++) {
         overdamped_time_step();
-    	if((it % out_time) == 0) {
+        bool save = (it % out_time) == 0;
+        if (output_policy.is_adaptive()) {
+            save = (it + 1) % check_interval == 0 && output_policy.check(it,
+                    calculate_energy(eta, eta_k), -1.0, -1,
+                    (max_iterations - it - 1)/check_interval);
+        }
+    	if (save) {
     		write_eta_to_file(output_path+"eta_"+to_string(it)+".bin");
+    		output_policy.written(2*sizeof(double)*nc*nx*ny);
     		write_eta_to_vtk_file(output_path+"eta_"+to_string(it)+".vtk");
+    		grain_analysis.write_statistics(output_path+"grain_stats.txt",
+    				output_path+"grain_sizes.txt", it);
     	}
     }
 
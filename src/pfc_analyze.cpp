@@ -0,0 +1,407 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+#include <mpi.h>
+
+#include "pfc.h"
+#include "profiler.h"
+
+#include <sys/stat.h> // mkdir, stat
+#include <dirent.h>   // opendir
+
+using namespace std;
+
+/*
+ *  Post-processing of snapshot files
+ *
+ *  Usage:
+ *    pfc-analyze <file or directory> ... [out=<dir>] [key=value ...]
+ *
+ *  Every snapshot (.pfc, and raw .bin files with the grid of the
+ *  parameters) is read in row slabs, so the processes share the memory and
+ *  the work. The grid and model parameters come from the snapshot header,
+ *  key=value overrides the rest (e.g. vtk_upsampling for phi, amplitude for
+ *  the solid threshold). For a snapshot "name" the output directory
+ *  (default ./output/analysis/) gets
+ *
+ *    name_eta.ppm           sum_j |eta_j|
+ *    name_phi.ppm           reconstructed density (vtk_upsampling times finer)
+ *    name_energy.ppm        free energy density
+ *    name_orientation.ppm   lattice rotation as hue, liquid black
+ *    name_radial.txt        averages over rings around the grid centre
+ *
+ *  and one line per snapshot in analysis.txt, in the order of the time steps.
+ */
+
+const std::string default_output_path = "./output/analysis/";
+
+/*! Colour maps of the images */
+enum Colormap {
+    SEQUENTIAL_MAP, //!< dark blue - green - yellow
+    CYCLIC_MAP      //!< hue, for angles
+};
+
+static void color(Colormap map, double t, unsigned char *rgb) {
+    t = std::min(std::max(t, 0.0), 1.0);
+    if (map == CYCLIC_MAP) {
+        double h = 6.0*t;
+        double c[3] = {std::abs(h - 3.0) - 1.0, 2.0 - std::abs(h - 2.0), 2.0 - std::abs(h - 4.0)};
+        for (int k = 0; k < 3; k++)
+            rgb[k] = (unsigned char) (255.0*std::min(std::max(c[k], 0.0), 1.0) + 0.5);
+        return;
+    }
+    // viridis at 0, 1/4, ..., 1
+    static const double stops[5][3] = {
+        {68, 1, 84}, {59, 82, 139}, {33, 145, 140}, {94, 201, 98}, {253, 231, 37}
+    };
+    int s = std::min((int) (4.0*t), 3);
+    double f = 4.0*t - s;
+    for (int k = 0; k < 3; k++)
+        rgb[k] = (unsigned char) ((1.0 - f)*stops[s][k] + f*stops[s+1][k] + 0.5);
+}
+
+/*! Analysis of the fields of one PhaseField (see the usage above) */
+class Analyzer {
+    PhaseField &pfc;
+    std::string out_dir;
+
+    void write_image(string filepath, const vector<double> &values, long rows,
+            long row_start, long total_rows, long cols, Colormap map,
+            double lo, double hi, const vector<char> *mask);
+
+    void min_max(const vector<double> &values, double &lo, double &hi);
+
+    void write_radial(string filepath, const vector<double> &amplitude,
+            const vector<double> &density, const vector<double> &orientation,
+            const vector<char> &solid);
+
+public:
+    Analyzer(PhaseField &pfc, string out_dir) : pfc(pfc), out_dir(out_dir) {}
+
+    /*! Analyzes the current eta, appends a line to analysis.txt (collective) */
+    void analyze(string name, int timestep, double time);
+};
+
+/*! Writes a binary PPM image, every process writes its rows (collective)
+ *
+ *  The image row i is the grid row x = i, values outside [lo, hi] are
+ *  clipped and cells with mask 0 are black.
+ */
+void Analyzer::write_image(string filepath, const vector<double> &values, long rows,
+        long row_start, long total_rows, long cols, Colormap map, double lo, double hi,
+        const vector<char> *mask) {
+    PROFILE_SCOPE("io_write");
+
+    char header[64];
+    snprintf(header, sizeof(header), "P6\n%ld %ld\n255\n", cols, total_rows);
+    MPI_Offset offset = strlen(header) + (MPI_Offset) row_start*cols*3;
+
+    vector<unsigned char> pixels(rows*cols*3 + 1);
+    double scale = hi > lo ? 1.0/(hi - lo) : 0.0;
+    for (long k = 0; k < rows*cols; k++) {
+        if (mask && !(*mask)[k]) {
+            pixels[3*k] = pixels[3*k+1] = pixels[3*k+2] = 0;
+        } else {
+            color(map, (values[k] - lo)*scale, &pixels[3*k]);
+        }
+    }
+
+    if (pfc.mpi_rank == 0) MPI_File_delete(filepath.c_str(), MPI_INFO_NULL);
+
+    MPI_File mpi_file;
+    int rcode = MPI_File_open(pfc.comm, filepath.c_str(),
+            MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &mpi_file);
+    if (rcode != MPI_SUCCESS) {
+        if (pfc.mpi_rank == 0) cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+    if (pfc.mpi_rank == 0)
+        MPI_File_write_at(mpi_file, 0, header, strlen(header), MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_write_at_all(mpi_file, offset, &pixels[0], rows*cols*3, MPI_UNSIGNED_CHAR,
+            MPI_STATUS_IGNORE);
+    MPI_File_close(&mpi_file);
+    PROFILE_COUNT("io_bytes_written", rows*cols*3.0);
+}
+
+void Analyzer::min_max(const vector<double> &values, double &lo, double &hi) {
+    double range[2] = {1e300, 1e300};   // min and -max
+    for (size_t k = 0; k < values.size(); k++) {
+        range[0] = std::min(range[0], values[k]);
+        range[1] = std::min(range[1], -values[k]);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, range, 2, MPI_DOUBLE, MPI_MIN, pfc.comm);
+    lo = range[0]; hi = -range[1];
+}
+
+/*! Writes the averages over rings of width dx around the grid centre
+ *  (the centre of the initial circle and seed), radius in the units of x
+ */
+void Analyzer::write_radial(string filepath, const vector<double> &amplitude,
+        const vector<double> &density, const vector<double> &orientation,
+        const vector<char> &solid) {
+    int nx = pfc.nx, ny = pfc.ny;
+    double dx = pfc.dx, dy = pfc.dy;
+    double r_max = sqrt(nx*dx*nx*dx + ny*dy*ny*dy)/2.0;
+    int nbins = (int) (r_max/dx) + 2;
+
+    // cells, sum |eta|, solid cells, orientation of the solid, energy density
+    vector<double> sums(5*nbins, 0.0);
+    for (int i = 0; i < pfc.local_nx; i++) {
+        double x = (i + pfc.local_nx_start + 1 - nx/2.0)*dx;
+        for (int j = 0; j < ny; j++) {
+            double y = (j + 1 - ny/2.0)*dy;
+            int bin = std::min((int) (sqrt(x*x + y*y)/dx), nbins-1);
+            long k = (long) i*ny + j;
+            sums[5*bin] += 1.0;
+            sums[5*bin+1] += amplitude[k];
+            sums[5*bin+4] += density[k];
+            if (solid[k]) {
+                sums[5*bin+2] += 1.0;
+                sums[5*bin+3] += orientation[k];
+            }
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &sums[0], 5*nbins, MPI_DOUBLE, MPI_SUM, pfc.comm);
+
+    if (pfc.mpi_rank != 0) return;
+    FILE *fp = fopen(filepath.c_str(), "w");
+    if (fp == NULL) {
+        cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+    fprintf(fp, "# r cells mean_eta solid_fraction mean_orientation_deg mean_energy_density\n");
+    for (int b = 0; b < nbins; b++) {
+        double n = sums[5*b];
+        if (n == 0.0) continue;
+        double n_solid = sums[5*b+2];
+        fprintf(fp, "%.4f %d %.6e %.6f %.6f %.6e\n", (b + 0.5)*dx, (int) n,
+                sums[5*b+1]/n, n_solid/n,
+                n_solid > 0.0 ? sums[5*b+3]/n_solid*180.0/PI : 0.0, sums[5*b+4]/n);
+    }
+    fclose(fp);
+}
+
+void Analyzer::analyze(string name, int timestep, double time) {
+    int ny = pfc.ny, nc = pfc.nc;
+    long n = (long) pfc.local_nx*ny;
+    string prefix = out_dir + name;
+
+    // energy, buffer is G_j eta_j afterwards (not with a memoized energy)
+    double energy = pfc.evaluate_energy(pfc.eta, pfc.eta_k);
+
+    const KernelTable &kern = kernels(pfc.lattice.type);
+    vector<double> amplitude(n, 0.0), density(n);
+    vector<complex<double>*> e(nc), g(nc);
+    for (long k = 0; k < n; k++) {
+        for (int c = 0; c < nc; c++) {
+            amplitude[k] += abs(pfc.eta[c][k]);
+            e[c] = pfc.eta[c] + k;
+            g[c] = pfc.buffer[c] + k;
+        }
+        density[k] = kern.energy_density(e.data(), g.data(), pfc.bx, pfc.bl,
+                pfc.tt, pfc.vv, 1);
+    }
+
+    vector<double> orientation;
+    vector<char> solid;
+    pfc.grain_analysis.orientation_map(orientation, solid);
+    GrainStatistics stats = pfc.grain_analysis.calculate_statistics();
+
+    double lo, hi;
+    min_max(amplitude, lo, hi);
+    write_image(prefix + "_eta.ppm", amplitude, pfc.local_nx, pfc.local_nx_start, pfc.nx,
+            ny, SEQUENTIAL_MAP, lo, hi, NULL);
+    min_max(density, lo, hi);
+    write_image(prefix + "_energy.ppm", density, pfc.local_nx, pfc.local_nx_start, pfc.nx,
+            ny, SEQUENTIAL_MAP, lo, hi, NULL);
+    double period = PI/nc;  // symmetry of the lattice rotations, see GrainAnalysis
+    write_image(prefix + "_orientation.ppm", orientation, pfc.local_nx, pfc.local_nx_start,
+            pfc.nx, ny, CYCLIC_MAP, -period/2, period/2, &solid);
+
+    write_radial(prefix + "_radial.txt", amplitude, density, orientation, solid);
+
+    // phi last, the reconstruction overwrites buffer
+    int factor = std::max(pfc.vtk_upsampling, 1);
+    ptrdiff_t local_n, local_start;
+    vector<double> phi, fine_amplitude;
+    pfc.density.reconstruct(factor, local_n, local_start, phi, fine_amplitude);
+    min_max(phi, lo, hi);
+    write_image(prefix + "_phi.ppm", phi, local_n, local_start, (long) factor*pfc.nx,
+            (long) factor*ny, SEQUENTIAL_MAP, lo, hi, NULL);
+
+    if (pfc.mpi_rank == 0) {
+        FILE *fp = fopen((out_dir + "analysis.txt").c_str(), "a");
+        if (fp == NULL) {
+            cerr << "Error: couldn't open " << out_dir << "analysis.txt" << endl;
+        } else {
+            fprintf(fp, "%s %d %.4f %.16e %d %.6e %.6f %.6e %.6f\n", name.c_str(), timestep,
+                    time, energy, stats.num_grains, stats.mean_area, stats.solid_fraction,
+                    stats.boundary_length, stats.mean_orientation*180.0/PI);
+            fclose(fp);
+        }
+        printf("%s: t = %.2f, energy %.10e, %d grains\n", name.c_str(), time, energy,
+                stats.num_grains);
+        fflush(stdout);
+    }
+}
+
+// ---------------------------------------------------------------
+
+/*! A snapshot to analyze, the raw .bin files have no time step (-1) */
+struct InputFile {
+    std::string path, name;
+    int timestep;
+    double time;
+    SnapshotHeader header;
+    bool snapshot;
+
+    bool operator<(const InputFile &other) const {
+        if (timestep != other.timestep) return timestep < other.timestep;
+        return path < other.path;
+    }
+};
+
+static bool has_suffix(const string &s, const string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/*! Adds "path" or the .pfc and .bin files of directory "path" (collective) */
+static void add_inputs(string path, MPI_Comm comm, vector<InputFile> &inputs) {
+    vector<string> paths;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path.c_str());
+        if (dir == NULL) return;
+        if (!has_suffix(path, "/")) path += "/";
+        while (struct dirent *entry = readdir(dir)) {
+            string name = entry->d_name;
+            if (has_suffix(name, ".pfc") || has_suffix(name, ".bin"))
+                paths.push_back(path + name);
+        }
+        closedir(dir);
+        std::sort(paths.begin(), paths.end());
+    } else {
+        paths.push_back(path);
+    }
+
+    for (size_t p = 0; p < paths.size(); p++) {
+        InputFile input;
+        input.path = paths[p];
+        size_t slash = input.path.find_last_of('/');
+        input.name = input.path.substr(slash == string::npos ? 0 : slash + 1);
+        input.name = input.name.substr(0, input.name.find_last_of('.'));
+        input.snapshot = is_snapshot_file(input.path);
+        input.timestep = -1;
+        input.time = 0.0;
+        if (input.snapshot) {
+            if (!read_snapshot_header(input.path, comm, input.header)) continue;
+            input.timestep = input.header.timestep;
+            input.time = input.header.time;
+        }
+        inputs.push_back(input);
+    }
+}
+
+/*! Parameters of the snapshot header, the rest from "defaults" */
+static PhaseFieldParameters input_parameters(const InputFile &input,
+        const PhaseFieldParameters &defaults) {
+    PhaseFieldParameters params = defaults;
+    if (!input.snapshot) return params;
+    const SnapshotHeader &h = input.header;
+    params.nx = h.nx; params.ny = h.ny;
+    params.dx = h.dx; params.dy = h.dy; params.dt = h.dt;
+    params.bx = h.bx; params.bl = h.bl; params.tt = h.tt; params.vv = h.vv;
+    for (int t = 0; t < NUM_LATTICES; t++)
+        if (get_lattice((LatticeType) t).nc == h.nc) params.lattice = get_lattice((LatticeType) t).name;
+    return params;
+}
+
+static bool same_grid(const PhaseFieldParameters &a, const PhaseFieldParameters &b) {
+    return a.nx == b.nx && a.ny == b.ny && a.dx == b.dx && a.dy == b.dy && a.dt == b.dt
+        && a.bx == b.bx && a.bl == b.bl && a.tt == b.tt && a.vv == b.vv
+        && a.lattice == b.lattice;
+}
+
+int main(int argc, char **argv) {
+
+    MPI_Init(&argc, &argv);
+
+    int mpi_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &mpi_rank);
+
+    // the fields are only read: 3 complex fields instead of 9
+    PhaseFieldParameters params;
+    params.low_memory = true;
+
+    std::string out_dir = default_output_path;
+    vector<string> args;
+    bool valid = true;
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        size_t eq = arg.find('=');
+        if (eq == string::npos) {
+            args.push_back(arg);
+        } else if (arg.substr(0, eq) == "out") {
+            out_dir = arg.substr(eq+1);
+            if (!has_suffix(out_dir, "/")) out_dir += "/";
+        } else if (!params.set(arg.substr(0, eq), arg.substr(eq+1))) {
+            if (mpi_rank == 0) cerr << "Error: invalid parameter " << arg << endl;
+            valid = false;
+        }
+    }
+
+    if (!valid || args.empty()) {
+        if (mpi_rank == 0)
+            cerr << "Usage: pfc-analyze <file or directory> ... [out=<dir>] "
+                    "[key=value ...]" << endl;
+        MPI_Finalize();
+        return EXIT_FAILURE;
+    }
+
+    vector<InputFile> inputs;
+    for (size_t a = 0; a < args.size(); a++)
+        add_inputs(args[a], MPI_COMM_WORLD, inputs);
+    std::stable_sort(inputs.begin(), inputs.end());
+
+    if (mpi_rank == 0) {
+        mkdir(out_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+        FILE *fp = fopen((out_dir + "analysis.txt").c_str(), "w");
+        if (fp != NULL) {
+            fprintf(fp, "# file timestep time energy num_grains mean_area solid_fraction "
+                    "boundary_length mean_orientation_deg\n");
+            fclose(fp);
+        }
+        printf("Analyzing %d files to %s\n", (int) inputs.size(), out_dir.c_str());
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    // one PhaseField as long as the grid stays the same
+    unique_ptr<PhaseField> pfc;
+    PhaseFieldParameters current;
+    for (size_t f = 0; f < inputs.size(); f++) {
+        PhaseFieldParameters p = input_parameters(inputs[f], params);
+        if (!pfc || !same_grid(p, current)) {
+            pfc.reset();
+            pfc.reset(new PhaseField(MPI_COMM_WORLD, out_dir, p));
+            current = p;
+        }
+        if (inputs[f].snapshot) {
+            if (!pfc->read_eta_from_snapshot(inputs[f].path)) continue;
+        } else {
+            pfc->read_eta_from_file(inputs[f].path);
+        }
+        pfc->fields_changed();
+        Analyzer(*pfc, out_dir).analyze(inputs[f].name, inputs[f].timestep, inputs[f].time);
+    }
+
+    MPI_Finalize();
+    return EXIT_SUCCESS;
+}
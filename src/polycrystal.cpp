@@ -0,0 +1,268 @@
+
+#include <iostream>
+#include <cmath>
+#include <ctime>
+#include <random>
+#include <limits>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "polycrystal.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+// ---------------------------------------------------------------
+// PARAMETERS
+
+// seeds are evaluated up to the distance where amplitude/(rd^p+1)
+// drops below this fraction of the amplitude (3.2 radii for p = 16)
+const double Polycrystal::seed_tolerance = 1.0e-8;
+
+// ---------------------------------------------------------------
+
+/*! Uniform double in [0, 1) from the top 53 bits, the same on every platform
+ *  (unlike std::uniform_real_distribution)
+ */
+static double uniform(std::mt19937_64 &rng) {
+    return (rng() >> 11)*(1.0/9007199254740992.0);
+}
+
+/*! x^n for n >= 0 by repeated squaring */
+static double int_pow(double x, int n) {
+    double result = 1.0;
+    for (; n > 0; n >>= 1, x *= x)
+        if (n & 1) result *= x;
+    return result;
+}
+
+Polycrystal::Polycrystal(PhaseField *pfc, int num_grains, double max_radius,
+        double max_angle, uint64_t seed_, GrainDistribution distribution, int seed_exponent_)
+        : pfc(pfc), seed(seed_), seed_exponent(std::max(seed_exponent_, 1)),
+          nbx(0), nby(0), bin_x(0.0), bin_y(0.0) {
+    PROFILE_SCOPE("initialize");
+
+    if (seed == 0 && pfc->mpi_rank == 0) seed = (uint64_t) std::time(nullptr);
+    unsigned long long s = seed;
+    MPI_Bcast(&s, 1, MPI_UNSIGNED_LONG_LONG, 0, pfc->comm);
+    seed = s;
+
+    std::mt19937_64 rng(seed);
+    int nc = pfc->nc;
+    grains.resize(std::max(num_grains, 0));
+    for (size_t n = 0; n < grains.size(); n++) {
+        Grain &g = grains[n];
+        g.x = (pfc->nx-1)*uniform(rng)*pfc->dx;
+        g.y = (pfc->ny-1)*uniform(rng)*pfc->dy;
+        // both distributions take the same draws, so the centers are the same
+        double u_radius = uniform(rng), u_angle = uniform(rng);
+        if (distribution == REFERENCE_GRAINS) {
+            g.radius = max_radius*pfc->nx*pfc->dx;
+            g.angle = (n == 0) ? 0.0 : u_angle*max_angle;
+        } else {
+            g.radius = u_radius*max_radius*pfc->nx*pfc->dx;
+            g.angle = u_angle*2.0*max_angle - max_angle;
+        }
+
+        // rotation around the center, as in initialize_eta_circle:
+        // theta_j = q_j.(R(angle) - 1) r
+        double c = cos(g.angle) - 1.0, s = sin(g.angle);
+        g.k.resize(2*nc);
+        for (int j = 0; j < nc; j++) {
+            const double *q = pfc->q_vec[j];
+            g.k[2*j]   = q[0]*c + q[1]*s;
+            g.k[2*j+1] = q[1]*c - q[0]*s;
+        }
+    }
+}
+
+double Polycrystal::min_image(double d, double length) const {
+    return d - length*std::floor(d/length + 0.5);
+}
+
+double Polycrystal::periodic_dist_sq(double x, double y, const Grain &g) const {
+    double ddx = min_image(x - g.x, pfc->nx*pfc->dx);
+    double ddy = min_image(y - g.y, pfc->ny*pfc->dy);
+    return ddx*ddx + ddy*ddy;
+}
+
+/*! Method, that sets eta to the seeds in liquid
+ *
+ *  Seeds overlapping the local rows add amplitude/(rd^p+1)*exp(i theta)
+ *  to the cells where the profile is above seed_tolerance. Along a row theta is linear, so
+ *  the phase factor is rotated by one multiplication per cell. The seeds
+ *  are added in the same order on every process.
+ */
+void Polycrystal::seeds() {
+    PROFILE_SCOPE("initialize");
+    int nc = pfc->nc, nx = pfc->nx, ny = pfc->ny;
+    double dx = pfc->dx, dy = pfc->dy, amplitude = pfc->amplitude;
+    long local_nx = pfc->local_nx, local_nx_start = pfc->local_nx_start;
+
+    for (int c = 0; c < nc; c++)
+        std::fill(pfc->eta[c], pfc->eta[c] + local_nx*ny, complex<double>(0.0, 0.0));
+
+    // 1/(rd^p+1) < seed_tolerance beyond seed_cutoff radii
+    double seed_cutoff = std::pow(1.0/seed_tolerance, 1.0/seed_exponent);
+
+    vector< complex<double> > carrier(nc), rotation(nc);
+    for (size_t n = 0; n < grains.size(); n++) {
+        const Grain &g = grains[n];
+        if (g.radius <= 0.0) continue;
+
+        // cells around the center, at most one period (the nearest images)
+        double cutoff = seed_cutoff*g.radius;
+        long i_lo = (long) std::ceil((g.x - cutoff)/dx), i_hi = (long) std::floor((g.x + cutoff)/dx);
+        long j_lo = (long) std::ceil((g.y - cutoff)/dy), j_hi = (long) std::floor((g.y + cutoff)/dy);
+        if (i_hi - i_lo + 1 > nx) {
+            i_lo = (long) std::floor((g.x - 0.5*nx*dx)/dx) + 1;
+            i_hi = i_lo + nx - 1;
+        }
+        if (j_hi - j_lo + 1 > ny) {
+            j_lo = (long) std::floor((g.y - 0.5*ny*dy)/dy) + 1;
+            j_hi = j_lo + ny - 1;
+        }
+
+        double inv_r_sq = 1.0/(g.radius*g.radius);
+        double cutoff_sq = seed_cutoff*seed_cutoff;
+        for (int c = 0; c < nc; c++)
+            rotation[c] = std::polar(1.0, g.k[2*c+1]*dy);
+
+        for (long ia = i_lo; ia <= i_hi; ia++) {
+            long i = ((ia % nx) + nx) % nx - local_nx_start;
+            if (i < 0 || i >= local_nx) continue;
+
+            double x_dif = ia*dx - g.x;
+            double y_dif = j_lo*dy - g.y;
+            for (int c = 0; c < nc; c++)
+                carrier[c] = std::polar(amplitude, g.k[2*c]*x_dif + g.k[2*c+1]*y_dif);
+
+            for (long ja = j_lo; ja <= j_hi; ja++) {
+                y_dif = ja*dy - g.y;
+                double rd2 = (x_dif*x_dif + y_dif*y_dif)*inv_r_sq;
+                if (rd2 < cutoff_sq) {
+                    double rdp = int_pow(rd2, seed_exponent/2);
+                    if (seed_exponent % 2) rdp *= std::sqrt(rd2);
+                    double weight = 1.0/(rdp + 1.0);
+                    long j = ((ja % ny) + ny) % ny;
+                    for (int c = 0; c < nc; c++)
+                        pfc->eta[c][i*ny + j] += weight*carrier[c];
+                }
+                for (int c = 0; c < nc; c++)
+                    carrier[c] *= rotation[c];
+            }
+        }
+    }
+}
+
+/*! Method, that sorts the grain centers into about one bin per grain */
+void Polycrystal::make_bins() {
+    double lx = pfc->nx*pfc->dx, ly = pfc->ny*pfc->dy;
+    int n = grains.size();
+    nbx = std::max(1, (int) std::sqrt(n*lx/ly));
+    nby = std::max(1, n/nbx);
+    bin_x = lx/nbx;
+    bin_y = ly/nby;
+
+    vector<int> bin_of(n);
+    bin_start.assign(nbx*nby + 1, 0);
+    for (int g = 0; g < n; g++) {
+        int bi = std::min(nbx-1, (int) (grains[g].x/bin_x));
+        int bj = std::min(nby-1, (int) (grains[g].y/bin_y));
+        bin_of[g] = bi*nby + bj;
+        bin_start[bin_of[g]+1]++;
+    }
+    for (int b = 0; b < nbx*nby; b++)
+        bin_start[b+1] += bin_start[b];
+
+    vector<int> fill(bin_start.begin(), bin_start.end()-1);
+    bin_grains.resize(n);
+    for (int g = 0; g < n; g++)
+        bin_grains[fill[bin_of[g]]++] = g;
+}
+
+/*! Index of the grain center nearest to (x, y), ties go to the lower index
+ *
+ *  The bins are searched in rings around the bin of (x, y). Grains beyond
+ *  ring r are at least r bin widths away, which ends the search. When the
+ *  rings would wrap around the system, all grains are checked.
+ */
+int Polycrystal::nearest_grain(double x, double y) const {
+    int bi = std::min(nbx-1, (int) (x/bin_x));
+    int bj = std::min(nby-1, (int) (y/bin_y));
+    double bin_min = std::min(bin_x, bin_y);
+
+    int best = -1;
+    double best_d = std::numeric_limits<double>::max();
+    for (int r = 0; 2*r+1 <= nbx && 2*r+1 <= nby; r++) {
+        for (int di = -r; di <= r; di++) {
+            for (int dj = -r; dj <= r; dj++) {
+                if (std::max(std::abs(di), std::abs(dj)) != r) continue;
+                int b = ((bi+di+nbx) % nbx)*nby + (bj+dj+nby) % nby;
+                for (int k = bin_start[b]; k < bin_start[b+1]; k++) {
+                    int g = bin_grains[k];
+                    double d = periodic_dist_sq(x, y, grains[g]);
+                    if (d < best_d || (d == best_d && g < best)) {
+                        best_d = d;
+                        best = g;
+                    }
+                }
+            }
+        }
+        if (best >= 0 && best_d <= (r*bin_min)*(r*bin_min)) return best;
+    }
+
+    for (int g = 0; g < (int) grains.size(); g++) {
+        double d = periodic_dist_sq(x, y, grains[g]);
+        if (d < best_d || (d == best_d && g < best)) {
+            best_d = d;
+            best = g;
+        }
+    }
+    return best;
+}
+
+/*! Method, that sets eta to the Voronoi tessellation of the grain centers
+ *
+ *  Every cell gets the perfect lattice of the nearest grain, rotated around
+ *  the grain center (nearest periodic image). Along a row the phase factor
+ *  is only calculated when the grain changes.
+ */
+void Polycrystal::voronoi() {
+    PROFILE_SCOPE("initialize");
+    int nc = pfc->nc, nx = pfc->nx, ny = pfc->ny;
+    double dx = pfc->dx, dy = pfc->dy, amplitude = pfc->amplitude;
+
+    if (grains.empty()) {
+        for (int c = 0; c < nc; c++)
+            std::fill(pfc->eta[c], pfc->eta[c] + pfc->local_nx*ny,
+                    complex<double>(amplitude, 0.0));
+        return;
+    }
+    make_bins();
+
+    vector< complex<double> > carrier(nc), rotation(nc);
+    for (int i = 0; i < pfc->local_nx; i++) {
+        double x = (i + pfc->local_nx_start)*dx;
+        int last = -1;
+        for (int j = 0; j < ny; j++) {
+            double y = j*dy;
+            int g = nearest_grain(x, y);
+            if (g != last) {
+                const Grain &gr = grains[g];
+                double x_dif = min_image(x - gr.x, nx*dx);
+                double y_dif = min_image(y - gr.y, ny*dy);
+                for (int c = 0; c < nc; c++) {
+                    carrier[c] = std::polar(amplitude, gr.k[2*c]*x_dif + gr.k[2*c+1]*y_dif);
+                    rotation[c] = std::polar(1.0, gr.k[2*c+1]*dy);
+                }
+                last = g;
+            }
+            for (int c = 0; c < nc; c++) {
+                pfc->eta[c][i*ny + j] = carrier[c];
+                carrier[c] *= rotation[c];
+            }
+        }
+    }
+}
@@ -0,0 +1,188 @@
+
+#include <iostream>
+#include <cstdio>
+#include <chrono>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "profiler.h"
+
+vector<Profiler::Region> Profiler::regions;
+vector<Profiler::Counter> Profiler::counters;
+vector<Profiler::TraceEvent> Profiler::trace;
+bool Profiler::trace_enabled = false;
+double Profiler::time_origin = Profiler::now();
+
+// the timeline is truncated after this many events (~24 bytes each)
+const size_t Profiler::max_trace_events = 4000000;
+
+double Profiler::now() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int Profiler::region(const char *name) {
+    for (unsigned int i = 0; i < regions.size(); i++)
+        if (regions[i].name == name) return i;
+    Region r = {name, 0.0, 0};
+    regions.push_back(r);
+    return regions.size() - 1;
+}
+
+int Profiler::counter(const char *name) {
+    for (unsigned int i = 0; i < counters.size(); i++)
+        if (counters[i].name == name) return i;
+    Counter c = {name, 0.0};
+    counters.push_back(c);
+    return counters.size() - 1;
+}
+
+double Profiler::count(const char *name) {
+    for (unsigned int i = 0; i < counters.size(); i++)
+        if (counters[i].name == name) return counters[i].value;
+    return 0.0;
+}
+
+void Profiler::add_time(int id, double start, double duration) {
+    regions[id].time += duration;
+    regions[id].calls++;
+    if (trace_enabled && trace.size() < max_trace_events) {
+        TraceEvent e = {id, start, duration};
+        trace.push_back(e);
+    }
+}
+
+/*! Collects the union of "names" over all processes (sorted) */
+static vector<std::string> all_names(const vector<std::string> &names, MPI_Comm comm) {
+    std::string joined;
+    for (unsigned int i = 0; i < names.size(); i++)
+        joined += names[i] + '\n';
+
+    int mpi_size;
+    MPI_Comm_size(comm, &mpi_size);
+    int len = joined.size();
+    vector<int> lens(mpi_size), displs(mpi_size);
+    MPI_Allgather(&len, 1, MPI_INT, &lens[0], 1, MPI_INT, comm);
+    int total = 0;
+    for (int r = 0; r < mpi_size; r++) {
+        displs[r] = total;
+        total += lens[r];
+    }
+    vector<char> buf(total + 1);
+    MPI_Allgatherv(joined.c_str(), len, MPI_CHAR, &buf[0], &lens[0], &displs[0],
+            MPI_CHAR, comm);
+
+    vector<std::string> result;
+    std::string cur;
+    for (int i = 0; i < total; i++) {
+        if (buf[i] == '\n') {
+            result.push_back(cur);
+            cur.clear();
+        } else {
+            cur += buf[i];
+        }
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+/*! Reduces "values" to min, sum and max on root */
+static void reduce_stats(vector<double> &values, vector<double> &min,
+        vector<double> &sum, vector<double> &max, MPI_Comm comm) {
+    int n = values.size();
+    min.resize(n); sum.resize(n); max.resize(n);
+    if (n == 0) return;
+    MPI_Reduce(&values[0], &min[0], n, MPI_DOUBLE, MPI_MIN, 0, comm);
+    MPI_Reduce(&values[0], &sum[0], n, MPI_DOUBLE, MPI_SUM, 0, comm);
+    MPI_Reduce(&values[0], &max[0], n, MPI_DOUBLE, MPI_MAX, 0, comm);
+}
+
+void Profiler::write_report(string filepath, MPI_Comm comm) {
+    int mpi_rank, mpi_size;
+    MPI_Comm_rank(comm, &mpi_rank);
+    MPI_Comm_size(comm, &mpi_size);
+
+    vector<std::string> local_names;
+    for (unsigned int i = 0; i < regions.size(); i++)
+        local_names.push_back(regions[i].name);
+    vector<std::string> region_names = all_names(local_names, comm);
+
+    local_names.clear();
+    for (unsigned int i = 0; i < counters.size(); i++)
+        local_names.push_back(counters[i].name);
+    vector<std::string> counter_names = all_names(local_names, comm);
+
+    // values in the order of the common name lists
+    // (regions missing on a process count as zero)
+    vector<double> times(region_names.size(), 0.0), calls(region_names.size(), 0.0);
+    for (unsigned int k = 0; k < region_names.size(); k++) {
+        for (unsigned int i = 0; i < regions.size(); i++) {
+            if (regions[i].name == region_names[k]) {
+                times[k] = regions[i].time;
+                calls[k] = regions[i].calls;
+            }
+        }
+    }
+    vector<double> values(counter_names.size(), 0.0);
+    for (unsigned int k = 0; k < counter_names.size(); k++)
+        for (unsigned int i = 0; i < counters.size(); i++)
+            if (counters[i].name == counter_names[k]) values[k] = counters[i].value;
+
+    vector<double> wall(1, now() - time_origin);
+
+    vector<double> t_min, t_sum, t_max, c_min, c_sum, c_max, v_min, v_sum, v_max;
+    vector<double> w_min, w_sum, w_max;
+    reduce_stats(times, t_min, t_sum, t_max, comm);
+    reduce_stats(calls, c_min, c_sum, c_max, comm);
+    reduce_stats(values, v_min, v_sum, v_max, comm);
+    reduce_stats(wall, w_min, w_sum, w_max, comm);
+
+    if (mpi_rank != 0) return;
+
+    FILE *fp = fopen(filepath.c_str(), "w");
+    if (fp == NULL) {
+        cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+    fprintf(fp, "{\n  \"processes\": %d,\n", mpi_size);
+    fprintf(fp, "  \"wall_time\": {\"min\": %.6f, \"avg\": %.6f, \"max\": %.6f},\n",
+            w_min[0], w_sum[0]/mpi_size, w_max[0]);
+    fprintf(fp, "  \"regions\": [\n");
+    for (unsigned int k = 0; k < region_names.size(); k++) {
+        double avg = t_sum[k]/mpi_size;
+        fprintf(fp, "    {\"name\": \"%s\", \"calls\": %.0f, "
+                "\"time\": {\"min\": %.6f, \"avg\": %.6f, \"max\": %.6f}, "
+                "\"imbalance\": %.4f}%s\n",
+                region_names[k].c_str(), c_max[k], t_min[k], avg, t_max[k],
+                avg > 0.0 ? t_max[k]/avg : 1.0, k+1 < region_names.size() ? "," : "");
+    }
+    fprintf(fp, "  ],\n  \"counters\": [\n");
+    for (unsigned int k = 0; k < counter_names.size(); k++) {
+        fprintf(fp, "    {\"name\": \"%s\", \"total\": %.6e, "
+                "\"min\": %.6e, \"avg\": %.6e, \"max\": %.6e}%s\n",
+                counter_names[k].c_str(), v_sum[k], v_min[k], v_sum[k]/mpi_size, v_max[k],
+                k+1 < counter_names.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+    fclose(fp);
+}
+
+void Profiler::write_trace(string filepath, int mpi_rank) {
+    FILE *fp = fopen(filepath.c_str(), "w");
+    if (fp == NULL) {
+        cerr << "Error: couldn't open " << filepath << endl;
+        return;
+    }
+    fprintf(fp, "{\"traceEvents\": [\n");
+    for (size_t e = 0; e < trace.size(); e++) {
+        fprintf(fp, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": 0, "
+                "\"ts\": %.3f, \"dur\": %.3f}%s\n",
+                regions[trace[e].region].name.c_str(), mpi_rank,
+                (trace[e].start - time_origin)*1.0e6, trace[e].duration*1.0e6,
+                e+1 < trace.size() ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+}
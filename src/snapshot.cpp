@@ -0,0 +1,532 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <mpi.h>
+#include <zlib.h>
+
+#include "snapshot.h"
+
+/*
+ *  Snapshot file layout (all values in native byte order):
+ *
+ *  char[8]   magic "PFCSNAP1"
+ *  uint32    format version
+ *  uint32    size of the parameter block
+ *  ...       parameter block (grid, dx/dy, time, model parameters, q vectors,
+ *            precision and the delta reference file name)
+ *  uint32    number of chunks
+ *  ...       chunk table: int32 component, row_start, row_count, pad;
+ *            uint64 offset, size
+ *  ...       compressed chunks
+ *
+ *  A chunk holds rows [row_start, row_start+row_count) of one component as
+ *  alternating real and imaginary parts. Every value is converted to a word
+ *  (double bits, float bits or a quantized integer), optionally delta
+ *  encoded against the words of the same chunk in the reference file
+ *  (xor for floating point words, difference for integers), byte-shuffled
+ *  and compressed with zlib.
+ */
+
+static const char snapshot_magic[8] = {'P', 'F', 'C', 'S', 'N', 'A', 'P', '1'};
+static const uint32_t snapshot_version = 1;
+static const int chunk_entry_bytes = 32;
+
+
+// ---------------------------------------------------------------
+// Serialization helpers
+
+template <typename T>
+static void put(vector<char> &buf, T value) {
+    const char *p = reinterpret_cast<const char*>(&value);
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+template <typename T>
+static T get(const char *buf, size_t &pos) {
+    T value;
+    std::memcpy(&value, buf + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+static void serialize_header(vector<char> &buf, const SnapshotHeader &h) {
+    vector<char> block;
+    put<int32_t>(block, h.nx); put<int32_t>(block, h.ny); put<int32_t>(block, h.nc);
+    put<double>(block, h.dx); put<double>(block, h.dy); put<double>(block, h.dt);
+    put<int32_t>(block, h.timestep); put<double>(block, h.time);
+    put<double>(block, h.bx); put<double>(block, h.bl);
+    put<double>(block, h.tt); put<double>(block, h.vv);
+    for (int i = 0; i < 2*h.nc; i++)
+        put<double>(block, (size_t) i < h.q_vec.size() ? h.q_vec[i] : 0.0);
+    put<int32_t>(block, h.precision); put<double>(block, h.error_bound);
+    put<uint32_t>(block, h.reference.size());
+    block.insert(block.end(), h.reference.begin(), h.reference.end());
+
+    buf.insert(buf.end(), snapshot_magic, snapshot_magic + 8);
+    put<uint32_t>(buf, snapshot_version);
+    put<uint32_t>(buf, block.size());
+    buf.insert(buf.end(), block.begin(), block.end());
+}
+
+static void deserialize_header(const char *block, SnapshotHeader &h) {
+    size_t pos = 0;
+    h.nx = get<int32_t>(block, pos); h.ny = get<int32_t>(block, pos);
+    h.nc = get<int32_t>(block, pos);
+    h.dx = get<double>(block, pos); h.dy = get<double>(block, pos);
+    h.dt = get<double>(block, pos);
+    h.timestep = get<int32_t>(block, pos); h.time = get<double>(block, pos);
+    h.bx = get<double>(block, pos); h.bl = get<double>(block, pos);
+    h.tt = get<double>(block, pos); h.vv = get<double>(block, pos);
+    h.q_vec.resize(2*h.nc);
+    for (int i = 0; i < 2*h.nc; i++)
+        h.q_vec[i] = get<double>(block, pos);
+    h.precision = get<int32_t>(block, pos); h.error_bound = get<double>(block, pos);
+    uint32_t ref_len = get<uint32_t>(block, pos);
+    h.reference.assign(block + pos, ref_len);
+}
+
+static std::string directory_of(const string &filepath) {
+    size_t slash = filepath.find_last_of('/');
+    return (slash == string::npos) ? "" : filepath.substr(0, slash+1);
+}
+
+static std::string basename_of(const string &filepath) {
+    size_t slash = filepath.find_last_of('/');
+    return (slash == string::npos) ? filepath : filepath.substr(slash+1);
+}
+
+
+// ---------------------------------------------------------------
+// Chunk encoding
+
+static int word_size(int precision) {
+    return (precision == SNAPSHOT_FLOAT) ? 4 : 8;
+}
+
+static void values_to_words(const double *values, size_t n, int precision,
+        double error_bound, uint64_t *words) {
+    if (precision == SNAPSHOT_DOUBLE) {
+        std::memcpy(words, values, n*sizeof(double));
+    } else if (precision == SNAPSHOT_FLOAT) {
+        for (size_t i = 0; i < n; i++) {
+            float f = (float) values[i];
+            uint32_t bits;
+            std::memcpy(&bits, &f, sizeof(float));
+            words[i] = bits;
+        }
+    } else {
+        double scale = 0.5/error_bound;
+        for (size_t i = 0; i < n; i++)
+            words[i] = (uint64_t) (int64_t) std::llround(values[i]*scale);
+    }
+}
+
+static void words_to_values(const uint64_t *words, size_t n, int precision,
+        double error_bound, double *values) {
+    if (precision == SNAPSHOT_DOUBLE) {
+        std::memcpy(values, words, n*sizeof(double));
+    } else if (precision == SNAPSHOT_FLOAT) {
+        for (size_t i = 0; i < n; i++) {
+            uint32_t bits = (uint32_t) words[i];
+            float f;
+            std::memcpy(&f, &bits, sizeof(float));
+            values[i] = f;
+        }
+    } else {
+        for (size_t i = 0; i < n; i++)
+            values[i] = (int64_t) words[i] * 2.0*error_bound;
+    }
+}
+
+static void apply_delta(vector<uint64_t> &words, const vector<uint64_t> &ref,
+        int precision, bool encode) {
+    if (precision == SNAPSHOT_QUANTIZED) {
+        for (size_t i = 0; i < words.size(); i++)
+            words[i] = encode ? words[i] - ref[i] : words[i] + ref[i];
+    } else {
+        for (size_t i = 0; i < words.size(); i++)
+            words[i] ^= ref[i];
+    }
+}
+
+/*! Groups the k-th bytes of all words together, so that the slowly changing
+ *  high bytes (sign, exponent) form long compressible runs
+ */
+static void shuffle_words(const vector<uint64_t> &words, int wsize, vector<unsigned char> &out) {
+    size_t n = words.size();
+    out.resize(n*wsize);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = words[i];
+        for (int b = 0; b < wsize; b++)
+            out[b*n + i] = (unsigned char) (w >> (8*b));
+    }
+}
+
+static void unshuffle_words(const vector<unsigned char> &in, int wsize, vector<uint64_t> &words) {
+    size_t n = words.size();
+    for (size_t i = 0; i < n; i++) {
+        uint64_t w = 0;
+        for (int b = 0; b < wsize; b++)
+            w |= (uint64_t) in[b*n + i] << (8*b);
+        words[i] = w;
+    }
+}
+
+static void compress_words(const vector<uint64_t> &words, int wsize, int level,
+        vector<unsigned char> &out) {
+    vector<unsigned char> shuffled;
+    shuffle_words(words, wsize, shuffled);
+    uLongf out_len = compressBound(shuffled.size());
+    out.resize(out_len);
+    compress2(&out[0], &out_len, &shuffled[0], shuffled.size(), level);
+    out.resize(out_len);
+}
+
+static bool decompress_words(const vector<unsigned char> &in, int wsize,
+        vector<uint64_t> &words) {
+    vector<unsigned char> shuffled(words.size()*wsize);
+    uLongf len = shuffled.size();
+    if (uncompress(&shuffled[0], &len, &in[0], in.size()) != Z_OK
+            || len != shuffled.size())
+        return false;
+    unshuffle_words(shuffled, wsize, words);
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+// Writer
+
+SnapshotWriter::SnapshotWriter(MPI_Comm comm_, SnapshotOptions options_)
+        : comm(comm_), options(options_), count(0) {}
+
+void SnapshotWriter::set_options(SnapshotOptions options_) {
+    options = options_;
+    // the next snapshot can't refer to data encoded with other options
+    count = 0;
+    prev_words.clear();
+}
+
+uint64_t SnapshotWriter::write(string filepath, SnapshotHeader &header,
+        complex<double> **fields, int local_nx, int local_nx_start) {
+
+    int mpi_rank;
+    MPI_Comm_rank(comm, &mpi_rank);
+
+    int ny = header.ny;
+    int rows_per_chunk = options.chunk_bytes/(ny*sizeof(complex<double>));
+    if (rows_per_chunk < 1) rows_per_chunk = 1;
+
+    bool keyframe = !options.delta || options.keyframe_interval <= 1
+                    || count % options.keyframe_interval == 0;
+
+    header.precision = options.precision;
+    header.error_bound = options.error_bound;
+    header.reference = keyframe ? "" : last_filename;
+
+    // Encode and compress the local chunks
+    vector<SnapshotChunk> chunks;
+    vector< vector<unsigned char> > compressed;
+    vector< vector<uint64_t> > cur_words;
+    int wsize = word_size(options.precision);
+
+    for (int c = 0; c < header.nc; c++) {
+        for (int r = 0; r < local_nx; r += rows_per_chunk) {
+            int rows = std::min(rows_per_chunk, local_nx - r);
+            size_t n = (size_t) rows*ny*2;
+
+            vector<uint64_t> words(n);
+            values_to_words(reinterpret_cast<double*>(fields[c] + (size_t) r*ny), n,
+                    options.precision, options.error_bound, &words[0]);
+            cur_words.push_back(words);
+
+            if (!keyframe)
+                apply_delta(words, prev_words[chunks.size()], options.precision, true);
+
+            SnapshotChunk chunk;
+            chunk.component = c;
+            chunk.row_start = local_nx_start + r;
+            chunk.row_count = rows;
+            chunk.offset = 0;
+
+            compressed.push_back(vector<unsigned char>());
+            compress_words(words, wsize, options.compression_level, compressed.back());
+            chunk.size = compressed.back().size();
+            chunks.push_back(chunk);
+        }
+    }
+
+    // Offsets of the local data and the size of the header and chunk table
+    uint64_t local_bytes = 0;
+    for (unsigned int k = 0; k < chunks.size(); k++)
+        local_bytes += chunks[k].size;
+    uint64_t local_offset = 0;
+    MPI_Exscan(&local_bytes, &local_offset, 1, MPI_UINT64_T, MPI_SUM, comm);
+    if (mpi_rank == 0) local_offset = 0;
+
+    int local_nchunks = chunks.size(), nchunks = 0;
+    MPI_Allreduce(&local_nchunks, &nchunks, 1, MPI_INT, MPI_SUM, comm);
+
+    vector<char> head;
+    serialize_header(head, header);
+    put<uint32_t>(head, nchunks);
+    uint64_t data_start = head.size() + (uint64_t) nchunks*chunk_entry_bytes;
+
+    vector<char> entries;
+    uint64_t pos = data_start + local_offset;
+    for (unsigned int k = 0; k < chunks.size(); k++) {
+        chunks[k].offset = pos;
+        pos += chunks[k].size;
+        put<int32_t>(entries, chunks[k].component);
+        put<int32_t>(entries, chunks[k].row_start);
+        put<int32_t>(entries, chunks[k].row_count);
+        put<int32_t>(entries, 0);
+        put<uint64_t>(entries, chunks[k].offset);
+        put<uint64_t>(entries, chunks[k].size);
+    }
+
+    // Collect the chunk table to root. Rank order equals offset order, but the
+    // table is sorted by component for convenient sequential reading.
+    int mpi_size;
+    MPI_Comm_size(comm, &mpi_size);
+    int entries_bytes = entries.size();
+    vector<int> counts(mpi_size), displs(mpi_size);
+    MPI_Gather(&entries_bytes, 1, MPI_INT, &counts[0], 1, MPI_INT, 0, comm);
+    vector<char> table;
+    if (mpi_rank == 0) {
+        int total = 0;
+        for (int r = 0; r < mpi_size; r++) {
+            displs[r] = total;
+            total += counts[r];
+        }
+        table.resize(total);
+    }
+    MPI_Gatherv(entries.empty() ? NULL : &entries[0], entries_bytes, MPI_BYTE,
+            table.empty() ? NULL : &table[0], &counts[0], &displs[0], MPI_BYTE, 0, comm);
+
+    if (mpi_rank == 0) {
+        vector<char> sorted;
+        for (int c = 0; c < header.nc; c++) {
+            for (size_t e = 0; e < table.size(); e += chunk_entry_bytes) {
+                size_t p = e;
+                if (get<int32_t>(&table[0], p) == c)
+                    sorted.insert(sorted.end(), table.begin() + e,
+                            table.begin() + e + chunk_entry_bytes);
+            }
+        }
+        head.insert(head.end(), sorted.begin(), sorted.end());
+    }
+
+    vector<unsigned char> data(local_bytes);
+    uint64_t data_pos = 0;
+    for (unsigned int k = 0; k < compressed.size(); k++) {
+        std::memcpy(&data[data_pos], &compressed[k][0], compressed[k].size());
+        data_pos += compressed[k].size();
+    }
+
+    MPI_File mpi_file;
+    int rcode = MPI_File_open(comm, filepath.c_str(),
+            MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &mpi_file);
+    if (rcode != MPI_SUCCESS) {
+        cerr << "Error: couldn't open file " << filepath << endl;
+        return 0;
+    }
+    MPI_File_set_size(mpi_file, 0);
+
+    if (mpi_rank == 0) {
+        rcode = MPI_File_write_at(mpi_file, 0, &head[0], head.size(), MPI_BYTE,
+                MPI_STATUS_IGNORE);
+        if (rcode != MPI_SUCCESS)
+            cerr << "Error: couldn't write snapshot header" << endl;
+    }
+    rcode = MPI_File_write_at_all(mpi_file, data_start + local_offset,
+            data.empty() ? NULL : &data[0], local_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+    if (rcode != MPI_SUCCESS)
+        cerr << "Error: couldn't write snapshot data" << endl;
+
+    MPI_File_close(&mpi_file);
+
+    prev_words.swap(cur_words);
+    last_filename = basename_of(filepath);
+    count++;
+
+    uint64_t total_bytes = 0;
+    MPI_Allreduce(&local_bytes, &total_bytes, 1, MPI_UINT64_T, MPI_SUM, comm);
+    return total_bytes + data_start;
+}
+
+
+// ---------------------------------------------------------------
+// Reader
+
+bool is_snapshot_file(string filepath) {
+    char magic[8] = {0};
+    FILE *fp = fopen(filepath.c_str(), "rb");
+    if (fp == NULL) return false;
+    size_t n = fread(magic, 1, 8, fp);
+    fclose(fp);
+    return n == 8 && std::memcmp(magic, snapshot_magic, 8) == 0;
+}
+
+/*! Reads the header and chunk table on root and broadcasts them */
+static bool read_header_and_table(MPI_File mpi_file, MPI_Comm comm, SnapshotHeader &header,
+        vector<SnapshotChunk> &chunks) {
+    int mpi_rank;
+    MPI_Comm_rank(comm, &mpi_rank);
+
+    vector<char> head;
+    uint32_t head_bytes = 0;
+    if (mpi_rank == 0) {
+        char start[16];
+        MPI_File_read_at(mpi_file, 0, start, 16, MPI_BYTE, MPI_STATUS_IGNORE);
+        size_t pos = 8;
+        uint32_t version = get<uint32_t>(start, pos);
+        uint32_t block_bytes = get<uint32_t>(start, pos);
+        if (std::memcmp(start, snapshot_magic, 8) == 0 && version == snapshot_version) {
+            uint32_t nchunks;
+            MPI_File_read_at(mpi_file, 16 + block_bytes, &nchunks, 4, MPI_BYTE,
+                    MPI_STATUS_IGNORE);
+            head_bytes = 16 + block_bytes + 4 + nchunks*chunk_entry_bytes;
+            head.resize(head_bytes);
+            MPI_File_read_at(mpi_file, 0, &head[0], head_bytes, MPI_BYTE, MPI_STATUS_IGNORE);
+        }
+    }
+    MPI_Bcast(&head_bytes, 1, MPI_UINT32_T, 0, comm);
+    if (head_bytes == 0) return false;
+    head.resize(head_bytes);
+    MPI_Bcast(&head[0], head_bytes, MPI_BYTE, 0, comm);
+
+    size_t pos = 12;
+    uint32_t block_bytes = get<uint32_t>(&head[0], pos);
+    deserialize_header(&head[16], header);
+    pos = 16 + block_bytes;
+    uint32_t nchunks = get<uint32_t>(&head[0], pos);
+    chunks.resize(nchunks);
+    for (uint32_t k = 0; k < nchunks; k++) {
+        chunks[k].component = get<int32_t>(&head[0], pos);
+        chunks[k].row_start = get<int32_t>(&head[0], pos);
+        chunks[k].row_count = get<int32_t>(&head[0], pos);
+        get<int32_t>(&head[0], pos);
+        chunks[k].offset = get<uint64_t>(&head[0], pos);
+        chunks[k].size = get<uint64_t>(&head[0], pos);
+    }
+    return true;
+}
+
+bool read_snapshot_header(string filepath, MPI_Comm comm, SnapshotHeader &header,
+        vector<SnapshotChunk> *chunks) {
+    MPI_File mpi_file;
+    int rcode = MPI_File_open(comm, filepath.c_str(), MPI_MODE_RDONLY,
+            MPI_INFO_NULL, &mpi_file);
+    if (rcode != MPI_SUCCESS) {
+        cerr << "Error: couldn't open file " << filepath << endl;
+        return false;
+    }
+    vector<SnapshotChunk> table;
+    bool ok = read_header_and_table(mpi_file, comm, header, table);
+    MPI_File_close(&mpi_file);
+    if (!ok) cerr << "Error: " << filepath << " is not a snapshot file" << endl;
+    if (chunks != NULL) chunks->swap(table);
+    return ok;
+}
+
+/*! Reads and decodes the words of the chunks with the wanted geometry
+ *
+ *  Collective, as delta chains are followed through the reference files.
+ */
+static bool load_chunk_words(string filepath, MPI_Comm comm,
+        const vector<SnapshotChunk> &wanted, vector< vector<uint64_t> > &words,
+        SnapshotHeader &header) {
+    MPI_File mpi_file;
+    int rcode = MPI_File_open(comm, filepath.c_str(), MPI_MODE_RDONLY,
+            MPI_INFO_NULL, &mpi_file);
+    if (rcode != MPI_SUCCESS) {
+        cerr << "Error: couldn't open file " << filepath << endl;
+        return false;
+    }
+    vector<SnapshotChunk> chunks;
+    if (!read_header_and_table(mpi_file, comm, header, chunks)) {
+        cerr << "Error: " << filepath << " is not a snapshot file" << endl;
+        MPI_File_close(&mpi_file);
+        return false;
+    }
+
+    bool ok = true;
+    vector< vector<uint64_t> > ref_words;
+    if (!header.reference.empty()) {
+        SnapshotHeader ref_header;
+        ok = load_chunk_words(directory_of(filepath) + header.reference, comm,
+                wanted, ref_words, ref_header);
+    }
+
+    int wsize = word_size(header.precision);
+    words.resize(wanted.size());
+    for (unsigned int w = 0; w < wanted.size() && ok; w++) {
+        const SnapshotChunk *chunk = NULL;
+        for (unsigned int k = 0; k < chunks.size(); k++) {
+            if (chunks[k].component == wanted[w].component
+                    && chunks[k].row_start == wanted[w].row_start
+                    && chunks[k].row_count == wanted[w].row_count)
+                chunk = &chunks[k];
+        }
+        if (chunk == NULL) {
+            cerr << "Error: chunk layout of " << filepath << " doesn't match" << endl;
+            ok = false;
+            break;
+        }
+        vector<unsigned char> data(chunk->size);
+        MPI_File_read_at(mpi_file, chunk->offset, &data[0], chunk->size, MPI_BYTE,
+                MPI_STATUS_IGNORE);
+        words[w].resize((size_t) chunk->row_count*header.ny*2);
+        if (!decompress_words(data, wsize, words[w])) {
+            cerr << "Error: corrupt chunk in " << filepath << endl;
+            ok = false;
+            break;
+        }
+        if (!header.reference.empty())
+            apply_delta(words[w], ref_words[w], header.precision, false);
+    }
+    MPI_File_close(&mpi_file);
+    return ok;
+}
+
+bool read_snapshot(string filepath, MPI_Comm comm, complex<double> **fields,
+        int local_nx, int local_nx_start, SnapshotHeader &header) {
+
+    vector<SnapshotChunk> chunks;
+    if (!read_snapshot_header(filepath, comm, header, &chunks))
+        return false;
+
+    // chunks overlapping the local rows
+    vector<SnapshotChunk> wanted;
+    for (unsigned int k = 0; k < chunks.size(); k++) {
+        if (chunks[k].row_start < local_nx_start + local_nx
+                && chunks[k].row_start + chunks[k].row_count > local_nx_start)
+            wanted.push_back(chunks[k]);
+    }
+
+    vector< vector<uint64_t> > words;
+    bool ok = load_chunk_words(filepath, comm, wanted, words, header);
+
+    int ny = header.ny;
+    vector<double> values;
+    for (unsigned int w = 0; w < wanted.size() && ok; w++) {
+        const SnapshotChunk &chunk = wanted[w];
+        values.resize(words[w].size());
+        words_to_values(&words[w][0], words[w].size(), header.precision,
+                header.error_bound, &values[0]);
+        int first = std::max(chunk.row_start, local_nx_start);
+        int last = std::min(chunk.row_start + chunk.row_count, local_nx_start + local_nx);
+        double *dest = reinterpret_cast<double*>(fields[chunk.component]);
+        std::memcpy(dest + (size_t) (first - local_nx_start)*ny*2,
+                &values[(size_t) (first - chunk.row_start)*ny*2],
+                sizeof(double)*(last - first)*ny*2);
+    }
+
+    int local_ok = ok, all_ok = 0;
+    MPI_Allreduce(&local_ok, &all_ok, 1, MPI_INT, MPI_MIN, comm);
+    return all_ok;
+}
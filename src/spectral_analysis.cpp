@@ -0,0 +1,113 @@
+
+#include <iostream>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include "spectral_analysis.h"
+
+#include "pfc.h"
+#include "profiler.h"
+
+SpectralAnalysis::SpectralAnalysis(PhaseField *pfc)
+        : pfc(pfc) {}
+
+SpectralStatistics SpectralAnalysis::calculate_spectra() {
+    PROFILE_SCOPE("spectral_analysis");
+    int nc = pfc->nc, nx = pfc->nx, ny = pfc->ny, local_nx = pfc->local_nx;
+
+    complex<double> **field_k = pfc->eta_k;
+    if (pfc->fd.active()) {
+        // the finite-difference backend doesn't keep eta_k
+        for (int c = 0; c < nc; c++)
+            for (int n = 0; n < local_nx*ny; n++)
+                pfc->buffer[c][n] = pfc->eta[c][n];
+        pfc->take_fft(pfc->buffer_plan_f);
+        field_k = pfc->buffer_k;
+    } else {
+        pfc->update_k(pfc->eta);
+    }
+
+    SpectralStatistics stats;
+    stats.dk = std::max(2*PI/(nx*pfc->dx), 2*PI/(ny*pfc->dy));
+    double k_max = std::sqrt(PI*PI/(pfc->dx*pfc->dx) + PI*PI/(pfc->dy*pfc->dy));
+    int nbins = (int) (k_max/stats.dk) + 1;
+
+    // power and mode count of the bins, then W, sum |k| S, sum k_a k_b S
+    vector<double> sums(2*nbins + 5, 0.0);
+    double *power = &sums[0], *count = &sums[nbins], *moments = &sums[2*nbins];
+    double scale = 1.0/((double) nx*ny);
+    for (int i = 0; i < local_nx; i++) {
+        double kx = pfc->k_x_values[i + pfc->local_nx_start];
+        for (int j = 0; j < ny; j++) {
+            double ky = pfc->k_y_values[j];
+            double s = 0.0;
+            for (int c = 0; c < nc; c++)
+                s += norm(field_k[c][i*ny + j]);
+            s *= scale;
+            double k = std::sqrt(kx*kx + ky*ky);
+            int b = std::min((int) (k/stats.dk), nbins - 1);
+            power[b] += s;
+            count[b] += 1.0;
+            if (k == 0.0) continue;
+            moments[0] += s;
+            moments[1] += k*s;
+            moments[2] += kx*kx*s;
+            moments[3] += kx*ky*s;
+            moments[4] += ky*ky*s;
+        }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, &sums[0], sums.size(), MPI_DOUBLE, MPI_SUM, pfc->comm);
+
+    stats.spectrum.resize(nbins);
+    for (int b = 0; b < nbins; b++)
+        stats.spectrum[b] = count[b] > 0.0 ? power[b]/count[b] : 0.0;
+
+    // no power at k != 0 (uniform liquid or a perfect crystal)
+    stats.k_mean = stats.k_rms = stats.length = stats.anisotropy = stats.axis = 0.0;
+    if (moments[0] > 0.0) {
+        double w = moments[0];
+        double mxx = moments[2]/w, mxy = moments[3]/w, myy = moments[4]/w;
+        stats.k_mean = moments[1]/w;
+        stats.k_rms = std::sqrt(mxx + myy);
+        stats.length = 2*PI/stats.k_mean;
+        stats.anisotropy = std::sqrt((mxx - myy)*(mxx - myy) + 4*mxy*mxy)/(mxx + myy);
+        stats.axis = 0.5*std::atan2(2*mxy, mxx - myy);
+    }
+    return stats;
+}
+
+SpectralStatistics SpectralAnalysis::write_spectra(string spectra_filepath,
+        string stats_filepath, int timestep) {
+    SpectralStatistics stats = calculate_spectra();
+
+    if (pfc->mpi_rank == 0) {
+        FILE *fp = fopen(spectra_filepath.c_str(), "a");
+        if (fp == NULL) {
+            cerr << "Error: couldn't open " << spectra_filepath << endl;
+        } else {
+            // a new file starts with the bin centres
+            if (ftell(fp) == 0) {
+                fprintf(fp, "# k");
+                for (size_t b = 0; b < stats.spectrum.size(); b++)
+                    fprintf(fp, " %.6e", (b + 0.5)*stats.dk);
+                fprintf(fp, "\n");
+            }
+            fprintf(fp, "%d", timestep);
+            for (size_t b = 0; b < stats.spectrum.size(); b++)
+                fprintf(fp, " %.6e", stats.spectrum[b]);
+            fprintf(fp, "\n");
+            fclose(fp);
+        }
+        fp = fopen(stats_filepath.c_str(), "a");
+        if (fp != NULL) {
+            fprintf(fp, "%d %.2f %.6e %.6e %.6e %.6f %.4f\n", timestep, timestep*pfc->dt,
+                    stats.k_mean, stats.k_rms, stats.length, stats.anisotropy,
+                    stats.axis*180.0/PI);
+            fclose(fp);
+        }
+    }
+    return stats;
+}